@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <vector>
+
+// Epoch-based reclamation for single-writer, many-reader structures.
+//
+// A reader pins the current epoch for the duration of one operation; the
+// writer unlinks an object (so no reader that pins later can reach it),
+// retires it, and frees it once every reader that was pinned at the time has
+// unpinned. Pins are announced in a fixed table of slots, so pinning costs a
+// compare-and-swap on a slot the thread usually owns alone and never
+// allocates. retire() and reclaim() must be called by one writer at a time.
+class EpochManager {
+   public:
+    // Concurrent pins beyond this many wait for a free slot.
+    static constexpr size_t kSlots = 256;
+
+    // RAII pin; readers keep it alive while they use objects they loaded.
+    class Guard {
+       public:
+        explicit Guard(std::atomic<uint64_t>* slot) : slot_(slot) {}
+        Guard(Guard&& other) noexcept : slot_(other.slot_) {
+            other.slot_ = nullptr;
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        ~Guard() {
+            if (slot_) slot_->store(kIdle);
+        }
+
+       private:
+        std::atomic<uint64_t>* slot_;
+    };
+
+    EpochManager() {
+        for (auto& slot : slots_) slot.epoch.store(kIdle);
+    }
+
+    ~EpochManager() {
+        for (auto& r : retired_) r.free();
+    }
+
+    Guard pin() {
+        // Start from a per-thread slot so pins rarely contend.
+        static thread_local size_t hint =
+            std::hash<std::thread::id>()(std::this_thread::get_id());
+        for (size_t i = hint;; ++i) {
+            auto& slot = slots_[i % kSlots].epoch;
+            uint64_t idle = kIdle;
+            if (slot.load(std::memory_order_relaxed) == kIdle &&
+                slot.compare_exchange_strong(idle, epoch_.load())) {
+                hint = i % kSlots;
+                return Guard(&slot);
+            }
+            if ((i - hint + 1) % kSlots == 0) std::this_thread::yield();
+        }
+    }
+
+    // Frees p with free_fn once no reader pinned before this call remains.
+    void retire(void* p, void (*free_fn)(void*)) {
+        retired_.push_back({epoch_.load(), p, free_fn});
+    }
+
+    // Advances the epoch and frees every retired object that no pinned
+    // reader can still hold.
+    void reclaim() {
+        epoch_.fetch_add(1);
+        uint64_t oldest = kIdle;
+        for (auto& slot : slots_) {
+            uint64_t e = slot.epoch.load();
+            if (e < oldest) oldest = e;
+        }
+        size_t kept = 0;
+        for (auto& r : retired_) {
+            if (r.epoch < oldest)
+                r.free();
+            else
+                retired_[kept++] = r;
+        }
+        retired_.resize(kept);
+    }
+
+   private:
+    static constexpr uint64_t kIdle = std::numeric_limits<uint64_t>::max();
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch;
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        void* p;
+        void (*free_fn)(void*);
+        void free() { free_fn(p); }
+    };
+
+    std::atomic<uint64_t> epoch_{0};
+    Slot slots_[kSlots];
+    std::vector<Retired> retired_;
+};
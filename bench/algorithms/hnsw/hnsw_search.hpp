@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "../index.hpp"
+#include "hnswlib/hnswlib/hnswlib.h"
+
+// Allocation-free k-NN search over a hnswlib graph, used by the HNSW adapters
+// in place of HierarchicalNSW::searchKnn.
+//
+// searchKnn builds two std::priority_queues per query and hands the results
+// back in a third, which the adapters then unpacked into a vector. The
+// searches here descend the upper layers greedily and then run an ef-bounded
+// best-first search of layer 0, like searchKnn, but their working set lives
+// in a per-thread HNSWSearchScratch that is sized on first use and reused by
+// every later query, and the results are written straight into the caller's
+// row. Two layer-0 loops are provided, selected by QParams::search_loop:
+//
+//   hnsw_search_heap    searchKnn's loop, over binary heaps in the scratch.
+//   hnsw_search_linear  a DiskANN-style candidate list: the ef nearest nodes
+//                       seen so far in one sorted array, each with an
+//                       "expanded" bit, so the next node to expand is found by
+//                       a cursor rather than a heap pop. Unvisited neighbors
+//                       of a node are gathered and prefetched first, then
+//                       their distances are computed in one pass.
+//
+// Like searchKnn they read the graph without taking locks, so they may run
+// concurrently with addPoint.
+
+template <typename dist_t>
+struct HNSWSearchScratch {
+    using Entry = std::pair<dist_t, hnswlib::tableint>;
+
+    // One slot of the linear candidate list.
+    struct Candidate {
+        dist_t distance;
+        hnswlib::tableint id;
+        bool expanded;
+    };
+
+    std::vector<Entry> candidates;  // heap loop: min-heap on distance
+    std::vector<Entry> top;         // heap loop: max-heap, at most ef
+    std::vector<Candidate> pool;    // linear loop: sorted, at most ef
+    // Linear loop: unvisited neighbors of the node being expanded.
+    std::vector<hnswlib::tableint> batch_ids;
+    std::vector<dist_t> batch_dists;
+    // visited[id] == epoch marks id as seen by the current query; bumping
+    // the epoch clears the whole array at once.
+    std::vector<uint16_t> visited;
+    uint16_t epoch = 0;
+
+    void begin_query(size_t max_elements, size_t ef) {
+        if (visited.size() < max_elements) visited.resize(max_elements, 0);
+        if (++epoch == 0) {
+            std::fill(visited.begin(), visited.end(), 0);
+            epoch = 1;
+        }
+        candidates.clear();
+        top.clear();
+        pool.clear();
+        if (top.capacity() < ef + 1) {
+            top.reserve(ef + 1);
+            candidates.reserve(4 * ef);
+            pool.reserve(ef);
+        }
+    }
+
+    // Sizes the neighbor batch for lists of up to max_degree entries.
+    void reserve_batch(size_t max_degree) {
+        if (batch_ids.size() < max_degree) {
+            batch_ids.resize(max_degree);
+            batch_dists.resize(max_degree);
+        }
+    }
+
+    bool visit(hnswlib::tableint id) {
+        if (visited[id] == epoch) return false;
+        visited[id] = epoch;
+        return true;
+    }
+};
+
+// Greedy descent from the entry point through the upper layers; returns the
+// node of layer 1 closest to query, with its distance in cur_dist.
+template <typename dist_t>
+hnswlib::tableint hnsw_descend(const hnswlib::HierarchicalNSW<dist_t>& index,
+                               const void* query, dist_t& cur_dist) {
+    hnswlib::tableint cur = index.enterpoint_node_;
+    cur_dist = index.fstdistfunc_(query, index.getDataByInternalId(cur),
+                                  index.dist_func_param_);
+    for (int level = index.maxlevel_; level > 0; level--) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            hnswlib::linklistsizeint* list = index.get_linklist(cur, level);
+            size_t size = index.getListCount(list);
+            auto* neighbors = reinterpret_cast<hnswlib::tableint*>(list + 1);
+            for (size_t i = 0; i < size; i++) {
+                dist_t d = index.fstdistfunc_(
+                    query, index.getDataByInternalId(neighbors[i]),
+                    index.dist_func_param_);
+                if (d < cur_dist) {
+                    cur_dist = d;
+                    cur = neighbors[i];
+                    changed = true;
+                }
+            }
+        }
+    }
+    return cur;
+}
+
+// Searches query in index with beam width max(ef, k) using searchKnn's heap
+// loop and writes up to k results, nearest first, to tags and (unless null)
+// distances; the rest of the row is padded by clear_result_row(). Returns
+// the number of results.
+template <typename dist_t, typename TagT>
+size_t hnsw_search_heap(const hnswlib::HierarchicalNSW<dist_t>& index,
+                        const void* query, size_t k, size_t ef,
+                        HNSWSearchScratch<dist_t>& scratch, TagT* tags,
+                        float* distances) {
+    using Entry = typename HNSWSearchScratch<dist_t>::Entry;
+    if (index.cur_element_count == 0 || k == 0) {
+        clear_result_row(tags, distances, 0, k);
+        return 0;
+    }
+    dist_t cur_dist;
+    hnswlib::tableint cur = hnsw_descend(index, query, cur_dist);
+
+    ef = std::max(ef, k);
+    scratch.begin_query(index.max_elements_, ef);
+    auto& candidates = scratch.candidates;
+    auto& top = scratch.top;
+    std::greater<Entry> min_first;
+    bool has_deletions = index.num_deleted_ > 0;
+    auto allowed = [&](hnswlib::tableint id) {
+        return !has_deletions || !index.isMarkedDeleted(id);
+    };
+
+    dist_t lower_bound = std::numeric_limits<dist_t>::max();
+    if (allowed(cur)) {
+        top.emplace_back(cur_dist, cur);
+        lower_bound = cur_dist;
+    }
+    candidates.emplace_back(cur_dist, cur);
+    scratch.visit(cur);
+
+    while (!candidates.empty()) {
+        Entry current = candidates.front();
+        if (current.first > lower_bound &&
+            (top.size() == ef || !has_deletions))
+            break;
+        std::pop_heap(candidates.begin(), candidates.end(), min_first);
+        candidates.pop_back();
+
+        hnswlib::linklistsizeint* list = index.get_linklist0(current.second);
+        size_t size = index.getListCount(list);
+        auto* neighbors = reinterpret_cast<hnswlib::tableint*>(list + 1);
+        for (size_t i = 0; i < size; i++) {
+            hnswlib::tableint id = neighbors[i];
+            if (!scratch.visit(id)) continue;
+            dist_t d = index.fstdistfunc_(query, index.getDataByInternalId(id),
+                                          index.dist_func_param_);
+            if (top.size() < ef || d < lower_bound) {
+                candidates.emplace_back(d, id);
+                std::push_heap(candidates.begin(), candidates.end(),
+                               min_first);
+                if (allowed(id)) {
+                    top.emplace_back(d, id);
+                    std::push_heap(top.begin(), top.end());
+                    if (top.size() > ef) {
+                        std::pop_heap(top.begin(), top.end());
+                        top.pop_back();
+                    }
+                }
+                if (!top.empty()) lower_bound = top.front().first;
+            }
+        }
+    }
+
+    std::sort_heap(top.begin(), top.end());
+    size_t found = std::min(k, top.size());
+    for (size_t j = 0; j < found; ++j) {
+        tags[j] = static_cast<TagT>(index.getExternalLabel(top[j].second));
+        if (distances) distances[j] = top[j].first;
+    }
+    clear_result_row(tags, distances, found, k);
+    return found;
+}
+
+// Same contract as hnsw_search_heap, using the linear candidate list. Deleted
+// nodes stay in the list so the search can route through them, and are
+// skipped when the results are written; with many deletions a row can come
+// back shorter than the heap loop's.
+template <typename dist_t, typename TagT>
+size_t hnsw_search_linear(const hnswlib::HierarchicalNSW<dist_t>& index,
+                          const void* query, size_t k, size_t ef,
+                          HNSWSearchScratch<dist_t>& scratch, TagT* tags,
+                          float* distances) {
+    using Candidate = typename HNSWSearchScratch<dist_t>::Candidate;
+    if (index.cur_element_count == 0 || k == 0) {
+        clear_result_row(tags, distances, 0, k);
+        return 0;
+    }
+    dist_t cur_dist;
+    hnswlib::tableint cur = hnsw_descend(index, query, cur_dist);
+
+    ef = std::max(ef, k);
+    scratch.begin_query(index.max_elements_, ef);
+    auto& pool = scratch.pool;
+    auto less = [](const Candidate& c, dist_t d) { return c.distance < d; };
+    size_t cursor = 0;  // first unexpanded slot, or pool.size()
+
+    pool.push_back({cur_dist, cur, false});
+    scratch.visit(cur);
+
+    while (cursor < pool.size()) {
+        Candidate& next = pool[cursor];
+        next.expanded = true;
+        hnswlib::linklistsizeint* list = index.get_linklist0(next.id);
+        size_t size = index.getListCount(list);
+        auto* neighbors = reinterpret_cast<hnswlib::tableint*>(list + 1);
+
+        // Gather the unvisited neighbors and prefetch their vectors, then
+        // score them together.
+        scratch.reserve_batch(size);
+        hnswlib::tableint* ids = scratch.batch_ids.data();
+        dist_t* dists = scratch.batch_dists.data();
+        size_t n = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (!scratch.visit(neighbors[i])) continue;
+            ids[n++] = neighbors[i];
+            __builtin_prefetch(index.getDataByInternalId(neighbors[i]));
+        }
+        for (size_t i = 0; i < n; i++)
+            dists[i] = index.fstdistfunc_(
+                query, index.getDataByInternalId(ids[i]),
+                index.dist_func_param_);
+
+        for (size_t i = 0; i < n; i++) {
+            dist_t d = dists[i];
+            if (pool.size() == ef && !(d < pool.back().distance)) continue;
+            size_t pos = std::lower_bound(pool.begin(), pool.end(), d, less) -
+                         pool.begin();
+            if (pool.size() < ef) pool.emplace_back();
+            std::move_backward(pool.begin() + pos, pool.end() - 1,
+                               pool.end());
+            pool[pos] = {d, ids[i], false};
+            if (pos < cursor) cursor = pos;
+        }
+        while (cursor < pool.size() && pool[cursor].expanded) ++cursor;
+    }
+
+    bool has_deletions = index.num_deleted_ > 0;
+    size_t found = 0;
+    for (size_t j = 0; j < pool.size() && found < k; ++j) {
+        if (has_deletions && index.isMarkedDeleted(pool[j].id)) continue;
+        tags[found] = static_cast<TagT>(index.getExternalLabel(pool[j].id));
+        if (distances) distances[found] = pool[j].distance;
+        ++found;
+    }
+    clear_result_row(tags, distances, found, k);
+    return found;
+}
+
+// Dispatches to the layer-0 loop chosen by loop.
+template <typename dist_t, typename TagT>
+size_t hnsw_search(const hnswlib::HierarchicalNSW<dist_t>& index,
+                   SearchLoop loop, const void* query, size_t k, size_t ef,
+                   HNSWSearchScratch<dist_t>& scratch, TagT* tags,
+                   float* distances) {
+    if (loop == SearchLoop::kLinear)
+        return hnsw_search_linear(index, query, k, ef, scratch, tags,
+                                  distances);
+    return hnsw_search_heap(index, query, k, ef, scratch, tags, distances);
+}
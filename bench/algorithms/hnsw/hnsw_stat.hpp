@@ -1,9 +1,11 @@
 #pragma once
 
 #include <omp.h>
+#include <tbb/enumerable_thread_specific.h>
 
 #include <chrono>
 #include <cstddef>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -11,6 +13,7 @@
 #include <vector>
 
 #include "../index.hpp"
+#include "hnsw_search.hpp"
 #include "hnswlib/hnswlib/hnswlib.h"
 
 #define ENABLE_CC_STAT
@@ -30,11 +33,13 @@ class HNSW : public IndexBase<T, TagT, LabelT> {
         for (size_t i = 0; i < num_points; i++) {
             index_->addPoint((void*)(data + i * dim_), tags[i]);
         }
+        this->watermark_.complete(tags, num_points);
     }
 
     int insert(const T* data, const TagT tag) override {
-        index_->addPoint(data, tag);
-        return 0;
+        bool added = add_point(data, tag);
+        this->watermark_.complete(tag, tag + 1);
+        return added ? 0 : -1;
     }
 
     int batch_insert(const T* batch_data, const TagT* batch_tags,
@@ -57,14 +62,14 @@ class HNSW : public IndexBase<T, TagT, LabelT> {
 #ifdef ENABLE_CC_STAT
                 auto t_work_start = std::chrono::high_resolution_clock::now();
 #endif
-                index_->addPoint(batch_data + i * dim_, batch_tags[i]);
+                bool added = add_point(batch_data + i * dim_, batch_tags[i]);
 #ifdef ENABLE_CC_STAT
                 auto t_work_end = std::chrono::high_resolution_clock::now();
                 thread_work_time[tid] +=
                     std::chrono::duration<double>(t_work_end - t_work_start)
                         .count();
 #endif
-                success_count++;
+                if (added) success_count++;
             }
 
 #ifdef ENABLE_CC_STAT
@@ -92,25 +97,32 @@ class HNSW : public IndexBase<T, TagT, LabelT> {
         }
 #endif
 
-        return success_count == num_points ? 0 : -1;
+        // Failed points are simply absent, so the batch is complete either
+        // way; leaving its range out would hold the watermark back for good.
+        this->watermark_.complete(batch_tags, num_points);
+        if (static_cast<size_t>(success_count) != num_points) {
+            std::cerr << "HNSW: " << num_points - success_count << " of "
+                      << num_points << " inserts failed" << std::endl;
+            return -1;
+        }
+        return 0;
     }
 
     void set_query_params(const QParams& params) override {
         index_->setEf(params.ef_search);
+        search_loop_ = params.search_loop;
     }
 
-    int search(const T* query, size_t k,
-               std::vector<TagT>& result_tags) override {
-        auto result = index_->searchKnn(query, k);
-        while (!result.empty()) {
-            result_tags.push_back(result.top().second);
-            result.pop();
-        }
+    int search(const T* query, uint32_t k, TagT* tags,
+               float* distances) override {
+        hnsw_search(*index_, search_loop_, query, k, index_->ef_,
+                    scratch_.local(), tags, distances);
         return 0;
     }
 
     int batch_search(const T* batch_queries, uint32_t k, size_t num_queries,
-                     TagT** batch_results) override {
+                     TagT* tags, uint32_t* watermark) override {
+        if (watermark) *watermark = this->watermark_.load();
 #ifdef ENABLE_CC_STAT
         std::vector<double> thread_total_time(num_threads_, 0.0);
         std::vector<double> thread_work_time(num_threads_, 0.0);
@@ -128,17 +140,7 @@ class HNSW : public IndexBase<T, TagT, LabelT> {
 #ifdef ENABLE_CC_STAT
                 auto t_work_start = std::chrono::high_resolution_clock::now();
 #endif
-                auto result = index_->searchKnn(batch_queries + i * dim_, k);
-                size_t j = 0;
-                std::vector<TagT> results;
-                while (!result.empty()) {
-                    results.push_back(result.top().second);
-                    result.pop();
-                }
-                std::reverse(results.begin(), results.end());
-                for (j = 0; j < results.size(); ++j) {
-                    batch_results[i][j] = results[j];
-                }
+                search(batch_queries + i * dim_, k, tags + i * k, nullptr);
 #ifdef ENABLE_CC_STAT
                 auto t_work_end = std::chrono::high_resolution_clock::now();
                 thread_work_time[tid] +=
@@ -174,10 +176,36 @@ class HNSW : public IndexBase<T, TagT, LabelT> {
         return 0;
     }
 
+    int batch_search_with_distances(const T* batch_queries, uint32_t k,
+                                    size_t num_queries, TagT* tags,
+                                    float* distances,
+                                    uint32_t* watermark) override {
+        if (watermark) *watermark = this->watermark_.load();
+#pragma omp parallel for num_threads(num_threads_)
+        for (size_t i = 0; i < num_queries; ++i) {
+            search(batch_queries + i * dim_, k, tags + i * k,
+                   distances + i * k);
+        }
+        return 0;
+    }
+
+    // hnswlib throws when a point does not fit (the index is full); the
+    // point is then dropped and the caller reports the failure.
+    bool add_point(const T* point, TagT tag) {
+        try {
+            index_->addPoint(point, tag);
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
     size_t num_threads_;
     size_t dim_;
     hnswlib::L2Space space;
     hnswlib::HierarchicalNSW<T>* index_;
+    SearchLoop search_loop_ = SearchLoop::kHeap;
+    tbb::enumerable_thread_specific<HNSWSearchScratch<T>> scratch_;
 
 #ifdef ENABLE_CC_STAT
     struct BatchStat {
@@ -3,16 +3,28 @@
 #include <omp.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <vector>
 
+// Base-layer search loop used by adapters that own their search (currently
+// HNSW): kHeap is hnswlib's best-first search over a pair of binary heaps,
+// kLinear keeps the ef best candidates in one sorted array instead.
+enum class SearchLoop { kHeap = 0, kLinear = 1 };
+
 struct QParams {
     size_t ef_search;
     size_t beam_width;
     float alpha;
     size_t visit_limit;
+    SearchLoop search_loop = SearchLoop::kHeap;
 
     QParams() = default;
 
@@ -26,6 +38,83 @@ struct QParams {
           visit_limit(visit_limit) {}
 };
 
+// Marks slots [from, k) of a result row as empty: the largest tag and an
+// infinite distance. distances may be null.
+template <typename TagT>
+inline void clear_result_row(TagT* tags, float* distances, size_t from,
+                             size_t k) {
+    std::fill(tags + from, tags + k, std::numeric_limits<TagT>::max());
+    if (distances)
+        std::fill(distances + from, distances + k,
+                  std::numeric_limits<float>::infinity());
+}
+
+// Insert watermark: the largest w such that every insert of tags [0, w) has
+// completed. Batches may carry any tags in any order and finish out of order:
+// each batch's tags are sorted and coalesced into runs, and completed runs
+// past the watermark wait in pending_, merged with their neighbors, until the
+// gap before them closes. pending_ thus holds one entry per open gap. The
+// watermark only says something for tags that densely cover [0, n), as the
+// bench assigns them; tags far above any gap just wait there. Reads are a
+// single atomic load.
+class InsertWatermark {
+   public:
+    uint32_t load() const { return value_.load(std::memory_order_acquire); }
+
+    // Records that the inserts of tags [begin, end) have completed.
+    void complete(uint32_t begin, uint32_t end) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        complete_locked(begin, end);
+    }
+
+    // Same for the num_points tags of a batch, in any order, repeats
+    // allowed.
+    template <typename TagT>
+    void complete(const TagT* tags, size_t num_points) {
+        std::vector<uint32_t> sorted(tags, tags + num_points);
+        std::sort(sorted.begin(), sorted.end());
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < sorted.size();) {
+            size_t j = i + 1;
+            while (j < sorted.size() && sorted[j] - sorted[j - 1] <= 1) ++j;
+            // A run reaching the largest tag stops one short of it.
+            uint32_t last = std::min(sorted[j - 1],
+                                     std::numeric_limits<uint32_t>::max() - 1);
+            complete_locked(sorted[i], last + 1);
+            i = j;
+        }
+    }
+
+   private:
+    void complete_locked(uint32_t begin, uint32_t end) {
+        uint32_t w = value_.load(std::memory_order_relaxed);
+        if (end <= w || begin >= end) return;
+        begin = std::max(begin, w);
+        // Absorb every pending range that overlaps or touches [begin, end).
+        auto it = pending_.upper_bound(begin);
+        if (it != pending_.begin() && std::prev(it)->second >= begin) {
+            --it;
+            begin = it->first;
+            end = std::max(end, it->second);
+            it = pending_.erase(it);
+        }
+        while (it != pending_.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = pending_.erase(it);
+        }
+        if (begin <= w)
+            value_.store(end, std::memory_order_release);
+        else
+            pending_.emplace(begin, end);
+    }
+
+    std::mutex mutex_;
+    // Completed, disjoint, non-adjacent ranges [first, second) above the
+    // watermark.
+    std::map<uint32_t, uint32_t> pending_;
+    std::atomic<uint32_t> value_{0};
+};
+
 template <typename T, typename TagT = uint32_t, typename LabelT = uint32_t>
 class IndexBase {
    public:
@@ -35,11 +124,36 @@ class IndexBase {
     virtual int batch_insert(const T* batch_data, const TagT* batch_tags,
                              size_t num_points) = 0;
     virtual void set_query_params(const QParams& params) = 0;
-    virtual int search(const T* query, size_t k,
-                       std::vector<TagT>& res_tags) = 0;
 
+    // Searches a single query and writes its results, nearest first, to
+    // tags[0, k) and, unless distances is null, their distances to
+    // distances[0, k); short rows are padded by clear_result_row(). This is
+    // the online path: it may be called from many threads at once and must
+    // not allocate on the adapter side.
+    virtual int search(const T* query, uint32_t k, TagT* tags,
+                       float* distances) = 0;
+
+    // Searches num_queries contiguous queries (num_queries x dim) and writes
+    // row i, nearest first, to tags[i * k, (i + 1) * k). Rows with fewer than
+    // k results are padded by clear_result_row(). Unless it is null,
+    // *watermark receives the insert watermark the batch observed: every tag
+    // below it was visible to every query of the batch. Adapters that search
+    // a snapshot report the snapshot's own watermark, so a batch sees
+    // exactly that prefix when inserts complete in order.
     virtual int batch_search(const T* batch_queries, uint32_t k,
-                             size_t num_queries, TagT** batch_results) = 0;
+                             size_t num_queries, TagT* tags,
+                             uint32_t* watermark) = 0;
+
+    // Like batch_search, also writing the matching distances (as the index
+    // computes them, e.g. squared L2) to the same ranges of distances.
+    virtual int batch_search_with_distances(const T* batch_queries,
+                                            uint32_t k, size_t num_queries,
+                                            TagT* tags, float* distances,
+                                            uint32_t* watermark) = 0;
 
     virtual void save_stat(const std::string& filename) {}
+
+   protected:
+    // Adapters complete a tag range once its inserts are searchable.
+    InsertWatermark watermark_;
 };
\ No newline at end of file
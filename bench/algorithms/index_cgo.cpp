@@ -4,10 +4,13 @@
 #include <iostream>
 #include <vector>
 
+#include "gt_format.hpp"
 #include "hnsw/hnsw.hpp"
 #include "index.hpp"
+#include "online_recall.hpp"
 #include "parlayann/parlay_hnsw.hpp"
 #include "parlayann/parlay_vamana.hpp"
+#include "recall.hpp"
 #include "vamana/vamana.hpp"
 
 extern "C" {
@@ -63,7 +66,12 @@ void destroy_index(void* index_ptr) {
 int build(void* index_ptr, float* data, uint32_t* tags, size_t num_points) {
     if (!index_ptr || !data || !tags) return -1;
     auto index = static_cast<IndexBase<float>*>(index_ptr);
-    index->build(data, tags, num_points);
+    try {
+        index->build(data, tags, num_points);
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to build index: " << e.what() << std::endl;
+        return -1;
+    }
     return 0;
 }
 
@@ -78,18 +86,15 @@ void set_query_params(void* index_ptr, C_QueryParams params) {
     auto index = static_cast<IndexBase<float>*>(index_ptr);
     QParams qparams(params.ef_search, params.beam_width, params.alpha,
                     params.visit_limit);
+    qparams.search_loop = static_cast<SearchLoop>(params.search_loop);
     index->set_query_params(qparams);
 }
 
-int search(void* index_ptr, float* query, size_t k, uint32_t* res_tags) {
+int search(void* index_ptr, float* query, uint32_t k, uint32_t* res_tags,
+           float* res_dists) {
     if (!index_ptr || !query || !res_tags) return -1;
     auto index = static_cast<IndexBase<float>*>(index_ptr);
-    std::vector<uint32_t> results;
-    index->search(query, k, results);
-    for (size_t i = 0; i < results.size(); ++i) {
-        res_tags[i] = results[i];
-    }
-    return 0;
+    return index->search(query, k, res_tags, res_dists);
 }
 
 int batch_insert(void* index_ptr, float* batch_data, uint32_t* batch_tags,
@@ -100,10 +105,15 @@ int batch_insert(void* index_ptr, float* batch_data, uint32_t* batch_tags,
 }
 
 int batch_search(void* index_ptr, float* batch_queries, uint32_t k,
-                 size_t num_queries, uint32_t** batch_results) {
-    if (!index_ptr || !batch_queries) return -1;
+                 size_t num_queries, uint32_t* tags, float* distances,
+                 uint32_t* watermark) {
+    if (!index_ptr || !batch_queries || !tags) return -1;
     auto index = static_cast<IndexBase<float>*>(index_ptr);
-    return index->batch_search(batch_queries, k, num_queries, batch_results);
+    if (distances)
+        return index->batch_search_with_distances(
+            batch_queries, k, num_queries, tags, distances, watermark);
+    return index->batch_search(batch_queries, k, num_queries, tags,
+                               watermark);
 }
 
 void save_stat(void* index_ptr, const char* filename) {
@@ -111,4 +121,93 @@ void save_stat(void* index_ptr, const char* filename) {
     index->save_stat(std::string(filename));
 }
 
+void* create_recall_evaluator(const char* gt_path, uint32_t recall_at) {
+    if (!gt_path || recall_at == 0) return nullptr;
+    try {
+        return static_cast<void*>(new OnlineRecall(gt_path, recall_at));
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to create recall evaluator: " << e.what()
+                  << std::endl;
+        return nullptr;
+    }
+}
+
+void destroy_recall_evaluator(void* eval_ptr) {
+    if (eval_ptr) {
+        delete static_cast<OnlineRecall*>(eval_ptr);
+    }
+}
+
+int recall_submit(void* eval_ptr, uint64_t insert_offset,
+                  const uint32_t* query_idx, const uint32_t* tags,
+                  size_t num_queries, uint32_t k) {
+    if (!eval_ptr || !query_idx || !tags) return -1;
+    auto eval = static_cast<OnlineRecall*>(eval_ptr);
+    eval->submit(insert_offset, query_idx, tags, num_queries, k);
+    return 0;
+}
+
+void recall_flush(void* eval_ptr) {
+    if (!eval_ptr) return;
+    static_cast<OnlineRecall*>(eval_ptr)->flush();
+}
+
+size_t recall_num_stages(void* eval_ptr) {
+    if (!eval_ptr) return 0;
+    return static_cast<OnlineRecall*>(eval_ptr)->stages().size();
+}
+
+size_t recall_stages(void* eval_ptr, C_StageRecall* stages,
+                     size_t max_stages) {
+    if (!eval_ptr || !stages) return 0;
+    size_t n = 0;
+    for (const auto& [offset, stage] :
+         static_cast<OnlineRecall*>(eval_ptr)->stages()) {
+        if (n == max_stages) break;
+        stages[n++] = C_StageRecall{offset, stage.recall_sum, stage.count,
+                                    stage.unmatched};
+    }
+    return n;
+}
+
+void recall_overall(void* eval_ptr, C_StageRecall* overall) {
+    if (!eval_ptr || !overall) return;
+    auto total = static_cast<OnlineRecall*>(eval_ptr)->overall();
+    *overall = C_StageRecall{0, total.recall_sum, total.count, total.unmatched};
+}
+
+double compute_recall(const uint32_t* gt_ids, const float* gt_dists,
+                      uint32_t gt_k, const uint32_t* res_tags, uint32_t res_k,
+                      size_t num_queries, uint32_t recall_at) {
+    if (!gt_ids || !res_tags || recall_at == 0 || recall_at > gt_k ||
+        recall_at > res_k)
+        return -1;
+    return calculate_recall(num_queries, gt_ids, gt_dists, gt_k, res_tags,
+                            res_k, recall_at);
+}
+
+double compute_recall_from_file(const char* gt_path, const uint32_t* res_tags,
+                                uint32_t res_k, size_t num_queries,
+                                uint32_t recall_at, int ties) {
+    if (!gt_path) return -1;
+    std::vector<uint32_t> gt_ids;
+    std::vector<float> gt_dists;
+    size_t gt_n = 0, gt_k = 0;
+    try {
+        load_truthset(gt_path, gt_ids, gt_dists, gt_n, gt_k);
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to load ground truth: " << e.what() << std::endl;
+        return -1;
+    }
+    if (gt_n < num_queries) {
+        std::cerr << "Ground truth has " << gt_n << " queries, expected "
+                  << num_queries << std::endl;
+        return -1;
+    }
+    return compute_recall(gt_ids.data(),
+                          ties && !gt_dists.empty() ? gt_dists.data() : nullptr,
+                          static_cast<uint32_t>(gt_k), res_tags, res_k,
+                          num_queries, recall_at);
+}
+
 }  // extern "C"
\ No newline at end of file
@@ -33,11 +33,17 @@ typedef struct {
     DataType data_type;
 } IndexParams;
 
+typedef enum {
+    SEARCH_LOOP_HEAP = 0,
+    SEARCH_LOOP_LINEAR = 1,
+} C_SearchLoop;
+
 typedef struct {
     size_t ef_search;
     size_t beam_width;
     float alpha;
     size_t visit_limit;
+    C_SearchLoop search_loop;
 } C_QueryParams;
 
 void* create_index(IndexType type, IndexParams params);
@@ -46,14 +52,57 @@ void destroy_index(void* index_ptr);
 int build(void* index_ptr, float* data, uint32_t* tags, size_t num_points);
 int insert(void* index_ptr, float* point, uint32_t tag);
 void set_query_params(void* index_ptr, C_QueryParams params);
-int search(void* index_ptr, float* query, size_t k, uint32_t* res_tags);
+// Searches one query into the caller's k-slot buffers; res_dists may be
+// null. Short rows are padded with tag 0xffffffff and distance +inf.
+int search(void* index_ptr, float* query, uint32_t k, uint32_t* res_tags,
+           float* res_dists);
 int batch_insert(void* index_ptr, float* batch_data, uint32_t* batch_tags,
                  size_t batch_size);
+// Searches a contiguous num_queries x dim query matrix and writes the
+// num_queries x k result matrix, row by row, into the caller's buffers;
+// distances may be null. Short rows are padded with tag 0xffffffff and
+// distance +inf. Nothing is copied or allocated on the way in or out. Unless
+// it is null, *watermark receives the insert watermark the batch observed:
+// every tag below it was inserted and visible to the whole batch.
 int batch_search(void* index_ptr, float* batch_queries, uint32_t k,
-                 size_t num_queries, uint32_t** batch_results);
+                 size_t num_queries, uint32_t* tags, float* distances,
+                 uint32_t* watermark);
 
 void save_stat(void* index_ptr, const char* filename);
 
+// Online stagewise recall: results are scored on a background thread against
+// a stagewise ground truth file while the benchmark runs.
+typedef struct {
+    uint64_t insert_offset;
+    double recall_sum;
+    uint64_t count;
+    uint64_t unmatched;
+} C_StageRecall;
+
+void* create_recall_evaluator(const char* gt_path, uint32_t recall_at);
+void destroy_recall_evaluator(void* eval_ptr);
+int recall_submit(void* eval_ptr, uint64_t insert_offset,
+                  const uint32_t* query_idx, const uint32_t* tags,
+                  size_t num_queries, uint32_t k);
+void recall_flush(void* eval_ptr);
+size_t recall_num_stages(void* eval_ptr);
+size_t recall_stages(void* eval_ptr, C_StageRecall* stages,
+                     size_t max_stages);
+void recall_overall(void* eval_ptr, C_StageRecall* overall);
+
+// Offline recall through the shared recall library (utils/recall.hpp):
+// recall@recall_at in percent of num_queries x res_k result tags against a
+// gt_k-wide ground truth matrix, with tie handling when gt_dists is not null.
+// compute_recall_from_file uses the file's distances for ties only when ties
+// is nonzero. Return -1 on invalid arguments or an unreadable ground truth
+// file.
+double compute_recall(const uint32_t* gt_ids, const float* gt_dists,
+                      uint32_t gt_k, const uint32_t* res_tags, uint32_t res_k,
+                      size_t num_queries, uint32_t recall_at);
+double compute_recall_from_file(const char* gt_path, const uint32_t* res_tags,
+                                uint32_t res_k, size_t num_queries,
+                                uint32_t recall_at, int ties);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
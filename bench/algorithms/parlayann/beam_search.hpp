@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Allocation-free beam search over a SnapshotGraph view, used by the parlay
+// adapters in place of parlayANN::beam_search_impl.
+//
+// beam_search_impl builds its frontier, candidate and visited sequences
+// afresh for every query. The search here keeps the beam as one sorted array
+// of the nearest nodes seen so far, each with an "expanded" bit, like
+// hnsw_search_linear, and takes it and an epoch-stamped visited array from a
+// per-thread ParlayBeamScratch that is sized on first use and reused by every
+// later query. As in beam_search_impl, at most visit_limit nodes are expanded,
+// only the first degree_limit neighbors of each are scored, and for metric
+// distances the beam is cut after every expansion to the nodes within cut
+// times the distance of its (k + 1)-th entry (QueryParams::k and ::cut).
+
+template <typename IdT>
+struct ParlayBeamScratch {
+    struct Candidate {
+        float distance;
+        IdT id;
+        bool expanded;
+    };
+
+    std::vector<Candidate> beam;  // sorted by distance, at most beam_width
+    // Unvisited neighbors of the node being expanded.
+    std::vector<IdT> batch_ids;
+    std::vector<float> batch_dists;
+    // visited[id] == epoch marks id as seen by the current query; bumping
+    // the epoch clears the whole array at once.
+    std::vector<uint16_t> visited;
+    uint16_t epoch = 0;
+
+    void begin_query(size_t max_points, size_t beam_width) {
+        if (visited.size() < max_points) visited.resize(max_points, 0);
+        if (++epoch == 0) {
+            std::fill(visited.begin(), visited.end(), 0);
+            epoch = 1;
+        }
+        beam.clear();
+        if (beam.capacity() < beam_width) beam.reserve(beam_width);
+    }
+
+    void reserve_batch(size_t max_degree) {
+        if (batch_ids.size() < max_degree) {
+            batch_ids.resize(max_degree);
+            batch_dists.resize(max_degree);
+        }
+    }
+
+    bool visit(IdT id) {
+        if (visited[id] == epoch) return false;
+        visited[id] = epoch;
+        return true;
+    }
+};
+
+// Searches q over graph from starts for its k nearest and leaves the beam,
+// nearest first, in scratch.beam. max_points bounds every id in graph;
+// points[id] is the vector of node id.
+template <typename IdT, typename Point, typename Graph, typename Range>
+void parlay_beam_search(const Point& q, const Graph& graph,
+                        const Range& points, const IdT* starts,
+                        size_t num_starts, size_t max_points, size_t k,
+                        size_t beam_width, float cut, size_t visit_limit,
+                        size_t degree_limit, ParlayBeamScratch<IdT>& scratch) {
+    using Candidate = typename ParlayBeamScratch<IdT>::Candidate;
+    scratch.begin_query(max_points, beam_width);
+    auto& beam = scratch.beam;
+    if (graph.size() == 0 || beam_width == 0) return;
+    auto less = [](const Candidate& c, float d) { return c.distance < d; };
+    // Inserts (d, id) at its place in the beam unless the beam is full of
+    // nearer nodes; returns the slot, or beam.size() when dropped.
+    auto offer = [&](float d, IdT id) {
+        if (beam.size() == beam_width && !(d < beam.back().distance))
+            return beam.size();
+        size_t pos =
+            std::lower_bound(beam.begin(), beam.end(), d, less) - beam.begin();
+        if (beam.size() < beam_width) beam.emplace_back();
+        std::move_backward(beam.begin() + pos, beam.end() - 1, beam.end());
+        beam[pos] = {d, id, false};
+        return pos;
+    };
+
+    for (size_t i = 0; i < num_starts; ++i)
+        if (scratch.visit(starts[i]))
+            offer(q.distance(points[starts[i]]), starts[i]);
+
+    size_t cursor = 0;  // first unexpanded slot, or beam.size()
+    for (size_t expanded = 0; cursor < beam.size() && expanded < visit_limit;
+         ++expanded) {
+        beam[cursor].expanded = true;
+        auto edges = graph[beam[cursor].id];
+        size_t size = std::min(edges.size(), degree_limit);
+
+        // Gather the unvisited neighbors and prefetch their vectors, then
+        // score them together.
+        scratch.reserve_batch(size);
+        IdT* ids = scratch.batch_ids.data();
+        float* dists = scratch.batch_dists.data();
+        size_t n = 0;
+        for (size_t j = 0; j < size; ++j) {
+            if (!scratch.visit(edges[j])) continue;
+            ids[n++] = edges[j];
+            points[edges[j]].prefetch();
+        }
+        for (size_t j = 0; j < n; ++j) dists[j] = q.distance(points[ids[j]]);
+
+        for (size_t j = 0; j < n; ++j) {
+            size_t pos = offer(dists[j], ids[j]);
+            if (pos < cursor) cursor = pos;
+        }
+        if (k > 0 && beam.size() > k && q.is_metric()) {
+            float bound = cut * beam[k].distance;
+            beam.erase(std::upper_bound(beam.begin() + k, beam.end(), bound,
+                                        [](float d, const Candidate& c) {
+                                            return d < c.distance;
+                                        }),
+                       beam.end());
+        }
+        while (cursor < beam.size() && beam[cursor].expanded) ++cursor;
+    }
+}
@@ -1,17 +1,25 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <vector>
 
+#include <tbb/enumerable_thread_specific.h>
+
 #include "../index.hpp"
+#include "../tag_map.hpp"
 #include "parlayann/algorithms/HNSW/HNSW.hpp"
 #include "parlayann/algorithms/utils/euclidian_point.h"
 #include "parlayann/algorithms/utils/point_range.h"
 #include "parlayann/algorithms/utils/types.h"
+#include "beam_search.hpp"
+#include "snapshot_graph.hpp"
 
 template <typename T, typename TagT = uint32_t, typename LabelT = uint32_t>
 class ParlayHNSW : public IndexBase<T, TagT, LabelT> {
@@ -30,11 +38,14 @@ class ParlayHNSW : public IndexBase<T, TagT, LabelT> {
           alpha_(alpha),
           num_threads_(num_threads),
           max_elements_(max_elements),
-          total_points_(0) {
+          total_points_(0),
+          tag_map_(max_elements) {
         setenv("PARLAY_NUM_THREADS", std::to_string(num_threads).c_str(), 1);
     }
 
     void build(const T* data, const TagT* tags, size_t num_points) override {
+        if (!tag_map_.insert_batch(tags, num_points, 0))
+            throw std::runtime_error("ParlayHNSW: duplicate tag in build");
         data_range_ = Range(reinterpret_cast<const float*>(data), num_points,
                             dim_, max_elements_);
         total_points_ = num_points;
@@ -48,6 +59,10 @@ class ParlayHNSW : public IndexBase<T, TagT, LabelT> {
         index_ = std::make_unique<ANN::HNSW<desc>>(ps.begin(), ps.end(), dim_,
                                                    m_l_, graph_degree_,
                                                    ef_construction_, alpha_);
+        snapshot_ = std::make_unique<SnapshotGraph<TagT>>(
+            max_elements_, index_->get_threshold_m(0));
+        this->watermark_.complete(tags, num_points);
+        publish(0);
     }
 
     int batch_insert(const T* batch_data, const TagT* batch_tags,
@@ -56,16 +71,24 @@ class ParlayHNSW : public IndexBase<T, TagT, LabelT> {
 
         assert((total_points_ + num_points) <= max_elements_);
 
+        // Slots go out in arrival order, whatever the tags are.
+        size_t first = total_points_;
+        if (!tag_map_.insert_batch(batch_tags, num_points, first)) {
+            std::cerr << "ParlayHNSW: batch repeats an inserted tag"
+                      << std::endl;
+            return -1;
+        }
         data_range_.extend(reinterpret_cast<const float*>(batch_data),
                            num_points);
         total_points_ += num_points;
 
         auto ps = parlay::delayed_seq<Point>(
-            num_points, [this, num_points](size_t i) {
-                return data_range_[total_points_ - num_points + i];
-            });
+            num_points,
+            [this, first](size_t i) { return data_range_[first + i]; });
 
-        index_->batch_insert(ps.begin(), ps.end(), batch_tags[0]);
+        index_->batch_insert(ps.begin(), ps.end(), first);
+        this->watermark_.complete(batch_tags, num_points);
+        publish(first);
         return 0;
     }
 
@@ -80,35 +103,85 @@ class ParlayHNSW : public IndexBase<T, TagT, LabelT> {
         beam_width_ = params.beam_width;
     }
 
-    int search(const T* query, size_t k,
-               std::vector<TagT>& result_tags) override {
-        std::cerr << "ParlayHNSW does not support dynamic single search"
-                  << std::endl;
-        return -1;
+    int search(const T* query, uint32_t k, TagT* tags,
+               float* distances) override {
+        auto guard = snapshot_->pin();
+        auto graph = snapshot_->view();
+        search_one(Range(query, 1, dim_)[0], graph, k, tags, distances);
+        return 0;
     }
 
     int batch_search(const T* batch_queries, uint32_t k, size_t num_queries,
-                     TagT** batch_results) override {
-        parlayANN::QueryParams QP(
-            k, beam_width_, 1.35, visit_limit_,
-            std::min<int>(index_->get_threshold_m(0), 3 * visit_limit_));
+                     TagT* tags, uint32_t* watermark) override {
         Range qpoints(batch_queries, num_queries, dim_);
-        parlay::sequence<TagT> starts(1, 0);
 
-        auto start = std::chrono::high_resolution_clock::now();
-        auto graph = typename ANN::HNSW<desc>::graph(*index_, 0);
+        // One snapshot for the whole batch.
+        auto guard = snapshot_->pin();
+        auto graph = snapshot_->view();
+        if (watermark) *watermark = graph.watermark();
+        parlay::parallel_for(0, num_queries, [&](size_t i) {
+            search_one(qpoints[i], graph, k, tags + i * k, nullptr);
+        });
+        return 0;
+    }
+
+    int batch_search_with_distances(const T* batch_queries, uint32_t k,
+                                    size_t num_queries, TagT* tags,
+                                    float* distances,
+                                    uint32_t* watermark) override {
+        Range qpoints(batch_queries, num_queries, dim_);
+
+        // One snapshot for the whole batch.
+        auto guard = snapshot_->pin();
+        auto graph = snapshot_->view();
+        if (watermark) *watermark = graph.watermark();
         parlay::parallel_for(0, num_queries, [&](size_t i) {
-            auto q = qpoints[i];
-            auto results = parlayANN::beam_search_impl<uint32_t>(
-                q, graph, data_range_, starts, QP);
-            for (size_t j = 0; j < k && j < results.first.first.size(); ++j) {
-                batch_results[i][j] = results.first.first[j].first;
-            }
+            search_one(qpoints[i], graph, k, tags + i * k,
+                       distances + i * k);
         });
         return 0;
     }
 
    private:
+    // Republishes the nodes that inserting points [first, total_points_)
+    // may have changed and whose edge list differs from their newest
+    // snapshot block, then commits. Writers only: build() and
+    // batch_insert() under index_mutex.
+    void publish(size_t first) {
+        auto graph = typename ANN::HNSW<desc>::graph(*index_, 0);
+        size_t n = total_points_;
+        const std::vector<size_t>& nodes = touched_.collect(graph, first, n);
+        stale_.resize(nodes.size());
+        parlay::parallel_for(0, nodes.size(), [&](size_t j) {
+            stale_[j] = !snapshot_->current(nodes[j], graph[nodes[j]]);
+        });
+        for (size_t j = 0; j < nodes.size(); ++j)
+            if (stale_[j]) snapshot_->publish(nodes[j], graph[nodes[j]], n);
+        snapshot_->commit(total_points_, this->watermark_.load());
+    }
+
+    // Beam search on the base layer from the entry point, with the results
+    // translated from slots to tags and written straight into the caller's
+    // row.
+    void search_one(const Point& q,
+                    const typename SnapshotGraph<TagT>::View& graph,
+                    uint32_t k, TagT* tags, float* distances) {
+        auto& scratch = scratch_.local();
+        size_t degree_limit =
+            std::min<size_t>(index_->get_threshold_m(0), 3 * visit_limit_);
+        parlay_beam_search(q, graph, data_range_, starts_.data(),
+                           starts_.size(), max_elements_, k,
+                           std::max<size_t>(beam_width_, k), 1.35f,
+                           visit_limit_, degree_limit, scratch);
+        auto& beam = scratch.beam;
+        size_t found = std::min<size_t>(k, beam.size());
+        for (size_t j = 0; j < found; ++j) {
+            tags[j] = static_cast<TagT>(tag_map_.tag(beam[j].id));
+            if (distances) distances[j] = beam[j].distance;
+        }
+        clear_result_row(tags, distances, found, k);
+    }
+
     std::mutex index_mutex;
 
     size_t dim_;
@@ -125,4 +198,15 @@ class ParlayHNSW : public IndexBase<T, TagT, LabelT> {
     std::unique_ptr<ANN::HNSW<desc>> index_;
     Range data_range_;
     QParams query_params_;
+    // Shared, read-only start set of every search.
+    parlay::sequence<TagT> starts_ = parlay::sequence<TagT>(1, 0);
+    // What searches walk instead of index_, so they never see a batch
+    // insert half-applied.
+    std::unique_ptr<SnapshotGraph<TagT>> snapshot_;
+    TouchedNodes touched_;
+    std::vector<uint8_t> stale_;
+    tbb::enumerable_thread_specific<ParlayBeamScratch<TagT>> scratch_;
+    // The library and snapshot_ work in slots (positions in data_range_);
+    // callers only ever see tags.
+    TagMap tag_map_;
 };
\ No newline at end of file
@@ -1,19 +1,27 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <vector>
 
+#include <tbb/enumerable_thread_specific.h>
+
 #include "../index.hpp"
+#include "../tag_map.hpp"
 #include "parlayann/algorithms/utils/euclidian_point.h"
 #include "parlayann/algorithms/utils/point_range.h"
 #include "parlayann/algorithms/utils/types.h"
 #include "parlayann/algorithms/vamana/index.h"
 #include "parlayann/data_tools/utils/beamSearch.h"
+#include "beam_search.hpp"
+#include "snapshot_graph.hpp"
 
 template <typename T, typename TagT = uint32_t, typename LabelT = uint32_t>
 class ParlayVamana : public IndexBase<T, TagT, LabelT> {
@@ -34,11 +42,14 @@ class ParlayVamana : public IndexBase<T, TagT, LabelT> {
           graph_degree_(M),
           ef_construction_(ef_construction),
           alpha_(alpha),
-          total_points_(0) {
+          total_points_(0),
+          tag_map_(max_elements) {
         setenv("PARLAY_NUM_THREADS", std::to_string(num_threads).c_str(), 1);
     }
 
     void build(const T* data, const TagT* tags, size_t num_points) override {
+        if (!tag_map_.insert_batch(tags, num_points, 0))
+            throw std::runtime_error("ParlayVamana: duplicate tag in build");
         data_range_ = Range(reinterpret_cast<const float*>(data), num_points,
                             dim_, max_elements_);
         total_points_ = num_points;
@@ -54,12 +65,22 @@ class ParlayVamana : public IndexBase<T, TagT, LabelT> {
         BuildParams BP(graph_degree_, ef_construction_, alpha_, 1);
         index_ = std::make_unique<KnnIndex>(BP);
         index_->build_index(*G_, data_range_, data_range_, build_stats);
+        snapshot_ = std::make_unique<SnapshotGraph<TagT>>(max_elements_,
+                                                          G_->max_degree());
+        this->watermark_.complete(tags, num_points);
+        publish(0);
     }
 
     int batch_insert(const T* batch_data, const TagT* batch_tags,
                      size_t num_points) override {
         std::lock_guard<std::mutex> lock(index_mutex);
+        // Slots go out in arrival order, whatever the tags are.
         size_t start_idx = actual_points_;
+        if (!tag_map_.insert_batch(batch_tags, num_points, start_idx)) {
+            std::cerr << "ParlayVamana: batch repeats an inserted tag"
+                      << std::endl;
+            return -1;
+        }
         data_range_.extend(reinterpret_cast<const float*>(batch_data),
                            num_points);
         total_points_ += num_points;
@@ -71,8 +92,23 @@ class ParlayVamana : public IndexBase<T, TagT, LabelT> {
             [&](size_t i) { return static_cast<TagT>(start_idx + i); });
         BuildParams BP(graph_degree_, ef_construction_, alpha_, 1);
         parlayANN::stats<TagT> build_stats(total_points_);
-        return index_->incr_batch_insert(points, *G_, data_range_, data_range_,
-                                         build_stats, BP.alpha);
+        int result = index_->incr_batch_insert(
+            points, *G_, data_range_, data_range_, build_stats, BP.alpha);
+        // Failed points are absent either way, so the watermark moves past
+        // the batch.
+        this->watermark_.complete(batch_tags, num_points);
+        if (result != 0) {
+            // The library may have linked part of the batch in, and its slots
+            // stay taken. Unmapped, they can still route searches but are
+            // never returned; the snapshot keeps the last good batch.
+            tag_map_.erase_batch(batch_tags, num_points);
+            snapshot_->commit(start_idx, this->watermark_.load());
+            std::cerr << "ParlayVamana: batch insert failed with " << result
+                      << std::endl;
+            return result;
+        }
+        publish(start_idx);
+        return 0;
     }
 
     int insert(const T* point, const TagT tag) override {
@@ -86,40 +122,93 @@ class ParlayVamana : public IndexBase<T, TagT, LabelT> {
         beam_width_ = params.beam_width;
     }
 
-    int search(const T* query, size_t k,
-               std::vector<TagT>& result_tags) override {
-        std::cerr << "ParlayVamana does not support dynamic single search"
-                  << std::endl;
-        return -1;
+    int search(const T* query, uint32_t k, TagT* tags,
+               float* distances) override {
+        Range query_points(reinterpret_cast<const float*>(query), 1, dim_);
+        auto guard = snapshot_->pin();
+        auto graph = snapshot_->view();
+        search_one(query_points[0], graph, k, tags, distances);
+        return 0;
     }
 
     int batch_search(const T* batch_queries, uint32_t k, size_t num_queries,
-                     TagT** batch_results) override {
-        std::cout << "beam_width_: " << beam_width_ << ", alpha_: " << alpha_
-                  << ", visit_limit_: " << visit_limit_ << std::endl;
-        QueryParams QP(k, beam_width_, alpha_, visit_limit_,
-                       std::min<int>(G_->max_degree(), 3 * visit_limit_));
+                     TagT* tags, uint32_t* watermark) override {
         Range query_points(reinterpret_cast<const float*>(batch_queries),
                            num_queries, dim_);
 
-        parlay::sequence<TagT> starting_points = {0};
-
+        // One snapshot for the whole batch.
+        auto guard = snapshot_->pin();
+        auto graph = snapshot_->view();
+        if (watermark) *watermark = graph.watermark();
         parlay::parallel_for(0, num_queries, [&](size_t i) {
-            auto p = query_points[i];
+            search_one(query_points[i], graph, k, tags + i * k, nullptr);
+        });
+
+        return 0;
+    }
 
-            auto search_results = parlayANN::beam_search(p, *G_, data_range_,
-                                                         starting_points, QP);
-            auto& beam_results = search_results.first.first;
+    int batch_search_with_distances(const T* batch_queries, uint32_t k,
+                                    size_t num_queries, TagT* tags,
+                                    float* distances,
+                                    uint32_t* watermark) override {
+        Range query_points(reinterpret_cast<const float*>(batch_queries),
+                           num_queries, dim_);
 
-            for (uint32_t j = 0; j < k && j < beam_results.size(); j++) {
-                batch_results[i][j] = static_cast<TagT>(beam_results[j].first);
-            }
+        // One snapshot for the whole batch.
+        auto guard = snapshot_->pin();
+        auto graph = snapshot_->view();
+        if (watermark) *watermark = graph.watermark();
+        parlay::parallel_for(0, num_queries, [&](size_t i) {
+            search_one(query_points[i], graph, k, tags + i * k,
+                       distances + i * k);
         });
 
         return 0;
     }
 
    private:
+    // Republishes the nodes that inserting points [first, actual_points_)
+    // may have changed and whose edge list differs from their newest
+    // snapshot block, then commits. Writers only: build() and
+    // batch_insert() under index_mutex.
+    void publish(size_t first) {
+        size_t n = actual_points_;
+        const std::vector<size_t>& nodes = touched_.collect(*G_, first, n);
+        stale_.resize(nodes.size());
+        parlay::parallel_for(0, nodes.size(), [&](size_t j) {
+            stale_[j] = !snapshot_->current(nodes[j], (*G_)[nodes[j]]);
+        });
+        for (size_t j = 0; j < nodes.size(); ++j)
+            if (stale_[j]) snapshot_->publish(nodes[j], (*G_)[nodes[j]], n);
+        snapshot_->commit(actual_points_, this->watermark_.load());
+    }
+
+    // Beam search from the start point over a snapshot of the graph, with
+    // the results translated from slots to tags and written straight into
+    // the caller's row.
+    void search_one(const Point& q,
+                    const typename SnapshotGraph<TagT>::View& graph,
+                    uint32_t k, TagT* tags, float* distances) {
+        auto& scratch = scratch_.local();
+        size_t degree_limit =
+            std::min<size_t>(G_->max_degree(), 3 * visit_limit_);
+        parlay_beam_search(q, graph, data_range_, starting_points_.data(),
+                           starting_points_.size(), max_elements_, k,
+                           std::max<size_t>(beam_width_, k), alpha_,
+                           visit_limit_, degree_limit, scratch);
+        // Slots of a failed batch map to no tag and are left out.
+        size_t found = 0;
+        for (const auto& c : scratch.beam) {
+            if (found == k) break;
+            uint32_t tag = tag_map_.tag(c.id);
+            if (tag == TagMap::kNone) continue;
+            tags[found] = static_cast<TagT>(tag);
+            if (distances) distances[found] = c.distance;
+            ++found;
+        }
+        clear_result_row(tags, distances, found, k);
+    }
+
     std::mutex index_mutex;
 
     size_t dim_;
@@ -138,4 +227,15 @@ class ParlayVamana : public IndexBase<T, TagT, LabelT> {
 
     Range data_range_;
     QParams query_params_;
+    // Shared, read-only start set of every search.
+    parlay::sequence<TagT> starting_points_ = {0};
+    // What searches walk instead of G_, so they never see a batch insert
+    // half-applied.
+    std::unique_ptr<SnapshotGraph<TagT>> snapshot_;
+    TouchedNodes touched_;
+    std::vector<uint8_t> stale_;
+    tbb::enumerable_thread_specific<ParlayBeamScratch<TagT>> scratch_;
+    // The library and snapshot_ work in slots (positions in data_range_);
+    // callers only ever see tags.
+    TagMap tag_map_;
 };
\ No newline at end of file
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "../epoch.hpp"
+
+// Read-side copy of a ParlayANN graph that searches can walk while a batch
+// insert rewrites the library's own adjacency lists in place.
+//
+// Every node holds an immutable edge block. The writer publishes a fresh
+// block for each node a batch touched, linked to the block it replaces and
+// stamped with the point count the batch makes visible, then commits that
+// count together with the insert watermark it establishes. A reader pins an
+// epoch, reads the committed pair once, and follows each node's chain back to
+// the newest block stamped at or below the count, so a search sees the graph
+// and point range exactly as of one committed batch and knows its watermark.
+// Replaced blocks are retired after the commit and freed by the
+// EpochManager once no reader pinned before it remains.
+//
+// The point vectors themselves are not copied: PointRange is created with
+// room for max_elements points and extend() appends in place, so the vectors
+// of visible points never move.
+template <typename IdT>
+class SnapshotGraph {
+    struct Block {
+        const Block* prev;
+        size_t visible_at;
+        uint32_t size;
+        const IdT* ids() const {
+            return reinterpret_cast<const IdT*>(this + 1);
+        }
+        IdT* ids() { return reinterpret_cast<IdT*>(this + 1); }
+    };
+
+   public:
+    // Neighbor list of one node, shaped like parlayANN::edgeRange.
+    class EdgeRange {
+       public:
+        EdgeRange(const IdT* ids, size_t size) : ids_(ids), size_(size) {}
+        size_t size() const { return size_; }
+        IdT operator[](size_t j) const { return ids_[j]; }
+        const IdT* begin() const { return ids_; }
+        const IdT* end() const { return ids_ + size_; }
+        void prefetch() const {
+            for (size_t j = 0; j < size_; j += 64 / sizeof(IdT))
+                __builtin_prefetch(ids_ + j);
+        }
+
+       private:
+        const IdT* ids_;
+        size_t size_;
+    };
+
+    // Graph as of one committed batch, shaped like parlayANN::Graph. Only
+    // valid while the EpochManager::Guard it was taken under is alive.
+    class View {
+       public:
+        View(const SnapshotGraph* graph, uint64_t committed)
+            : graph_(graph),
+              visible_(static_cast<uint32_t>(committed)),
+              watermark_(static_cast<uint32_t>(committed >> 32)) {}
+        size_t size() const { return visible_; }
+        // Insert watermark committed with this snapshot.
+        uint32_t watermark() const { return watermark_; }
+        size_t max_degree() const { return graph_->max_degree_; }
+        EdgeRange operator[](size_t i) const {
+            const Block* b = graph_->nodes_[i].load(std::memory_order_acquire);
+            while (b && b->visible_at > visible_) b = b->prev;
+            if (!b) return EdgeRange(nullptr, 0);
+            return EdgeRange(b->ids(), b->size);
+        }
+
+       private:
+        const SnapshotGraph* graph_;
+        size_t visible_;
+        uint32_t watermark_;
+    };
+
+    SnapshotGraph(size_t max_points, size_t max_degree)
+        : max_points_(max_points),
+          max_degree_(max_degree),
+          nodes_(new std::atomic<const Block*>[max_points]) {
+        for (size_t i = 0; i < max_points; ++i) nodes_[i].store(nullptr);
+    }
+
+    ~SnapshotGraph() {
+        // Replaced blocks belong to epochs_ by now; only heads are ours.
+        for (size_t i = 0; i < max_points_; ++i)
+            free_block(const_cast<Block*>(nodes_[i].load()));
+    }
+
+    SnapshotGraph(const SnapshotGraph&) = delete;
+    SnapshotGraph& operator=(const SnapshotGraph&) = delete;
+
+    // Reader side: pin first, then take the view, and keep the guard alive
+    // for as long as the view or any EdgeRange from it is used.
+    EpochManager::Guard pin() { return epochs_.pin(); }
+    View view() const { return View(this, committed_.load()); }
+
+    // Writer side, one writer at a time: publish() the edges of every node
+    // the batch touched, then commit() the new point count and watermark.
+    template <typename Edges>
+    void publish(size_t i, const Edges& edges, size_t visible_at) {
+        size_t size = edges.size();
+        Block* b = static_cast<Block*>(
+            ::operator new(sizeof(Block) + size * sizeof(IdT)));
+        const Block* old = nodes_[i].load(std::memory_order_relaxed);
+        b->prev = old;
+        b->visible_at = visible_at;
+        b->size = static_cast<uint32_t>(size);
+        for (size_t j = 0; j < size; ++j) b->ids()[j] = edges[j];
+        nodes_[i].store(b, std::memory_order_release);
+        if (old) replaced_.push_back(old);
+    }
+
+    // Writer side: whether the newest block of node i holds exactly edges.
+    // Safe to call from several threads while no publish() runs.
+    template <typename Edges>
+    bool current(size_t i, const Edges& edges) const {
+        const Block* b = nodes_[i].load(std::memory_order_relaxed);
+        size_t size = edges.size();
+        if (!b) return size == 0;
+        if (b->size != size) return false;
+        for (size_t j = 0; j < size; ++j)
+            if (b->ids()[j] != edges[j]) return false;
+        return true;
+    }
+
+    void commit(uint32_t visible, uint32_t watermark) {
+        committed_.store(static_cast<uint64_t>(watermark) << 32 | visible);
+        // Only readers that saw the old count can still reach these, and
+        // they pinned before the store above.
+        for (const Block* b : replaced_)
+            epochs_.retire(const_cast<Block*>(b), free_block);
+        replaced_.clear();
+        epochs_.reclaim();
+    }
+
+   private:
+    static void free_block(void* p) { ::operator delete(p); }
+
+    size_t max_points_;
+    size_t max_degree_;
+    std::unique_ptr<std::atomic<const Block*>[]> nodes_;
+    // Point count in the low half, watermark in the high half, so readers
+    // always get a matching pair.
+    std::atomic<uint64_t> committed_{0};
+    std::vector<const Block*> replaced_;
+    EpochManager epochs_;
+};
+
+// Writer-side list of the nodes a batch insert may have changed, for
+// republishing: the new points [first, n), the older nodes they link to, and
+// a window of older nodes swept in turn.
+//
+// Older nodes only change by gaining reverse edges from new points, and the
+// library gives those to the nodes in each new point's list. That list can
+// be pruned again later in the same batch, when the new point gains reverse
+// edges of its own, and then no longer names every node it gave one to. The
+// sweep, as wide as the rest of the list, catches such nodes within a few
+// batches; until then searches see their previous list, which is still a
+// complete one. The whole list costs O(batch size x max degree), however
+// large the index.
+class TouchedNodes {
+   public:
+    template <typename Graph>
+    const std::vector<size_t>& collect(const Graph& graph, size_t first,
+                                       size_t n) {
+        nodes_.clear();
+        for (size_t i = first; i < n; ++i) {
+            nodes_.push_back(i);
+            auto edges = graph[i];
+            for (size_t j = 0; j < edges.size(); ++j)
+                if (edges[j] < first) nodes_.push_back(edges[j]);
+        }
+        size_t window = std::min(first, nodes_.size());
+        for (size_t j = 0; j < window; ++j) {
+            if (sweep_ >= first) sweep_ = 0;
+            nodes_.push_back(sweep_++);
+        }
+        std::sort(nodes_.begin(), nodes_.end());
+        nodes_.erase(std::unique(nodes_.begin(), nodes_.end()), nodes_.end());
+        return nodes_;
+    }
+
+   private:
+    std::vector<size_t> nodes_;
+    size_t sweep_ = 0;  // next older node to sweep
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+// Two-way mapping between caller tags and the dense internal ids (slots) an
+// index assigns in insertion order, for indexes whose library only knows
+// slots. The forward map only guards against mapping a tag twice and is
+// touched by writers alone, one at a time (the adapters hold their index
+// mutex). The reverse map is a plain array indexed by slot that searches
+// read without locking. Tag 0xffffffff is the empty result tag and cannot be
+// mapped.
+class TagMap {
+   public:
+    static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+    explicit TagMap(size_t max_slots) : tags_(new uint32_t[max_slots]) {
+        for (size_t i = 0; i < max_slots; ++i) tags_[i] = kNone;
+    }
+
+    // Maps tags[i] to slot first + i for a whole batch, or nothing at all:
+    // false if any tag is kNone, already mapped, or repeats within the batch.
+    template <typename TagT>
+    bool insert_batch(const TagT* tags, size_t n, size_t first) {
+        // Grown per batch rather than for max_slots up front, and never
+        // shrunk, so a large build rehashes once.
+        size_t want = slots_.size() + n;
+        if (want > slots_.bucket_count() * slots_.max_load_factor())
+            slots_.reserve(want);
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t tag = static_cast<uint32_t>(tags[i]);
+            uint32_t slot = static_cast<uint32_t>(first + i);
+            if (tag != kNone && slots_.emplace(tag, slot).second) {
+                tags_[slot] = tag;
+                continue;
+            }
+            erase_batch(tags, i);
+            return false;
+        }
+        return true;
+    }
+
+    // Unmaps tags[0, n), which must all be mapped; their slots then map to
+    // kNone.
+    template <typename TagT>
+    void erase_batch(const TagT* tags, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            auto it = slots_.find(static_cast<uint32_t>(tags[i]));
+            tags_[it->second] = kNone;
+            slots_.erase(it);
+        }
+    }
+
+    // Tag of slot, or kNone. Slots reach searches only through a published
+    // snapshot, which orders this read after the write of the entry.
+    uint32_t tag(uint32_t slot) const { return tags_[slot]; }
+
+   private:
+    std::unique_ptr<uint32_t[]> tags_;
+    std::unordered_map<uint32_t, uint32_t> slots_;
+};
@@ -64,10 +64,12 @@ class Vamana : public IndexBase<T, TagT, LabelT> {
             auto insert_result =
                 index_->insert_point(data + i * dim_, tags[i] + 1);
         }
+        this->watermark_.complete(tags, num_points);
     }
 
     int insert(const T* data, const TagT tag) override {
         index_->insert_point(data, tag + 1);
+        this->watermark_.complete(tag, tag + 1);
         return 0;
     }
 
@@ -77,6 +79,7 @@ class Vamana : public IndexBase<T, TagT, LabelT> {
         for (size_t i = 0; i < num_points; i++) {
             index_->insert_point(batch_data + i * dim_, batch_tags[i] + 1);
         }
+        this->watermark_.complete(batch_tags, num_points);
         return 0;
     }
 
@@ -84,25 +87,39 @@ class Vamana : public IndexBase<T, TagT, LabelT> {
         Ls_ = params.ef_search;
     }
 
-    int search(const T* query, size_t k,
-               std::vector<TagT>& result_tags) override {
+    int search(const T* query, uint32_t k, TagT* tags,
+               float* distances) override {
+        // DiskANN takes its query scratch from a pool sized at build time,
+        // and an empty res_vectors asks for no vectors to be copied out.
+        std::vector<T*> res_vectors;
+        size_t found = index_->search_with_tags(query, k, Ls_, tags,
+                                                distances, res_vectors);
+        found = std::min<size_t>(found, k);
+        // Tags are stored shifted by one; see insert().
+        for (size_t j = 0; j < found; ++j) tags[j] -= 1;
+        clear_result_row(tags, distances, found, k);
         return 0;
     }
 
     int batch_search(const T* batch_queries, uint32_t k, size_t num_queries,
-                     TagT** batch_results) override {
+                     TagT* tags, uint32_t* watermark) override {
+        if (watermark) *watermark = this->watermark_.load();
 #pragma omp parallel for num_threads(num_threads_)
         for (size_t i = 0; i < num_queries; ++i) {
-            std::vector<TagT> tags_res(k);
-            std::vector<float> distances(k);
-            std::vector<T*> res_vectors;
-
-            index_->search_with_tags(batch_queries + i * dim_, k, Ls_,
-                                     tags_res.data(), nullptr, res_vectors);
+            search(batch_queries + i * dim_, k, tags + i * k, nullptr);
+        }
+        return 0;
+    }
 
-            for (uint32_t j = 0; j < k; ++j) {
-                batch_results[i][j] = tags_res[j] - 1;
-            }
+    int batch_search_with_distances(const T* batch_queries, uint32_t k,
+                                    size_t num_queries, TagT* tags,
+                                    float* distances,
+                                    uint32_t* watermark) override {
+        if (watermark) *watermark = this->watermark_.load();
+#pragma omp parallel for num_threads(num_threads_)
+        for (size_t i = 0; i < num_queries; ++i) {
+            search(batch_queries + i * dim_, k, tags + i * k,
+                   distances + i * k);
         }
         return 0;
     }
@@ -29,6 +29,15 @@ const (
 	DataTypeUint8
 )
 
+// SearchLoop selects the base-layer search loop of adapters that own their
+// search; see SearchLoop in algorithms/index.hpp.
+type SearchLoop int
+
+const (
+	SearchLoopHeap SearchLoop = iota
+	SearchLoopLinear
+)
+
 type IndexParams struct {
 	Dim            int
 	MaxElements    uint64
@@ -45,10 +54,12 @@ type QueryParams struct {
 	BeamWidth  uint
 	Alpha      float32
 	VisitLimit uint
+	SearchLoop SearchLoop
 }
 
 type Index struct {
 	ptr unsafe.Pointer
+	dim int
 }
 
 func NewIndex(indexType IndexType, params IndexParams) *Index {
@@ -64,6 +75,7 @@ func NewIndex(indexType IndexType, params IndexParams) *Index {
 	}
 	return &Index{
 		ptr: C.create_index(C.IndexType(indexType), cParams),
+		dim: params.Dim,
 	}
 }
 
@@ -74,24 +86,24 @@ func (i *Index) Close() {
 	}
 }
 
-func (i *Index) Build(data [][]float32, tags []uint32) error {
+// Build bulk-loads len(tags) points from data, a contiguous
+// len(tags) x dim matrix that is handed to the index without copying.
+func (i *Index) Build(data []float32, tags []uint32) error {
 	if len(data) == 0 || len(tags) == 0 {
 		return nil
 	}
+	if len(data) != len(tags)*i.dim {
+		return fmt.Errorf("build data has %d values for %d points of dim %d", len(data), len(tags), i.dim)
+	}
 
 	startTime := time.Now()
 
-	numPoints := len(data)
-	dim := len(data[0])
-	flatData := make([]float32, numPoints*dim)
-	for j, vec := range data {
-		copy(flatData[j*dim:], vec)
-	}
+	numPoints := len(tags)
 	result := C.build(
 		i.ptr,
-		(*C.float)(&flatData[0]),
+		(*C.float)(&data[0]),
 		(*C.uint32_t)(&tags[0]),
-		C.size_t(len(tags)),
+		C.size_t(numPoints),
 	)
 
 	buildTime := time.Since(startTime)
@@ -128,44 +140,63 @@ func (i *Index) SetQueryParams(params QueryParams) {
 		beam_width:  C.size_t(params.BeamWidth),
 		alpha:       C.float(params.Alpha),
 		visit_limit: C.size_t(params.VisitLimit),
+		search_loop: C.C_SearchLoop(params.SearchLoop),
 	}
 	C.set_query_params(i.ptr, cParams)
 }
 
 func (i *Index) Search(query []float32, k uint) ([]uint32, error) {
 	results := make([]uint32, k)
+	if err := i.SearchInto(query, results, nil); err != nil {
+		return nil, err
+	}
+	return results, nil
+}
+
+// SearchInto searches a single query and writes len(tags) results, nearest
+// first, into the caller's slices, so repeated single searches can reuse
+// their buffers and allocate nothing. dists may be nil; otherwise it must be
+// as long as tags.
+func (i *Index) SearchInto(query []float32, tags []uint32, dists []float32) error {
+	if len(query) == 0 || len(tags) == 0 {
+		return fmt.Errorf("search needs a query and at least one result slot")
+	}
+	var distPtr *C.float
+	if dists != nil {
+		if len(dists) != len(tags) {
+			return fmt.Errorf("search has %d distance slots for %d tags", len(dists), len(tags))
+		}
+		distPtr = (*C.float)(&dists[0])
+	}
 	result := C.search(
 		i.ptr,
 		(*C.float)(&query[0]),
-		C.size_t(k),
-		(*C.uint32_t)(&results[0]),
+		C.uint32_t(len(tags)),
+		(*C.uint32_t)(&tags[0]),
+		distPtr,
 	)
 	if result != 0 {
-		return nil, fmt.Errorf("search failed with code: %d", result)
+		return fmt.Errorf("search failed with code: %d", result)
 	}
-	return results, nil
+	return nil
 }
 
-func (i *Index) BatchInsert(batchData [][]float32, batchTags []uint32) error {
+// BatchInsert inserts len(batchTags) points from batchData, a contiguous
+// len(batchTags) x dim matrix, typically a view into the loaded dataset; it
+// is handed to the index without copying.
+func (i *Index) BatchInsert(batchData []float32, batchTags []uint32) error {
 	if len(batchData) == 0 || len(batchTags) == 0 {
 		return nil
 	}
-
-	numPoints := len(batchData)
-	if numPoints == 0 {
-		return nil
-	}
-	dim := len(batchData[0])
-	flatData := make([]float32, numPoints*dim)
-	for j, vec := range batchData {
-		copy(flatData[j*dim:], vec)
+	if len(batchData) != len(batchTags)*i.dim {
+		return fmt.Errorf("insert batch has %d values for %d points of dim %d", len(batchData), len(batchTags), i.dim)
 	}
 
 	result := C.batch_insert(
 		i.ptr,
-		(*C.float)(&flatData[0]),
+		(*C.float)(&batchData[0]),
 		(*C.uint32_t)(&batchTags[0]),
-		C.size_t(numPoints),
+		C.size_t(len(batchTags)),
 	)
 
 	if result != 0 {
@@ -174,45 +205,46 @@ func (i *Index) BatchInsert(batchData [][]float32, batchTags []uint32) error {
 	return nil
 }
 
-func (i *Index) BatchSearch(queries [][]float32, k uint32) ([][]uint32, error) {
-	if len(queries) == 0 {
-		return nil, nil
+// BatchSearch searches queries, a contiguous n x dim matrix, and writes the
+// n x k results, row by row and nearest first, into tags and, unless it is
+// nil, dists; n is len(tags) / k. Short rows are padded with tag 0xffffffff
+// and distance +Inf. Queries are passed as is and results land directly in
+// the caller's slices, so a caller that reuses its buffers allocates nothing
+// per batch.
+//
+// It returns the insert watermark the batch observed: every tag below it had
+// been inserted and was visible to every query of the batch.
+func (i *Index) BatchSearch(queries []float32, k uint32, tags []uint32, dists []float32) (uint32, error) {
+	if k == 0 || len(tags) == 0 {
+		return 0, nil
 	}
-
-	dim := len(queries[0])
-	flatQueries := make([]float32, 0, len(queries)*dim)
-	for _, q := range queries {
-		flatQueries = append(flatQueries, q...)
+	numQueries := len(tags) / int(k)
+	if len(tags) != numQueries*int(k) || len(queries) != numQueries*i.dim {
+		return 0, fmt.Errorf("search batch has %d query values and %d result slots for k %d, dim %d", len(queries), len(tags), k, i.dim)
 	}
-
-	results := make([][]uint32, len(queries))
-	for j := range results {
-		results[j] = make([]uint32, k)
-	}
-
-	resultPtrs := make([]*C.uint32_t, len(queries))
-	for j := range results {
-		resultPtrs[j] = (*C.uint32_t)(&results[j][0])
-	}
-	resultPtrsC := C.malloc(C.size_t(len(queries)) * C.size_t(unsafe.Sizeof(uintptr(0))))
-	defer C.free(resultPtrsC)
-	ptrSlice := (*[1 << 30]*C.uint32_t)(resultPtrsC)[:len(queries):len(queries)]
-	for j, p := range resultPtrs {
-		ptrSlice[j] = p
+	var distPtr *C.float
+	if dists != nil {
+		if len(dists) != len(tags) {
+			return 0, fmt.Errorf("search batch has %d distance slots for %d tags", len(dists), len(tags))
+		}
+		distPtr = (*C.float)(&dists[0])
 	}
 
+	var watermark C.uint32_t
 	result := C.batch_search(
 		i.ptr,
-		(*C.float)(&flatQueries[0]),
+		(*C.float)(&queries[0]),
 		C.uint32_t(k),
-		C.size_t(len(queries)),
-		(**C.uint32_t)(resultPtrsC),
+		C.size_t(numQueries),
+		(*C.uint32_t)(&tags[0]),
+		distPtr,
+		&watermark,
 	)
 
 	if result != 0 {
-		return nil, fmt.Errorf("batch search failed with code: %d", result)
+		return 0, fmt.Errorf("batch search failed with code: %d", result)
 	}
-	return results, nil
+	return uint32(watermark), nil
 }
 
 func (i *Index) SaveCCStat(path string) {
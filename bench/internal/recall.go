@@ -0,0 +1,134 @@
+package internal
+
+// #include <stdlib.h>
+// #include "../algorithms/index_cgo.hpp"
+import "C"
+import (
+	"fmt"
+	"unsafe"
+)
+
+// StageRecall is the running recall of the searches seen at one insert
+// offset. Recall is a percentage over the Count scored queries; Unmatched
+// queries had no ground truth at that offset.
+type StageRecall struct {
+	InsertOffset uint64
+	Recall       float64
+	Count        uint64
+	Unmatched    uint64
+}
+
+// RecallEvaluator scores search results against a stagewise ground truth file
+// on a background thread inside the index library, so recall is known while
+// the benchmark runs and no results have to be kept for a post-run pass.
+type RecallEvaluator struct {
+	ptr unsafe.Pointer
+}
+
+func NewRecallEvaluator(gtPath string, recallAt uint32) (*RecallEvaluator, error) {
+	cpath := C.CString(gtPath)
+	defer C.free(unsafe.Pointer(cpath))
+	ptr := C.create_recall_evaluator(cpath, C.uint32_t(recallAt))
+	if ptr == nil {
+		return nil, fmt.Errorf("failed to open ground truth %s", gtPath)
+	}
+	return &RecallEvaluator{ptr: ptr}, nil
+}
+
+func (r *RecallEvaluator) Close() {
+	if r.ptr != nil {
+		C.destroy_recall_evaluator(r.ptr)
+		r.ptr = nil
+	}
+}
+
+// Submit queues the results of one search batch seen at insertOffset. tags
+// holds len(queryIdx) x k values, row by row, with empty slots set to
+// 0xffffffff.
+func (r *RecallEvaluator) Submit(insertOffset uint64, queryIdx []uint32, tags []uint32, k uint32) error {
+	if len(queryIdx) == 0 || k == 0 {
+		return nil
+	}
+	if len(tags) != len(queryIdx)*int(k) {
+		return fmt.Errorf("recall batch has %d tags, want %d", len(tags), len(queryIdx)*int(k))
+	}
+	result := C.recall_submit(
+		r.ptr,
+		C.uint64_t(insertOffset),
+		(*C.uint32_t)(&queryIdx[0]),
+		(*C.uint32_t)(&tags[0]),
+		C.size_t(len(queryIdx)),
+		C.uint32_t(k),
+	)
+	if result != 0 {
+		return fmt.Errorf("recall submit failed with code: %d", result)
+	}
+	return nil
+}
+
+// Flush waits until every submitted batch has been scored.
+func (r *RecallEvaluator) Flush() {
+	C.recall_flush(r.ptr)
+}
+
+func stageRecall(s C.C_StageRecall) StageRecall {
+	stage := StageRecall{
+		InsertOffset: uint64(s.insert_offset),
+		Count:        uint64(s.count),
+		Unmatched:    uint64(s.unmatched),
+	}
+	if s.count > 0 {
+		stage.Recall = float64(s.recall_sum) / float64(s.count) * 100
+	}
+	return stage
+}
+
+// ComputeRecall scores numQueries x k result tags against the ground truth
+// file at gtPath (as written by compute_gt) and returns recall@recallAt as a
+// percentage. With ties set, neighbors tied with the recallAt-th one count as
+// hits when the file holds distances.
+func ComputeRecall(gtPath string, tags []uint32, k uint32, recallAt uint32, ties bool) (float64, error) {
+	if k == 0 || len(tags) == 0 || len(tags)%int(k) != 0 {
+		return 0, fmt.Errorf("invalid result matrix: %d tags with k %d", len(tags), k)
+	}
+	cpath := C.CString(gtPath)
+	defer C.free(unsafe.Pointer(cpath))
+	cties := C.int(0)
+	if ties {
+		cties = 1
+	}
+	recall := C.compute_recall_from_file(
+		cpath,
+		(*C.uint32_t)(&tags[0]),
+		C.uint32_t(k),
+		C.size_t(len(tags)/int(k)),
+		C.uint32_t(recallAt),
+		cties,
+	)
+	if recall < 0 {
+		return 0, fmt.Errorf("failed to compute recall@%d against %s", recallAt, gtPath)
+	}
+	return float64(recall), nil
+}
+
+// Stages returns the running recall of every insert offset seen so far.
+func (r *RecallEvaluator) Stages() []StageRecall {
+	n := C.recall_num_stages(r.ptr)
+	if n == 0 {
+		return nil
+	}
+	buf := make([]C.C_StageRecall, n)
+	n = C.recall_stages(r.ptr, &buf[0], n)
+	stages := make([]StageRecall, n)
+	for i := range stages {
+		stages[i] = stageRecall(buf[i])
+	}
+	return stages
+}
+
+// Overall returns the running recall over all scored queries.
+func (r *RecallEvaluator) Overall() StageRecall {
+	var total C.C_StageRecall
+	C.recall_overall(r.ptr, &total)
+	return stageRecall(total)
+}
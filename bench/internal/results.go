@@ -0,0 +1,141 @@
+package internal
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"math"
+	"os"
+	"sync"
+)
+
+// Binary stagewise result layout shared with utils/result_format.hpp: a
+// 40-byte header, one block of fixed-width columns per search batch, then an
+// 8-byte aligned index of 24-byte batch entries.
+const (
+	resultMagic        uint32 = 0x53455253 // "SRES"
+	resultVersion      uint32 = 1
+	resultHasDistances uint32 = 1
+	resultEmpty        uint32 = 0xffffffff
+	resultHeaderSize          = 40
+)
+
+// ResultWriter streams search results to a .sres file as they are produced,
+// so the bench does not have to hold them in memory until the run ends.
+type ResultWriter struct {
+	mu      sync.Mutex
+	file    *os.File
+	w       *bufio.Writer
+	k       uint32
+	flags   uint32
+	offset  uint64
+	results uint64
+	index   []byte
+	buf     []byte
+}
+
+func NewResultWriter(path string, k uint32, withDistances bool) (*ResultWriter, error) {
+	file, err := os.Create(path)
+	if err != nil {
+		return nil, fmt.Errorf("failed to create result file: %v", err)
+	}
+	r := &ResultWriter{
+		file:   file,
+		w:      bufio.NewWriterSize(file, 1<<20),
+		k:      k,
+		offset: resultHeaderSize,
+	}
+	if withDistances {
+		r.flags = resultHasDistances
+	}
+	if _, err := r.w.Write(r.header(0)); err != nil {
+		file.Close()
+		return nil, fmt.Errorf("failed to write result header: %v", err)
+	}
+	return r, nil
+}
+
+func (r *ResultWriter) header(indexOffset uint64) []byte {
+	h := make([]byte, resultHeaderSize)
+	binary.LittleEndian.PutUint32(h[0:], resultMagic)
+	binary.LittleEndian.PutUint32(h[4:], resultVersion)
+	binary.LittleEndian.PutUint32(h[8:], r.k)
+	binary.LittleEndian.PutUint32(h[12:], r.flags)
+	binary.LittleEndian.PutUint64(h[16:], r.results)
+	binary.LittleEndian.PutUint64(h[24:], uint64(len(r.index)/24))
+	binary.LittleEndian.PutUint64(h[32:], indexOffset)
+	return h
+}
+
+// WriteBatch appends the results of one search call, all seen at
+// insertOffset. tags (and dists, when the file was opened with distances)
+// hold len(queryIdx) x k values, row by row; dists may be nil otherwise.
+func (r *ResultWriter) WriteBatch(insertOffset uint64, queryIdx []uint32, tags []uint32, dists []float32) error {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	count := len(queryIdx)
+	k := int(r.k)
+	cols := 1 + k
+	if r.flags&resultHasDistances != 0 {
+		cols += k
+		if len(dists) != count*k {
+			return fmt.Errorf("result batch has %d distances, want %d", len(dists), count*k)
+		}
+	}
+	if len(tags) != count*k {
+		return fmt.Errorf("result batch has %d tags, want %d", len(tags), count*k)
+	}
+	size := count * cols * 4
+	if cap(r.buf) < size {
+		r.buf = make([]byte, size)
+	}
+	buf := r.buf[:size]
+	for i, q := range queryIdx {
+		binary.LittleEndian.PutUint32(buf[i*4:], q)
+	}
+	tagCol := buf[count*4:]
+	for i, v := range tags {
+		binary.LittleEndian.PutUint32(tagCol[i*4:], v)
+	}
+	if r.flags&resultHasDistances != 0 {
+		distCol := tagCol[count*k*4:]
+		for i, v := range dists {
+			binary.LittleEndian.PutUint32(distCol[i*4:], math.Float32bits(v))
+		}
+	}
+	if _, err := r.w.Write(buf); err != nil {
+		return fmt.Errorf("failed to write result batch: %v", err)
+	}
+
+	var entry [24]byte
+	binary.LittleEndian.PutUint64(entry[0:], insertOffset)
+	binary.LittleEndian.PutUint64(entry[8:], r.offset)
+	binary.LittleEndian.PutUint32(entry[16:], uint32(count))
+	r.index = append(r.index, entry[:]...)
+	r.offset += uint64(size)
+	r.results += uint64(count)
+	return nil
+}
+
+// Close writes the batch index and the final header.
+func (r *ResultWriter) Close() error {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	defer r.file.Close()
+
+	padding := (8 - r.offset%8) % 8
+	if _, err := r.w.Write(make([]byte, padding)); err != nil {
+		return fmt.Errorf("failed to write result index: %v", err)
+	}
+	if _, err := r.w.Write(r.index); err != nil {
+		return fmt.Errorf("failed to write result index: %v", err)
+	}
+	if err := r.w.Flush(); err != nil {
+		return fmt.Errorf("failed to flush result file: %v", err)
+	}
+	if _, err := r.file.WriteAt(r.header(r.offset+padding), 0); err != nil {
+		return fmt.Errorf("failed to write result header: %v", err)
+	}
+	return nil
+}
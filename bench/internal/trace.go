@@ -0,0 +1,70 @@
+package internal
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"os"
+	"sync"
+)
+
+// Search trace layout shared with utils/gt_format.hpp: a uint32 magic and
+// version header followed by one 16-byte little-endian record per search
+// (uint64 search id, uint32 query index, uint32 watermark).
+const (
+	searchTraceMagic   uint32 = 0x52544753 // "SGTR"
+	searchTraceVersion uint32 = 1
+)
+
+// TraceWriter appends search events to a trace file for compute_incr_gt
+// --trace. Search ids are assigned in recording order.
+type TraceWriter struct {
+	mu     sync.Mutex
+	file   *os.File
+	w      *bufio.Writer
+	nextID uint64
+}
+
+func NewTraceWriter(path string) (*TraceWriter, error) {
+	file, err := os.Create(path)
+	if err != nil {
+		return nil, fmt.Errorf("failed to create trace file: %v", err)
+	}
+	t := &TraceWriter{file: file, w: bufio.NewWriterSize(file, 1<<20)}
+	var header [8]byte
+	binary.LittleEndian.PutUint32(header[0:], searchTraceMagic)
+	binary.LittleEndian.PutUint32(header[4:], searchTraceVersion)
+	if _, err := t.w.Write(header[:]); err != nil {
+		file.Close()
+		return nil, fmt.Errorf("failed to write trace header: %v", err)
+	}
+	return t, nil
+}
+
+// Record appends one event per query of a search batch, all seen at the
+// same watermark.
+func (t *TraceWriter) Record(queryIdx []uint32, watermark uint32) error {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	var rec [16]byte
+	for _, q := range queryIdx {
+		binary.LittleEndian.PutUint64(rec[0:], t.nextID)
+		binary.LittleEndian.PutUint32(rec[8:], q)
+		binary.LittleEndian.PutUint32(rec[12:], watermark)
+		if _, err := t.w.Write(rec[:]); err != nil {
+			return fmt.Errorf("failed to write trace event: %v", err)
+		}
+		t.nextID++
+	}
+	return nil
+}
+
+func (t *TraceWriter) Close() error {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	if err := t.w.Flush(); err != nil {
+		t.file.Close()
+		return fmt.Errorf("failed to flush trace file: %v", err)
+	}
+	return t.file.Close()
+}
@@ -2,6 +2,7 @@ package main
 
 import (
 	"ANN-CC-bench/bench/internal"
+	"bufio"
 	"context"
 	"encoding/binary"
 	"encoding/csv"
@@ -9,11 +10,9 @@ import (
 	"fmt"
 	"log"
 	"os"
-	"os/exec"
 	"path/filepath"
 	"runtime"
 	"sort"
-	"strings"
 	"sync"
 	"sync/atomic"
 	"time"
@@ -32,9 +31,11 @@ const (
 	SearchTask
 )
 
+// Task is one batch of work. Data holds its vectors as a contiguous
+// len(Tags) x dim matrix, normally a view into the loaded dataset.
 type Task struct {
 	Type      TaskType
-	Data      [][]float32
+	Data      []float32
 	Tags      []uint32
 	QueryIdx  uint32
 	RecallAt  uint32
@@ -49,9 +50,9 @@ type Stat struct {
 }
 
 type Index interface {
-	BatchInsert(data [][]float32, tags []uint32) error
-	BatchSearch(queries [][]float32, recallAt uint32) ([][]uint32, error)
-	Build(data [][]float32, tags []uint32) error
+	BatchInsert(data []float32, tags []uint32) error
+	BatchSearch(queries []float32, k uint32, tags []uint32, dists []float32) (uint32, error)
+	Build(data []float32, tags []uint32) error
 	SetQueryParams(params internal.QueryParams)
 }
 
@@ -60,20 +61,20 @@ type Bench struct {
 	index           Index
 	stats           Stat
 	mu              sync.Mutex
-	rwMu            sync.RWMutex
 	wg              sync.WaitGroup
 	insertCnt       int
 	searchCnt       int
 	insertLatencies []float64
 	searchLatencies []float64
 	rateLimiter     *rate.Limiter
-	searchResults   []*internal.SearchResult
-	resultsMu       sync.Mutex
+	results         *internal.ResultWriter
+	recall          *internal.RecallEvaluator
 	config          *Config
 	insertPointCnt  int
 	searchPointCnt  int
 	globalInsertCnt int64
 	startTime       time.Time
+	trace           *internal.TraceWriter
 }
 
 func ConcurrentBench(index Index, config Config) *Bench {
@@ -109,32 +110,38 @@ func (b *Bench) ProduceTasks(data []float32, queries []float32, dim int, config
 		if endInsertOffset > startInsertOffset {
 			task := Task{
 				Type: InsertTask,
-				Data: make([][]float32, 0, endInsertOffset-startInsertOffset),
+				Data: data[startInsertOffset*dim : endInsertOffset*dim],
 				Tags: make([]uint32, 0, endInsertOffset-startInsertOffset),
 			}
 			for i := startInsertOffset; i < endInsertOffset; i++ {
-				start := i * dim
-				end := start + dim
-				task.Data = append(task.Data, data[start:end])
 				task.Tags = append(task.Tags, uint32(i))
 			}
 			b.taskQueue <- task
 		}
 
-		batchQueries := make([][]float32, 0, searchBatchSize)
 		batchTags := make([]uint32, 0, searchBatchSize)
 		totalQueries := len(queries) / dim
 		maxQueryIdx := min(config.Data.MaxQueries, totalQueries)
 		for i := 0; i < searchBatchSize; i++ {
-			idx := queryIdx % maxQueryIdx
-			start := idx * dim
-			end := start + dim
-			batchQueries = append(batchQueries, queries[start:end])
-			batchTags = append(batchTags, uint32(idx))
+			batchTags = append(batchTags, uint32(queryIdx%maxQueryIdx))
 			queryIdx++
 		}
+		// A batch is a view of the query set unless it wraps around its end,
+		// which is the only case that needs a copy.
+		var batchQueries []float32
+		if len(batchTags) > 0 {
+			first := int(batchTags[0])
+			if first+len(batchTags) <= maxQueryIdx {
+				batchQueries = queries[first*dim : (first+len(batchTags))*dim]
+			} else {
+				batchQueries = make([]float32, 0, len(batchTags)*dim)
+				for _, idx := range batchTags {
+					batchQueries = append(batchQueries, queries[int(idx)*dim:(int(idx)+1)*dim]...)
+				}
+			}
+		}
 
-		if len(batchQueries) > 0 {
+		if len(batchTags) > 0 {
 			if err := b.rateLimiter.Wait(context.Background()); err != nil {
 				fmt.Printf("Rate limit error: %v\n", err)
 				continue
@@ -146,43 +153,36 @@ func (b *Bench) ProduceTasks(data []float32, queries []float32, dim int, config
 				RecallAt:  config.Search.RecallAt,
 				Timestamp: time.Now(),
 			}
-			b.searchCnt += len(batchQueries)
+			b.searchCnt += len(batchTags)
 		}
 	}
 }
 
 func (b *Bench) ConsumeTasks(numWorkers int) {
 
-	b.index.SetQueryParams(internal.QueryParams{
-		EfSearch:   uint(b.config.Search.EfSearch),
-		BeamWidth:  uint(b.config.Search.BeamWidth),
-		Alpha:      b.config.Search.Alpha,
-		VisitLimit: uint(b.config.Search.VisitLimit),
-	})
+	b.index.SetQueryParams(queryParams(b.config))
 
 	for i := 0; i < numWorkers; i++ {
 		b.wg.Add(1)
 		go func(workerId int) {
 			defer b.wg.Done()
+			// Result buffers are reused across this worker's searches; the
+			// result writer and the recall evaluator copy what they keep.
+			var resTags []uint32
+			var resDists []float32
 			for task := range b.taskQueue {
 				start := time.Now()
 				switch task.Type {
 				case InsertTask:
-					if b.config.Workload.EnforceConsistency {
-						b.rwMu.Lock()
-					}
 					err := b.index.BatchInsert(task.Data, task.Tags)
-					if b.config.Workload.EnforceConsistency {
-						b.rwMu.Unlock()
-					}
 					if err != nil {
 						fmt.Printf("Insert error: %v\n", err)
 						continue
 					}
 					b.insertLatencies = append(b.insertLatencies, float64(time.Since(start).Milliseconds()))
 					b.insertCnt++
-					b.insertPointCnt += len(task.Data)
-					atomic.AddInt64(&b.globalInsertCnt, int64(len(task.Data)))
+					b.insertPointCnt += len(task.Tags)
+					atomic.AddInt64(&b.globalInsertCnt, int64(len(task.Tags)))
 					if len(task.Tags) > 0 {
 						minTag := task.Tags[0]
 						maxTag := task.Tags[0]
@@ -197,30 +197,39 @@ func (b *Bench) ConsumeTasks(numWorkers int) {
 						// fmt.Printf("InsertTask: tag range [%d, %d], len=%d\n", minTag, maxTag, len(task.Tags))
 					}
 				case SearchTask:
-					if b.config.Workload.EnforceConsistency {
-						b.rwMu.RLock()
-					}
-					results, err := b.index.BatchSearch(task.Data, uint32(task.RecallAt))
-					if b.config.Workload.EnforceConsistency {
-						b.rwMu.RUnlock()
+					cells := len(task.Tags) * int(task.RecallAt)
+					if cap(resTags) < cells {
+						resTags = make([]uint32, cells)
+						resDists = make([]float32, cells)
 					}
+					tags, dists := resTags[:cells], resDists[:cells]
+					// The index reports the insert watermark the batch saw:
+					// every tag below it was visible to the search, so
+					// results can be scored against that prefix without
+					// holding inserts back.
+					watermark, err := b.index.BatchSearch(task.Data, task.RecallAt, tags, dists)
 					if err != nil {
 						fmt.Printf("Search error: %v\n", err)
 						continue
 					}
-					b.resultsMu.Lock()
-					for i, tags := range results {
-						result := internal.NewSearchResult(
-							uint64(b.insertCnt),
-							uint64(i),
-							tags,
-						)
-						b.searchResults = append(b.searchResults, result)
+					if b.trace != nil {
+						if err := b.trace.Record(task.Tags, watermark); err != nil {
+							fmt.Printf("Trace error: %v\n", err)
+						}
+					}
+					if b.results != nil {
+						if err := b.results.WriteBatch(uint64(watermark), task.Tags, tags, dists); err != nil {
+							fmt.Printf("Result write error: %v\n", err)
+						}
+					}
+					if b.recall != nil {
+						if err := b.recall.Submit(uint64(watermark), task.Tags, tags, task.RecallAt); err != nil {
+							fmt.Printf("Recall submit error: %v\n", err)
+						}
 					}
-					b.resultsMu.Unlock()
 					b.searchLatencies = append(b.searchLatencies, float64(time.Since(start).Milliseconds()))
 					b.searchCnt++
-					b.searchPointCnt += len(task.Data)
+					b.searchPointCnt += len(task.Tags)
 				}
 			}
 		}(i)
@@ -236,7 +245,11 @@ func (b *Bench) PrintProgress(totalInsert int) {
 			elapsed := time.Since(b.startTime).Seconds()
 			insertQPS := float64(current) / elapsed
 			searchQPS := float64(b.searchPointCnt) / elapsed
-			fmt.Printf("Progress: %d/%d (%d%%), Insert QPS: %.2f, Search QPS: %.2f\n", current, totalInsert, percent, insertQPS, searchQPS)
+			if b.recall != nil {
+				fmt.Printf("Progress: %d/%d (%d%%), Insert QPS: %.2f, Search QPS: %.2f, Recall: %.2f%%\n", current, totalInsert, percent, insertQPS, searchQPS, b.recall.Overall().Recall)
+			} else {
+				fmt.Printf("Progress: %d/%d (%d%%), Insert QPS: %.2f, Search QPS: %.2f\n", current, totalInsert, percent, insertQPS, searchQPS)
+			}
 			lastPercent = percent
 		}
 		if current >= totalInsert {
@@ -346,92 +359,103 @@ func (b *Bench) CollectStats(elapsedSec float64) {
 	}
 }
 
+// WriteOnlineRecall waits for the online evaluator to drain, prints the
+// stagewise recall and, if configured, writes it in calc_incr_recall's format.
+func (b *Bench) WriteOnlineRecall(config *Config) error {
+	b.recall.Flush()
+	overall := b.recall.Overall()
+	fmt.Printf("Online stagewise recall: %.4f%% over %d queries", overall.Recall, overall.Count)
+	if overall.Unmatched > 0 {
+		fmt.Printf(" (%d queries had no ground truth)", overall.Unmatched)
+	}
+	fmt.Println()
+	if config.Result.OnlineRecallPath == "" {
+		return nil
+	}
+
+	file, err := os.Create(config.Result.OnlineRecallPath)
+	if err != nil {
+		return fmt.Errorf("failed to create recall file: %v", err)
+	}
+	defer file.Close()
+	w := bufio.NewWriter(file)
+	fmt.Fprintf(w, "Batch Offset\tAverage Recall\tEntry Count\n")
+	for _, stage := range b.recall.Stages() {
+		if stage.Count > 0 {
+			fmt.Fprintf(w, "%d\t%g\t%d\n", stage.InsertOffset, stage.Recall, stage.Count)
+		}
+	}
+	if err := w.Flush(); err != nil {
+		return fmt.Errorf("failed to write recall file: %v", err)
+	}
+	fmt.Printf("Online recall written to: %s\n", config.Result.OnlineRecallPath)
+	return nil
+}
+
 func (b *Bench) CalcRecall(queries []float32, dataDim int, config *Config) (float64, error) {
 	fmt.Println()
-	if config.Result.GtPath == "" || config.Result.RecallToolPath == "" {
-		fmt.Println("No ground truth or recall tool path provided, skipping recall check")
+	if config.Result.GtPath == "" {
+		fmt.Println("No ground truth path provided, skipping recall check")
 		return 0, nil
 	}
 
 	fmt.Println("Calculating recall against ground truth...")
 
-	b.index.SetQueryParams(internal.QueryParams{
-		EfSearch:   uint(b.config.Search.EfSearch),
-		BeamWidth:  uint(b.config.Search.BeamWidth),
-		Alpha:      b.config.Search.Alpha,
-		VisitLimit: uint(b.config.Search.VisitLimit),
-	})
+	b.index.SetQueryParams(queryParams(b.config))
 
 	recallAt := config.Search.RecallAt
 
-	outPath := config.Result.SearchResPath
-	file, err := os.Create(outPath)
-	if err != nil {
-		return 0, fmt.Errorf("failed to create result file: %v", err)
-	}
-	defer file.Close()
-
 	numQueries := len(queries) / dataDim
-	batchedQueries := make([][]float32, numQueries)
-	for i := 0; i < numQueries; i++ {
-		batchedQueries[i] = queries[i*dataDim : (i+1)*dataDim]
-	}
-	tags, err := b.index.BatchSearch(batchedQueries, uint32(recallAt))
-	if err != nil {
+	tags := make([]uint32, numQueries*int(recallAt))
+	if _, err := b.index.BatchSearch(queries[:numQueries*dataDim], recallAt, tags, nil); err != nil {
 		return 0, fmt.Errorf("batch search error: %v", err)
 	}
 
+	k := int(recallAt)
 	for i := 0; i < numQueries && i < 5; i++ {
 		fmt.Printf("tags[%d]: ", i)
-		for j := 0; j < len(tags[i]) && j < 5; j++ {
-			fmt.Printf("%d ", tags[i][j])
+		for j := 0; j < k && j < 5; j++ {
+			fmt.Printf("%d ", tags[i*k+j])
 		}
 		fmt.Println()
 	}
 
-	n := int32(len(tags))
-	k := int32(len(tags[0]))
-	if err := binary.Write(file, binary.LittleEndian, n); err != nil {
-		return 0, fmt.Errorf("failed to write n: %v", err)
-	}
-	if err := binary.Write(file, binary.LittleEndian, k); err != nil {
-		return 0, fmt.Errorf("failed to write k: %v", err)
-	}
-	for i := 0; i < int(n); i++ {
-		for j := 0; j < int(k); j++ {
-			id := tags[i][j]
-			if err := binary.Write(file, binary.LittleEndian, id); err != nil {
-				return 0, fmt.Errorf("failed to write id: %v", err)
-			}
+	if outPath := config.Result.SearchResPath; outPath != "" {
+		if err := writeSearchResults(outPath, tags, numQueries, k); err != nil {
+			return 0, err
 		}
+		fmt.Printf("Search results written to: %s\n", outPath)
 	}
-	fmt.Printf("Search results written to: %s\n", outPath)
 
-	cmd := exec.Command(config.Result.RecallToolPath,
-		config.Result.GtPath,
-		config.Result.SearchResPath,
-		fmt.Sprintf("%d", recallAt),
-	)
-	output, err := cmd.CombinedOutput()
-	fmt.Printf("Running calc_recall: %s\n", strings.Join(cmd.Args, " "))
+	recall, err := internal.ComputeRecall(config.Result.GtPath, tags, recallAt, recallAt, config.Search.RecallTies)
 	if err != nil {
-		return 0, fmt.Errorf("failed to run calc_recall: %v, output: %s", err, string(output))
-	}
-
-	recall := 0.0
-	lines := strings.Split(string(output), "\n")
-	for _, line := range lines {
-		if strings.Contains(line, "recall@") && strings.Contains(line, "%") {
-			parts := strings.Split(line, "=")
-			if len(parts) == 2 {
-				fmt.Sscanf(parts[1], "%f%%", &recall)
-			}
-		}
+		return 0, err
 	}
 	fmt.Printf("Recall: %.4f%%\n", recall)
 	return recall, nil
 }
 
+// writeSearchResults saves an n x k tag matrix in the ids-only truthset
+// layout that calc_recall reads.
+func writeSearchResults(path string, tags []uint32, n, k int) error {
+	file, err := os.Create(path)
+	if err != nil {
+		return fmt.Errorf("failed to create result file: %v", err)
+	}
+	defer file.Close()
+	w := bufio.NewWriter(file)
+	if err := binary.Write(w, binary.LittleEndian, [2]int32{int32(n), int32(k)}); err != nil {
+		return fmt.Errorf("failed to write result header: %v", err)
+	}
+	if err := binary.Write(w, binary.LittleEndian, tags); err != nil {
+		return fmt.Errorf("failed to write result tags: %v", err)
+	}
+	if err := w.Flush(); err != nil {
+		return fmt.Errorf("failed to write result file: %v", err)
+	}
+	return nil
+}
+
 func min(a, b int) int {
 	if a < b {
 		return a
@@ -490,23 +514,31 @@ type Config struct {
 		BeamWidth  uint32  `yaml:"beam_width"`
 		Alpha      float32 `yaml:"alpha"`
 		VisitLimit uint32  `yaml:"visit_limit"`
+		// Base-layer search loop of the hnsw index: "heap" (default) or
+		// "linear".
+		SearchLoop string `yaml:"search_loop"`
+		// Count ground truth neighbors tied with the recall_at-th one as
+		// hits in the final recall check. Off by default.
+		RecallTies bool `yaml:"recall_ties"`
 	} `yaml:"search"`
 
 	Workload struct {
-		WriteRatio         float64 `yaml:"write_ratio"`
-		NumThreads         int     `yaml:"num_threads"`
-		QueueSize          int     `yaml:"queue_size"`
-		QueryNewData       bool    `yaml:"query_new_data"`
-		InputRate          float64 `yaml:"input_rate"`
-		EnforceConsistency bool    `yaml:"enforce_consistency"`
+		WriteRatio   float64 `yaml:"write_ratio"`
+		NumThreads   int     `yaml:"num_threads"`
+		QueueSize    int     `yaml:"queue_size"`
+		QueryNewData bool    `yaml:"query_new_data"`
+		InputRate    float64 `yaml:"input_rate"`
 	} `yaml:"workload"`
 
 	Result struct {
-		OutputDir      string `yaml:"output_dir"`
-		GtPath         string `yaml:"gt_path"`
-		SearchResPath  string `yaml:"search_res_path"`
-		RecallToolPath string `yaml:"recall_tool_path"`
-		CCStatPath     string `yaml:"cc_stat_path"`
+		OutputDir        string `yaml:"output_dir"`
+		GtPath           string `yaml:"gt_path"`
+		SearchResPath    string `yaml:"search_res_path"`
+		CCStatPath       string `yaml:"cc_stat_path"`
+		TracePath        string `yaml:"trace_path"`
+		StagewisePath    string `yaml:"stagewise_res_path"`
+		OnlineGtPath     string `yaml:"online_gt_path"`
+		OnlineRecallPath string `yaml:"online_recall_path"`
 	} `yaml:"result"`
 }
 
@@ -521,13 +553,52 @@ func loadConfig(filename string) (*Config, error) {
 	if err != nil {
 		return nil, fmt.Errorf("error parsing config file: %v", err)
 	}
+	if _, ok := searchLoops[config.Search.SearchLoop]; !ok {
+		return nil, fmt.Errorf("unknown search_loop %q", config.Search.SearchLoop)
+	}
 
 	return config, nil
 }
 
+var searchLoops = map[string]internal.SearchLoop{
+	"":       internal.SearchLoopHeap,
+	"heap":   internal.SearchLoopHeap,
+	"linear": internal.SearchLoopLinear,
+}
+
+func queryParams(config *Config) internal.QueryParams {
+	return internal.QueryParams{
+		EfSearch:   uint(config.Search.EfSearch),
+		BeamWidth:  uint(config.Search.BeamWidth),
+		Alpha:      config.Search.Alpha,
+		VisitLimit: uint(config.Search.VisitLimit),
+		SearchLoop: searchLoops[config.Search.SearchLoop],
+	}
+}
+
 func finishBench(bench *Bench, queries []float32, dataDim int, config *Config, start time.Time) {
 	elapsedSec := time.Since(start).Seconds()
 	fmt.Println("Streaming bench done")
+	if bench.recall != nil {
+		if err := bench.WriteOnlineRecall(config); err != nil {
+			fmt.Printf("Failed to write online recall: %v\n", err)
+		}
+		bench.recall.Close()
+	}
+	if bench.results != nil {
+		if err := bench.results.Close(); err != nil {
+			fmt.Printf("Failed to write stagewise results: %v\n", err)
+		} else {
+			fmt.Printf("Stagewise results saved to %s\n", config.Result.StagewisePath)
+		}
+	}
+	if bench.trace != nil {
+		if err := bench.trace.Close(); err != nil {
+			fmt.Printf("Failed to write trace: %v\n", err)
+		} else {
+			fmt.Printf("Search trace saved to %s\n", config.Result.TracePath)
+		}
+	}
 	var recall float64 = 0
 	var err error
 	if config.Result.GtPath != "" {
@@ -628,15 +699,12 @@ func main() {
 
 	beginNum := config.Data.BeginNum
 	if beginNum != 0 {
-		preData := make([][]float32, 0, beginNum)
+		preData := data[:beginNum*dataDim]
 		preTags := make([]uint32, 0, beginNum)
 		for i := 0; i < beginNum; i++ {
-			start := i * dataDim
-			end := start + dataDim
-			preData = append(preData, data[start:end])
 			preTags = append(preTags, uint32(i))
 		}
-		fmt.Println("Begin size:", len(preData))
+		fmt.Println("Begin size:", len(preTags))
 		if err := index.Build(preData, preTags); err != nil {
 			fmt.Printf("Warn start error: %v\n", err)
 			return
@@ -646,7 +714,27 @@ func main() {
 
 	var bench *Bench
 	bench = ConcurrentBench(index, *config)
-	bench.searchResults = make([]*internal.SearchResult, 0, config.Data.MaxElements)
+	if config.Result.OnlineGtPath != "" {
+		bench.recall, err = internal.NewRecallEvaluator(config.Result.OnlineGtPath, config.Search.RecallAt)
+		if err != nil {
+			fmt.Printf("Failed to open online recall: %v\n", err)
+			return
+		}
+	}
+	if config.Result.StagewisePath != "" {
+		bench.results, err = internal.NewResultWriter(config.Result.StagewisePath, config.Search.RecallAt, true)
+		if err != nil {
+			fmt.Printf("Failed to open stagewise results: %v\n", err)
+			return
+		}
+	}
+	if config.Result.TracePath != "" {
+		bench.trace, err = internal.NewTraceWriter(config.Result.TracePath)
+		if err != nil {
+			fmt.Printf("Failed to open trace: %v\n", err)
+			return
+		}
+	}
 
 	go func() {
 		log.Println(http.ListenAndServe("0.0.0.0:6060", nil))
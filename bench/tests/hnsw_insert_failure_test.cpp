@@ -0,0 +1,50 @@
+// A batch that overflows the HNSW index must fail, yet still complete its tag
+// range in the insert watermark, so later batches and searches are not held
+// back behind it.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <vector>
+
+#include "hnsw/hnsw.hpp"
+
+#define CHECK(cond)                                                    \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, \
+                         __LINE__, #cond);                             \
+            std::exit(1);                                              \
+        }                                                              \
+    } while (0)
+
+// Insert watermark as batch_search reports it; no queries are run.
+uint32_t watermark(HNSW<float>& index) {
+    uint32_t w = 0;
+    CHECK(index.batch_search(nullptr, 1, 0, nullptr, &w) == 0);
+    return w;
+}
+
+int main() {
+    const size_t dim = 4, max_elements = 8, total = 16;
+    HNSW<float> index(max_elements, dim, 2, 8, 32);
+    std::vector<float> data(total * dim);
+    std::iota(data.begin(), data.end(), 0.0f);
+    std::vector<uint32_t> tags(total);
+    std::iota(tags.begin(), tags.end(), 0u);
+
+    index.build(data.data(), tags.data(), 4);
+    CHECK(watermark(index) == 4);
+
+    // Tags 4..11: only four of them fit.
+    CHECK(index.batch_insert(data.data() + 4 * dim, tags.data() + 4, 8) ==
+          -1);
+    CHECK(watermark(index) == 12);
+
+    CHECK(index.insert(data.data() + 12 * dim, 12) == -1);
+    CHECK(watermark(index) == 13);
+
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,52 @@
+// InsertWatermark over batches of arbitrary, out-of-order tags: the watermark
+// never moves backwards, and it closes up as soon as every gap is filled.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+#include "index.hpp"
+
+#define CHECK(cond)                                                    \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, \
+                         __LINE__, #cond);                             \
+            std::exit(1);                                              \
+        }                                                              \
+    } while (0)
+
+int main() {
+    InsertWatermark w;
+
+    // Descending batch past a gap: nothing visible yet.
+    std::vector<uint32_t> a = {9, 8, 7, 5};
+    w.complete(a.data(), a.size());
+    CHECK(w.load() == 0);
+
+    // Scattered batch that fills [0, 5) except 3, with a repeat.
+    std::vector<uint32_t> b = {4, 0, 2, 1, 2};
+    w.complete(b.data(), b.size());
+    CHECK(w.load() == 3);
+
+    // Filling 3 and 6 joins everything up to 10.
+    std::vector<uint32_t> c = {6, 3};
+    w.complete(c.data(), c.size());
+    CHECK(w.load() == 10);
+
+    // Tags below the watermark never move it back.
+    std::vector<uint32_t> d = {1, 0};
+    w.complete(d.data(), d.size());
+    CHECK(w.load() == 10);
+
+    // Ranges and tag batches mix; the empty tag does not overflow.
+    w.complete(12, 20);
+    std::vector<uint32_t> e = {11, std::numeric_limits<uint32_t>::max(), 10};
+    w.complete(e.data(), e.size());
+    CHECK(w.load() == 20);
+
+    std::printf("ok\n");
+    return 0;
+}
@@ -2,129 +2,284 @@
 #include <future>
 #include <iomanip>
 #include <map>
+#include <memory>
 #include <sstream>
-#include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
+#include "recall.hpp"
 #include "utils.hpp"
 
-struct ThreadResult {
-    float total_recall = 0.0f;
-    size_t valid_entries = 0;
-    std::unordered_map<size_t, float> batch_recall_sum;
-    std::unordered_map<size_t, size_t> batch_entry_count;
+// Search results as fixed-width batches. Binary result files are used in place
+// through their mapping; text files are converted once into owned columns.
+struct Results {
+    std::unique_ptr<ResultReader> reader;
+    std::vector<uint32_t> query_idx, tags;
+    std::vector<ResultBatch> batches;
+    size_t k = 0;
 };
 
-ThreadResult process_chunk(
-    const std::vector<SearchResult<uint32_t>>& res,
-    const std::unordered_map<
-        size_t, std::unordered_map<size_t, std::unordered_set<uint32_t>>>&
-        gt_map,
-    size_t start, size_t end, size_t recall_at) {
-    ThreadResult result{0.0f, 0, {}, {}};
-    for (size_t i = start; i < end; ++i) {
-        const auto& res_entry = res[i];
-        const auto& gt_tags =
-            gt_map.at(res_entry.insert_offset).at(res_entry.query_idx);
-
-        size_t matches = 0;
-        for (auto tag : res_entry.tags) {
-            if (gt_tags.count(tag)) matches++;
+void load_results(Results& results, const std::string& path) {
+    if (is_result_file(path)) {
+        results.reader.reset(new ResultReader(path));
+        results.k = results.reader->k();
+        results.batches = results.reader->batches();
+        return;
+    }
+
+    std::vector<SearchResult<uint32_t>> res;
+    read_results(res, path);
+    std::stable_sort(res.begin(), res.end(),
+                     [](const SearchResult<uint32_t>& a,
+                        const SearchResult<uint32_t>& b) {
+                         return a.insert_offset < b.insert_offset;
+                     });
+    size_t k = 0;
+    for (const auto& r : res) k = std::max(k, r.tags.size());
+    results.k = k;
+    results.query_idx.resize(res.size());
+    results.tags.assign(res.size() * k, kResultEmpty);
+    for (size_t i = 0; i < res.size(); ++i) {
+        results.query_idx[i] = static_cast<uint32_t>(res[i].query_idx);
+        std::copy(res[i].tags.begin(), res[i].tags.end(),
+                  results.tags.begin() + i * k);
+    }
+    for (size_t begin = 0, end; begin < res.size(); begin = end) {
+        for (end = begin; end < res.size() &&
+                          res[end].insert_offset == res[begin].insert_offset;
+             ++end) {
         }
-        float recall = static_cast<float>(matches) / recall_at;
-        result.total_recall += recall;
-        result.valid_entries++;
-        result.batch_recall_sum[res_entry.insert_offset] += recall;
-        result.batch_entry_count[res_entry.insert_offset]++;
+        results.batches.push_back(ResultBatch{
+            res[begin].insert_offset, static_cast<uint32_t>(end - begin),
+            results.query_idx.data() + begin,
+            results.tags.data() + begin * k, nullptr});
     }
-    return result;
 }
 
-float check_recall(std::vector<SearchResult<uint32_t>>& res,
-                   std::vector<SearchResult<uint32_t>>& gt,
-                   const std::string& recall_path, size_t recall_at) {
-    std::unordered_map<size_t,
-                       std::unordered_map<size_t, std::unordered_set<uint32_t>>>
-        gt_map;
-    gt_map.reserve(gt.size());
-    size_t ties_detected = 0;
-
-    for (const auto& gt_entry : gt) {
-        if (gt_entry.tags.size() != gt_entry.distances.size()) {
-            std::cerr
-                << "Error: Tags and distances size mismatch for insert_offset "
-                << gt_entry.insert_offset << ", query_idx "
-                << gt_entry.query_idx << std::endl;
-            return 0.0f;
-        }
+// Recall cutoffs reported next to the main recall. recall@c scores the first c
+// tags of a row against the c nearest neighbors, and is only reported when
+// both the results and the ground truth hold at least c entries per query.
+const size_t kCutoffs[] = {1, 10, 100};
+const size_t kNumCutoffs = sizeof(kCutoffs) / sizeof(kCutoffs[0]);
 
-        auto& tag_set = gt_map[gt_entry.insert_offset][gt_entry.query_idx];
-        tag_set.reserve(recall_at);
+// Which metrics a run computes. sets[0] of a stage is built at recall_at;
+// cutoff c uses sets[set_index[c]], or is off when set_index[c] is 0 and
+// kCutoffs[c] != recall_at. The mean reciprocal rank needs cutoff 1, the
+// distance ratio needs result distances.
+struct MetricSpec {
+    size_t recall_at;
+    size_t num_sets = 1;
+    size_t set_index[kNumCutoffs] = {};
+    bool cutoff[kNumCutoffs] = {};
+    bool distances = false;
+};
 
-        std::vector<std::pair<uint32_t, float>> tagged_distances;
-        for (size_t i = 0; i < gt_entry.tags.size(); ++i) {
-            tagged_distances.emplace_back(gt_entry.tags[i],
-                                          gt_entry.distances[i]);
-        }
-        std::sort(
-            tagged_distances.begin(), tagged_distances.end(),
-            [](const auto& a, const auto& b) { return a.second < b.second; });
-
-        size_t tie_breaker = std::min(recall_at - 1, tagged_distances.size());
-        while (tie_breaker < tagged_distances.size() &&
-               tagged_distances[tie_breaker].second ==
-                   tagged_distances[recall_at - 1].second) {
-            tie_breaker++;
-        }
-        for (size_t i = 0; i < tie_breaker; ++i) {
-            tag_set.insert(tagged_distances[i].first);
-        }
-        ties_detected +=
-            (tie_breaker > recall_at) ? (tie_breaker - recall_at) : 0;
+// Per-batch metric sums; every field is averaged over the batch's queries
+// except distance_ratio, which is averaged over ratio_queries.
+struct BatchSums {
+    double recall = 0.0;
+    double cutoff_recall[kNumCutoffs] = {};
+    double reciprocal_rank = 0.0;
+    double distance_ratio = 0.0;
+    size_t ratio_queries = 0;
+
+    void add(const BatchSums& o) {
+        recall += o.recall;
+        for (size_t c = 0; c < kNumCutoffs; ++c)
+            cutoff_recall[c] += o.cutoff_recall[c];
+        reciprocal_rank += o.reciprocal_rank;
+        distance_ratio += o.distance_ratio;
+        ratio_queries += o.ratio_queries;
     }
+};
+
+// A ground truth stage waiting to be scored, with the batches searched at its
+// base size: res.batches[batch_begin, batch_end). The stage itself is kept
+// only when its distances are needed for the distance ratio.
+struct StageWork {
+    size_t base_size;
+    std::vector<RecallSets> sets;
+    GTStage gt;
+    size_t batch_begin, batch_end;
+};
+
+// Scores the batches of every stage in work; sums land in batch_sums by
+// batch index, so threads never share an accumulator.
+void score_stages(const Results& res, const std::vector<StageWork>& work,
+                  const MetricSpec& spec, std::vector<BatchSums>& batch_sums) {
+    std::vector<std::pair<size_t, size_t>> items;  // (work index, batch)
+    for (size_t w = 0; w < work.size(); ++w)
+        for (size_t b = work[w].batch_begin; b < work[w].batch_end; ++b)
+            items.emplace_back(w, b);
+
+    auto score = [&](size_t begin, size_t end) {
+        std::vector<uint32_t> scratch;
+        std::vector<float> gt_row;
+        for (size_t i = begin; i < end; ++i) {
+            const StageWork& stage = work[items[i].first];
+            const ResultBatch& batch = res.batches[items[i].second];
+            BatchSums sum;
+            for (size_t r = 0; r < batch.count; ++r) {
+                size_t q = batch.query_idx[r];
+                if (!stage.sets[0].has(q))
+                    throw std::runtime_error(
+                        "No ground truth for query " + std::to_string(q) +
+                        " at insert offset " +
+                        std::to_string(stage.base_size));
+                const uint32_t* tags = batch.tags + r * res.k;
+                sum.recall += static_cast<double>(count_matches(
+                                  stage.sets[0], q, tags, res.k, kResultEmpty,
+                                  scratch)) /
+                              spec.recall_at;
+                for (size_t c = 0; c < kNumCutoffs; ++c) {
+                    if (!spec.cutoff[c]) continue;
+                    sum.cutoff_recall[c] +=
+                        static_cast<double>(count_matches(
+                            stage.sets[spec.set_index[c]], q, tags,
+                            kCutoffs[c], kResultEmpty, scratch)) /
+                        kCutoffs[c];
+                }
+                if (spec.cutoff[0]) {
+                    size_t rank = first_match(stage.sets[spec.set_index[0]],
+                                              q, tags, res.k);
+                    if (rank < res.k) sum.reciprocal_rank += 1.0 / (rank + 1);
+                }
+                if (spec.distances) {
+                    const float* gt_dists =
+                        stage.gt.distances.data() + q * stage.gt.k;
+                    size_t n = std::min<size_t>(res.k, stage.gt.sizes[q]);
+                    if (!std::is_sorted(gt_dists,
+                                        gt_dists + stage.gt.sizes[q])) {
+                        gt_row.assign(gt_dists, gt_dists + stage.gt.sizes[q]);
+                        std::sort(gt_row.begin(), gt_row.end());
+                        gt_dists = gt_row.data();
+                    }
+                    double ratio = 0.0;
+                    size_t ranks = sum_distance_ratios(
+                        batch.dists + r * res.k, gt_dists, n, ratio);
+                    if (ranks > 0) {
+                        sum.distance_ratio += ratio / ranks;
+                        ++sum.ratio_queries;
+                    }
+                }
+            }
+            batch_sums[items[i].second] = sum;
+        }
+    };
 
     size_t thread_count = std::thread::hardware_concurrency();
     if (thread_count == 0) thread_count = 1;
-    size_t chunk_size = res.size() / thread_count;
+    size_t chunk_size = (items.size() + thread_count - 1) / thread_count;
     if (chunk_size == 0) chunk_size = 1;
+    std::vector<std::future<void>> futures;
+    for (size_t i = 0; i < items.size(); i += chunk_size)
+        futures.push_back(std::async(std::launch::async, score, i,
+                                     std::min(i + chunk_size, items.size())));
+    for (auto& f : futures) f.get();
+}
+
+// Streams the ground truth stage by stage: each stage that was searched is
+// turned into flat sorted recall sets, its batches are scored, and the stage
+// is dropped. Stages are scored in groups of about kGroupIds ground truth ids
+// to keep the threads busy, which also bounds memory regardless of how many
+// stages the file holds.
+//
+// Besides the main recall at recall_at, every row is scored for recall@{1, 10,
+// 100}, the reciprocal rank of the nearest neighbor and, when the results
+// carry distances, the mean ratio of result to ground truth distance by rank.
+// All of these come from the ground truth file alone, in the same pass.
+float check_recall(const Results& res, const std::string& gt_path,
+                   const std::string& recall_path, size_t recall_at) {
+    const size_t kGroupIds = 1 << 22;
+
+    // Only the stages that were actually searched need ground truth.
+    std::set<size_t> searched_offsets;
+    for (const auto& b : res.batches) searched_offsets.insert(b.insert_offset);
+
+    GTStageStream stream(gt_path, &searched_offsets);
+    std::cout << "Streaming ground truth from " << gt_path
+              << " (queries: " << stream.num_queries()
+              << ", k: " << stream.k() << ", batches: " << stream.num_stages()
+              << ", " << stream.format_name() << ")" << std::endl;
 
-    std::vector<std::future<ThreadResult>> futures;
-    for (size_t i = 0; i < res.size(); i += chunk_size) {
-        size_t end = std::min(i + chunk_size, res.size());
-        futures.push_back(std::async(std::launch::async, process_chunk,
-                                     std::cref(res), std::cref(gt_map), i, end,
-                                     recall_at));
+    MetricSpec spec;
+    spec.recall_at = recall_at;
+    for (size_t c = 0; c < kNumCutoffs; ++c) {
+        if (kCutoffs[c] > res.k ||
+            kCutoffs[c] > static_cast<size_t>(stream.k()))
+            continue;
+        spec.cutoff[c] = true;
+        spec.set_index[c] = kCutoffs[c] == recall_at ? 0 : spec.num_sets++;
     }
+    spec.distances = res.reader && res.reader->has_distances();
 
-    float total_recall = 0.0f;
-    size_t valid_entries = 0;
-    std::unordered_map<size_t, float> batch_recall_sum;
-    std::unordered_map<size_t, size_t> batch_entry_count;
-
-    size_t total_chunks = futures.size();
-    size_t completed_chunks = 0;
-
-    for (auto& f : futures) {
-        try {
-            ThreadResult result = f.get();
-            total_recall += result.total_recall;
-            valid_entries += result.valid_entries;
-            for (const auto& [offset, recall_sum] : result.batch_recall_sum) {
-                batch_recall_sum[offset] += recall_sum;
-            }
-            for (const auto& [offset, count] : result.batch_entry_count) {
-                batch_entry_count[offset] += count;
+    std::vector<BatchSums> batch_sums(res.batches.size());
+    std::vector<char> scored(res.batches.size(), 0);
+    size_t ties_detected = 0, stages_done = 0;
+    std::vector<StageWork> work;
+    size_t group_ids = 0;
+    GTStage stage;
+    bool more = true;
+    while (more) {
+        more = stream.next(stage);
+        if (more) {
+            auto first = std::lower_bound(
+                res.batches.begin(), res.batches.end(), stage.base_size,
+                [](const ResultBatch& b, size_t offset) {
+                    return b.insert_offset < offset;
+                });
+            auto last = std::upper_bound(
+                first, res.batches.end(), stage.base_size,
+                [](size_t offset, const ResultBatch& b) {
+                    return offset < b.insert_offset;
+                });
+            work.emplace_back();
+            StageWork& w = work.back();
+            w.base_size = stage.base_size;
+            w.batch_begin = first - res.batches.begin();
+            w.batch_end = last - res.batches.begin();
+            w.sets.resize(spec.num_sets);
+            w.sets[0].build(stage.ids.data(), stage.distances.data(),
+                            stage.sizes.data(), stage.n, stage.k, recall_at);
+            for (size_t c = 0; c < kNumCutoffs; ++c)
+                if (spec.cutoff[c] && spec.set_index[c] != 0)
+                    w.sets[spec.set_index[c]].build(
+                        stage.ids.data(), stage.distances.data(),
+                        stage.sizes.data(), stage.n, stage.k, kCutoffs[c]);
+            for (size_t b = w.batch_begin; b < w.batch_end; ++b) scored[b] = 1;
+            ties_detected += w.sets[0].ties();
+            for (const auto& sets : w.sets) group_ids += sets.num_ids();
+            if (spec.distances) {
+                group_ids += stage.ids.size();
+                w.gt = std::move(stage);
+                stage = GTStage();
             }
-            completed_chunks++;
-            float progress =
-                static_cast<float>(completed_chunks) / total_chunks * 100.0f;
-            std::cout << "Progress: " << completed_chunks << "/" << total_chunks
-                      << " (" << std::fixed << std::setprecision(2) << progress
-                      << "%)" << std::endl;
-        } catch (const std::exception& e) {
-            std::cerr << "Thread exception: " << e.what() << std::endl;
+            if (group_ids < kGroupIds) continue;
         }
+        if (work.empty()) continue;
+        score_stages(res, work, spec, batch_sums);
+        stages_done += work.size();
+        std::cout << "Progress: " << stages_done << "/" << stream.num_stages()
+                  << " stages" << std::endl;
+        work.clear();
+        group_ids = 0;
+    }
+
+    for (size_t b = 0; b < res.batches.size(); ++b)
+        if (!scored[b])
+            throw std::runtime_error(
+                "No ground truth for insert offset " +
+                std::to_string(res.batches[b].insert_offset));
+
+    // Batches are sorted by insert offset, so equal offsets are adjacent.
+    std::map<size_t, std::pair<BatchSums, size_t>> offset_sums;
+    BatchSums total;
+    size_t valid_entries = 0;
+    for (size_t b = 0; b < res.batches.size(); ++b) {
+        auto& entry = offset_sums[res.batches[b].insert_offset];
+        entry.first.add(batch_sums[b]);
+        entry.second += res.batches[b].count;
+        total.add(batch_sums[b]);
+        valid_entries += res.batches[b].count;
     }
 
     if (valid_entries == 0) {
@@ -132,26 +287,46 @@ float check_recall(std::vector<SearchResult<uint32_t>>& res,
         return 0.0f;
     }
 
-    float average_recall = total_recall / valid_entries * 100.0f;
+    float average_recall =
+        static_cast<float>(total.recall / valid_entries * 100.0);
     std::cout << "Detected " << ties_detected
               << " tie instances in ground truth" << std::endl;
 
-    std::map<size_t, float> sorted_batch_recall_sum(batch_recall_sum.begin(),
-                                                    batch_recall_sum.end());
-    std::map<size_t, size_t> sorted_batch_entry_count(batch_entry_count.begin(),
-                                                      batch_entry_count.end());
+    // The first three columns keep their meaning; the extra metric columns
+    // follow, one per metric this run could compute.
+    auto metric_columns = [&](const BatchSums& sums, size_t count) {
+        std::stringstream cols;
+        for (size_t c = 0; c < kNumCutoffs; ++c)
+            if (spec.cutoff[c])
+                cols << "\t"
+                     << static_cast<float>(sums.cutoff_recall[c] / count *
+                                           100.0);
+        if (spec.cutoff[0])
+            cols << "\t" << static_cast<float>(sums.reciprocal_rank / count);
+        if (spec.distances)
+            cols << "\t"
+                 << (sums.ratio_queries > 0
+                         ? static_cast<float>(sums.distance_ratio /
+                                              sums.ratio_queries)
+                         : 0.0f);
+        return cols.str();
+    };
 
     std::stringstream ss;
-    ss << "Batch Offset\tAverage Recall\tEntry Count\n";
-    for (const auto& [offset, recall_sum] : sorted_batch_recall_sum) {
+    ss << "Batch Offset\tAverage Recall\tEntry Count";
+    for (size_t c = 0; c < kNumCutoffs; ++c)
+        if (spec.cutoff[c]) ss << "\tRecall@" << kCutoffs[c];
+    if (spec.cutoff[0]) ss << "\tMRR";
+    if (spec.distances) ss << "\tDistance Ratio";
+    ss << "\n";
+    for (const auto& [offset, entry] : offset_sums) {
         float batch_avg_recall =
-            recall_sum / sorted_batch_entry_count[offset] * 100.0f;
-        ss << offset << "\t" << batch_avg_recall << "\t"
-           << sorted_batch_entry_count[offset] << "\n";
+            static_cast<float>(entry.first.recall / entry.second * 100.0);
+        ss << offset << "\t" << batch_avg_recall << "\t" << entry.second
+           << metric_columns(entry.first, entry.second) << "\n";
         std::cout << "Batch " << offset
                   << ": Average recall = " << batch_avg_recall << "% ("
-                  << sorted_batch_entry_count[offset] << " queries)"
-                  << std::endl;
+                  << entry.second << " queries)" << std::endl;
     }
 
     std::ofstream out_file(recall_path);
@@ -166,6 +341,24 @@ float check_recall(std::vector<SearchResult<uint32_t>>& res,
     std::cout << "Computed recall for " << valid_entries
               << " queries, average stage-wise recall: " << average_recall
               << "%" << std::endl;
+    for (size_t c = 0; c < kNumCutoffs; ++c)
+        if (spec.cutoff[c])
+            std::cout << "Recall@" << kCutoffs[c] << ": "
+                      << total.cutoff_recall[c] / valid_entries * 100.0 << "%"
+                      << std::endl;
+    if (spec.cutoff[0])
+        std::cout << "MRR: " << total.reciprocal_rank / valid_entries
+                  << std::endl;
+    if (spec.distances) {
+        if (total.ratio_queries > 0)
+            std::cout << "Distance ratio: "
+                      << total.distance_ratio / total.ratio_queries << " ("
+                      << total.ratio_queries << " queries)" << std::endl;
+        else
+            std::cout << "Distance ratio: n/a (no positive ground truth "
+                         "distances)"
+                      << std::endl;
+    }
     return average_recall;
 }
 
@@ -190,14 +383,9 @@ int main(int argc, char* argv[]) {
     }
 
     try {
-        using TagT = uint32_t;
-
-        std::vector<SearchResult<TagT>> res, gt;
-        read_results(res, res_path);
-
-        load_gt<TagT>(gt, gt_path);
-
-        float recall = check_recall(res, gt, recall_path, 10);
+        Results res;
+        load_results(res, res_path);
+        float recall = check_recall(res, gt_path, recall_path, 10);
         std::cout << "Final average recall: " << recall << std::endl;
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
@@ -1,17 +1,25 @@
 #include <getopt.h>
+#include <omp.h>
 
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <limits>
-#include <queue>
+#include <numeric>
 #include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "distance.hpp"
+#include "gt_format.hpp"
+#include "sgemm.hpp"
+#include "topk.hpp"
+
 const int PARTSIZE = 10000000;
 const int ALIGNMENT = 512;
 
@@ -21,16 +29,6 @@ T div_round_up(const T numerator, const T denominator) {
                                           : 1 + (numerator / denominator);
 }
 
-using pairIF = std::pair<size_t, float>;
-struct cmpmaxstruct {
-    bool operator()(const pairIF &l, const pairIF &r) const {
-        return l.second < r.second;
-    }
-};
-
-using maxPQIFCS =
-    std::priority_queue<pairIF, std::vector<pairIF>, cmpmaxstruct>;
-
 inline bool custom_dist(const std::pair<uint32_t, float> &a,
                         const std::pair<uint32_t, float> &b) {
     return a.second < b.second;
@@ -44,31 +42,6 @@ float manual_sdot(int N, const float *X, int incX, const float *Y, int incY) {
     return sum;
 }
 
-void manual_sgemm_dot_product_rows(size_t M, size_t N, size_t K, float alpha,
-                                   const float *A, size_t ldA, const float *B,
-                                   size_t ldB, float beta, float *C,
-                                   size_t ldC) {
-    for (size_t j = 0; j < N; ++j) {
-        for (size_t i = 0; i < M; ++i) {
-            float dot_prod = 0.0f;
-            for (size_t k = 0; k < K; ++k) {
-                dot_prod += A[i * ldA + k] * B[j * ldB + k];
-            }
-            C[i + j * ldC] = alpha * dot_prod + beta * C[i + j * ldC];
-        }
-    }
-}
-
-void manual_sgemm_add_outer_product(size_t M, size_t N, float alpha,
-                                    const float *vec1, const float *vec2,
-                                    float *C, size_t ldC) {
-    for (size_t j = 0; j < N; ++j) {
-        for (size_t i = 0; i < M; ++i) {
-            C[i + j * ldC] += alpha * vec1[i] * vec2[j];
-        }
-    }
-}
-
 void compute_l2sq(float *const points_l2sq, const float *const matrix,
                   const int64_t num_points, const uint64_t dim) {
     assert(points_l2sq != NULL);
@@ -83,24 +56,21 @@ void compute_l2sq(float *const points_l2sq, const float *const matrix,
 void distsq_to_points(const size_t dim, float *dist_matrix, size_t npoints,
                       const float *const points, const float *const points_l2sq,
                       size_t nqueries, const float *const queries,
-                      const float *const queries_l2sq, float *ones_vec = NULL) {
-    bool ones_vec_alloc = false;
-    if (ones_vec == NULL) {
-        ones_vec = new float[nqueries > npoints ? nqueries : npoints];
-        std::fill_n(ones_vec, nqueries > npoints ? nqueries : npoints,
-                    (float)1.0);
-        ones_vec_alloc = true;
+                      const float *const queries_l2sq,
+                      Metric metric = Metric::L2) {
+    if (metric != Metric::L2) {
+        // -<p, q>; cosine inputs were normalized when loaded, and the norm
+        // arrays are not needed.
+        sgemm_dot_product_rows(npoints, nqueries, dim, (float)-1.0, points,
+                               dim, queries, dim, (float)0.0, dist_matrix,
+                               npoints);
+        return;
     }
-
-    manual_sgemm_dot_product_rows(npoints, nqueries, dim, (float)-2.0, points,
-                                  dim, queries, dim, (float)0.0, dist_matrix,
-                                  npoints);
-    manual_sgemm_add_outer_product(npoints, nqueries, (float)1.0, points_l2sq,
-                                   ones_vec, dist_matrix, npoints);
-    manual_sgemm_add_outer_product(npoints, nqueries, (float)1.0, ones_vec,
-                                   queries_l2sq, dist_matrix, npoints);
-
-    if (ones_vec_alloc) delete[] ones_vec;
+    // ||p||^2 - 2 <p, q> + ||q||^2, with the two norm terms folded into the
+    // GEMM epilogue instead of separate outer-product passes.
+    sgemm_dot_product_rows(npoints, nqueries, dim, (float)-2.0, points, dim,
+                           queries, dim, (float)0.0, dist_matrix, npoints,
+                           points_l2sq, queries_l2sq);
 }
 
 void exact_knn(
@@ -111,19 +81,20 @@ void exact_knn(
                                        // corresponding closes_points
     size_t npoints,
     float *points_in,  // points in Col major (actually row-major flat array)
-    size_t nqueries, float *queries_in, float *points_l2sq = NULL,
+    size_t nqueries, float *queries_in, Metric metric = Metric::L2,
+    float *points_l2sq = NULL,
     float *queries_l2sq =
         NULL)  // queries in Col major (actually row-major flat array)
 {
     bool points_l2sq_alloc = false;
-    if (points_l2sq == NULL) {
+    if (points_l2sq == NULL && metric == Metric::L2) {
         points_l2sq = new float[npoints];
         compute_l2sq(points_l2sq, points_in, npoints, dim);
         points_l2sq_alloc = true;
     }
 
     bool queries_l2sq_alloc = false;
-    if (queries_l2sq == NULL) {
+    if (queries_l2sq == NULL && metric == Metric::L2) {
         queries_l2sq = new float[nqueries];
         compute_l2sq(queries_l2sq, queries_in, nqueries, dim);
         queries_l2sq_alloc = true;
@@ -134,7 +105,9 @@ void exact_knn(
 
     std::cout << "Going to compute " << k << " NNs for " << nqueries
               << " queries over " << npoints << " points in " << dim
-              << " dimensions using L2 distance fn. " << std::endl;
+              << " dimensions using " << metric_name(metric)
+              << " distance fn (" << get_sgemm_kernel().name << " kernel). "
+              << std::endl;
 
     size_t q_batch_size = (1 << 9);
     float *dist_matrix = new float[(size_t)q_batch_size * (size_t)npoints];
@@ -145,44 +118,24 @@ void exact_knn(
                           ? nqueries
                           : (b + 1) * q_batch_size;
 
-        distsq_to_points(
-            dim, dist_matrix, npoints, points, points_l2sq, (size_t)(q_e - q_b),
-            queries + (ptrdiff_t)q_b * (ptrdiff_t)dim, queries_l2sq + q_b);
+        distsq_to_points(dim, dist_matrix, npoints, points, points_l2sq,
+                         (size_t)(q_e - q_b),
+                         queries + (ptrdiff_t)q_b * (ptrdiff_t)dim,
+                         queries_l2sq ? queries_l2sq + q_b : NULL, metric);
 
         std::cout << "Computed distances for queries: [" << q_b << "," << q_e
                   << ")" << std::endl;
 
 #pragma omp parallel for schedule(dynamic, 16)
         for (long long q = q_b; q < q_e; q++) {
-            maxPQIFCS point_dist;
-            for (size_t p = 0; p < k; p++) {
-                point_dist.emplace(
-                    p, dist_matrix[(ptrdiff_t)p +
-                                   (ptrdiff_t)(q - q_b) * (ptrdiff_t)npoints]);
-            }
-            for (size_t p = k; p < npoints; p++) {
-                if (point_dist.top().second >
-                    dist_matrix[(ptrdiff_t)p +
-                                (ptrdiff_t)(q - q_b) * (ptrdiff_t)npoints]) {
-                    point_dist.pop();  // Remove largest
-                    point_dist.emplace(
-                        p, dist_matrix[(ptrdiff_t)p +
-                                       (ptrdiff_t)(q - q_b) *
-                                           (ptrdiff_t)npoints]);  // Add new
-                                                                  // smaller
-                }
-            }
-            // Extract results from priority queue (they are in reverse sorted
-            // order)
-            for (ptrdiff_t l = 0; l < (ptrdiff_t)k; ++l) {
-                closest_points[(ptrdiff_t)(k - 1 - l) +
-                               (ptrdiff_t)q * (ptrdiff_t)k] =
-                    point_dist.top().first;
-                dist_closest_points[(ptrdiff_t)(k - 1 - l) +
-                                    (ptrdiff_t)q * (ptrdiff_t)k] =
-                    point_dist.top().second;
-                point_dist.pop();
-            }
+            TopKBuffer<size_t> point_dist(k);
+            point_dist.push_block(
+                dist_matrix + (ptrdiff_t)(q - q_b) * (ptrdiff_t)npoints,
+                npoints, 0);
+            std::copy(point_dist.ids(), point_dist.ids() + k,
+                      closest_points + (ptrdiff_t)q * (ptrdiff_t)k);
+            std::copy(point_dist.dists(), point_dist.dists() + k,
+                      dist_closest_points + (ptrdiff_t)q * (ptrdiff_t)k);
             assert(std::is_sorted(
                 dist_closest_points + (ptrdiff_t)q * (ptrdiff_t)k,
                 dist_closest_points + (ptrdiff_t)(q + 1) * (ptrdiff_t)k));
@@ -201,8 +154,407 @@ void exact_knn(
     }
 }
 
+// Folds the per-thread buffers of queries [q_b, q_e) into the output rows.
+void merge_thread_topk(
+    const size_t k, size_t *const closest_points,
+    float *const dist_closest_points, int64_t q_b, int64_t q_e,
+    std::vector<std::vector<TopKBuffer<size_t>>> &thread_topk) {
+#pragma omp parallel for schedule(dynamic, 16)
+    for (long long q = q_b; q < q_e; q++) {
+        TopKBuffer<size_t> &point_dist = thread_topk[0][q - q_b];
+        for (size_t t = 1; t < thread_topk.size(); ++t)
+            point_dist.merge(thread_topk[t][q - q_b]);
+        std::copy(point_dist.ids(), point_dist.ids() + k,
+                  closest_points + (ptrdiff_t)q * (ptrdiff_t)k);
+        std::copy(point_dist.dists(), point_dist.dists() + k,
+                  dist_closest_points + (ptrdiff_t)q * (ptrdiff_t)k);
+    }
+}
+
+// Runs exact k-NN one (query batch x point tile) block at a time, folding each
+// distance tile straight into per-thread top-k buffers so peak memory depends
+// on the tile size rather than on npoints. compute_tile(q_b, nq_b, p_b, np,
+// tile) fills tile[q * np + p] with the distance from query q_b + q to point
+// p_b + p.
+template <typename TileFn>
+void exact_knn_tiled(const size_t k, size_t *const closest_points,
+                     float *const dist_closest_points, size_t npoints,
+                     size_t nqueries, size_t q_batch_size, size_t p_tile,
+                     TileFn compute_tile) {
+    size_t num_tiles = div_round_up(npoints, p_tile);
+    int num_threads = omp_get_max_threads();
+
+    for (size_t b = 0; b < div_round_up(nqueries, q_batch_size); ++b) {
+        int64_t q_b = b * q_batch_size;
+        int64_t q_e = ((b + 1) * q_batch_size > nqueries)
+                          ? nqueries
+                          : (b + 1) * q_batch_size;
+        size_t nq_b = (size_t)(q_e - q_b);
+
+        std::vector<std::vector<TopKBuffer<size_t>>> thread_topk(
+            num_threads, std::vector<TopKBuffer<size_t>>(
+                             nq_b, TopKBuffer<size_t>(k)));
+
+#pragma omp parallel num_threads(num_threads)
+        {
+            std::vector<TopKBuffer<size_t>> &topk =
+                thread_topk[omp_get_thread_num()];
+            std::vector<float> tile(p_tile * nq_b);
+#pragma omp for schedule(dynamic, 1)
+            for (int64_t t = 0; t < (int64_t)num_tiles; ++t) {
+                size_t p_b = (size_t)t * p_tile;
+                size_t np = std::min(p_tile, npoints - p_b);
+                compute_tile((size_t)q_b, nq_b, p_b, np, tile.data());
+                for (size_t q = 0; q < nq_b; ++q)
+                    topk[q].push_block(tile.data() + q * np, np, p_b);
+            }
+        }
+
+        merge_thread_topk(k, closest_points, dist_closest_points, q_b, q_e,
+                          thread_topk);
+        std::cout << "Computed exact k-NN for queries: [" << q_b << "," << q_e
+                  << ")" << std::endl;
+    }
+}
+
+// Same contract as exact_knn, but built on exact_knn_tiled with the SGEMM
+// producing one distance tile at a time.
+void exact_knn_fused(const size_t dim, const size_t k,
+                     size_t *const closest_points,
+                     float *const dist_closest_points, size_t npoints,
+                     float *points_in, size_t nqueries, float *queries_in,
+                     Metric metric = Metric::L2, float *points_l2sq = NULL,
+                     float *queries_l2sq = NULL) {
+    bool points_l2sq_alloc = false;
+    if (points_l2sq == NULL && metric == Metric::L2) {
+        points_l2sq = new float[npoints];
+        compute_l2sq(points_l2sq, points_in, npoints, dim);
+        points_l2sq_alloc = true;
+    }
+
+    bool queries_l2sq_alloc = false;
+    if (queries_l2sq == NULL && metric == Metric::L2) {
+        queries_l2sq = new float[nqueries];
+        compute_l2sq(queries_l2sq, queries_in, nqueries, dim);
+        queries_l2sq_alloc = true;
+    }
+
+    float *points = points_in;
+    float *queries = queries_in;
+
+    size_t q_batch_size = (1 << 9);
+    size_t max_q_batch = std::min(nqueries, q_batch_size);
+    size_t p_tile = get_cache_info().l2 / 2 / (max_q_batch * sizeof(float));
+    p_tile = std::max<size_t>(256, p_tile / 64 * 64);
+
+    std::cout << "Going to compute " << k << " NNs for " << nqueries
+              << " queries over " << npoints << " points in " << dim
+              << " dimensions using " << metric_name(metric)
+              << " distance fn (" << get_sgemm_kernel().name
+              << " kernel, fused tiles of "
+              << p_tile << " points x " << max_q_batch << " queries). "
+              << std::endl;
+
+    exact_knn_tiled(
+        k, closest_points, dist_closest_points, npoints, nqueries,
+        q_batch_size, p_tile,
+        [&](size_t q_b, size_t nq_b, size_t p_b, size_t np, float *tile) {
+            distsq_to_points(dim, tile, np,
+                             points + (ptrdiff_t)p_b * (ptrdiff_t)dim,
+                             points_l2sq ? points_l2sq + p_b : NULL, nq_b,
+                             queries + (ptrdiff_t)q_b * (ptrdiff_t)dim,
+                             queries_l2sq ? queries_l2sq + q_b : NULL, metric);
+        });
+
+    if (points_l2sq_alloc) {
+        delete[] points_l2sq;
+    }
+    if (queries_l2sq_alloc) {
+        delete[] queries_l2sq;
+    }
+}
+
+// Exact pruning on top of the fused tiles, for l2 and ip over float data.
+// Points are visited in tiles of similar norm, and a query skips a tile when a
+// norm bound proves that no point in it can beat the query's k-th distance:
+//   l2  ||q - p||^2 >= (||q|| - ||p||)^2
+//   ip  -<q, p>     >= -||q|| ||p||
+// The bound is relaxed by a tolerance that covers the float rounding of the
+// GEMM distances and of the norms, so no point the unpruned scan would keep is
+// ever skipped. Each query's k-th distance is seeded from k points of similar
+// norm (the largest norms for ip) so tiles can be skipped from the start.
+//
+// The surviving queries of a tile are gathered and run through the same SGEMM.
+// It computes every entry with the same sequence of operations whatever the
+// matrix shape, so distances match the unpruned paths bit for bit.
+const double kPruneTolerance = 1.0 / (1 << 19);
+
+void exact_knn_pruned(const size_t dim, const size_t k,
+                      size_t *const closest_points,
+                      float *const dist_closest_points, size_t npoints,
+                      float *points, size_t nqueries, float *queries,
+                      Metric metric) {
+    const bool l2 = metric == Metric::L2;
+    std::vector<float> points_l2sq(npoints), queries_l2sq(nqueries);
+    compute_l2sq(points_l2sq.data(), points, npoints, dim);
+    compute_l2sq(queries_l2sq.data(), queries, nqueries, dim);
+
+    std::vector<size_t> order(npoints);
+    std::iota(order.begin(), order.end(), (size_t)0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return points_l2sq[a] < points_l2sq[b];
+    });
+
+    // Seed bound: the largest of the distances to k real points is at least
+    // the final k-th distance.
+    std::vector<float> seed(nqueries, std::numeric_limits<float>::infinity());
+    if (npoints >= k) {
+        std::vector<float> sorted_l2sq(npoints);
+        for (size_t i = 0; i < npoints; ++i)
+            sorted_l2sq[i] = points_l2sq[order[i]];
+#pragma omp parallel
+        {
+            std::vector<float> rows(k * dim), rows_l2sq(k), dists(k);
+#pragma omp for schedule(dynamic, 64)
+            for (int64_t q = 0; q < (int64_t)nqueries; ++q) {
+                size_t first = npoints - k;
+                if (l2) {
+                    size_t pos = std::lower_bound(sorted_l2sq.begin(),
+                                                  sorted_l2sq.end(),
+                                                  queries_l2sq[q]) -
+                                 sorted_l2sq.begin();
+                    first = std::min(first, pos - std::min(pos, k / 2));
+                }
+                for (size_t i = 0; i < k; ++i) {
+                    size_t id = order[first + i];
+                    std::copy(points + id * dim, points + (id + 1) * dim,
+                              rows.data() + i * dim);
+                    rows_l2sq[i] = points_l2sq[id];
+                }
+                distsq_to_points(dim, dists.data(), k, rows.data(),
+                                 rows_l2sq.data(), 1,
+                                 queries + (ptrdiff_t)q * (ptrdiff_t)dim,
+                                 queries_l2sq.data() + q, metric);
+                seed[q] = *std::max_element(dists.begin(), dists.end());
+            }
+        }
+    }
+
+    size_t q_batch_size = (1 << 9);
+    size_t max_q_batch = std::min(nqueries, q_batch_size);
+    size_t p_tile = get_cache_info().l2 / 2 / (max_q_batch * sizeof(float));
+    p_tile = std::max<size_t>(256, p_tile / 64 * 64);
+    size_t num_tiles = div_round_up(npoints, p_tile);
+
+    // Within a tile points go back to id order, which keeps the insertion
+    // order, and so the tie-breaking, of the unpruned scan.
+    std::vector<double> tile_lo(num_tiles), tile_hi(num_tiles);
+    for (size_t t = 0; t < num_tiles; ++t) {
+        size_t p_b = t * p_tile, p_e = std::min(npoints, p_b + p_tile);
+        tile_lo[t] = std::sqrt((double)points_l2sq[order[p_b]]);
+        tile_hi[t] = std::sqrt((double)points_l2sq[order[p_e - 1]]);
+        std::sort(order.begin() + p_b, order.begin() + p_e);
+    }
+
+    std::cout << "Going to compute " << k << " NNs for " << nqueries
+              << " queries over " << npoints << " points in " << dim
+              << " dimensions using " << metric_name(metric)
+              << " distance fn (" << get_sgemm_kernel().name
+              << " kernel, norm-pruned tiles of " << p_tile << " points x "
+              << max_q_batch << " queries). " << std::endl;
+
+    int num_threads = omp_get_max_threads();
+    size_t pruned = 0;
+    for (size_t b = 0; b < div_round_up(nqueries, q_batch_size); ++b) {
+        int64_t q_b = b * q_batch_size;
+        int64_t q_e = std::min(nqueries, (b + 1) * q_batch_size);
+        size_t nq_b = (size_t)(q_e - q_b);
+
+        std::vector<std::vector<TopKBuffer<size_t>>> thread_topk(
+            num_threads, std::vector<TopKBuffer<size_t>>(
+                             nq_b, TopKBuffer<size_t>(k)));
+
+#pragma omp parallel num_threads(num_threads) reduction(+ : pruned)
+        {
+            std::vector<TopKBuffer<size_t>> &topk =
+                thread_topk[omp_get_thread_num()];
+            std::vector<float> tile(p_tile * nq_b);
+            std::vector<float> rows(p_tile * dim), rows_l2sq(p_tile);
+            std::vector<float> q_rows(nq_b * dim), q_l2sq(nq_b);
+            std::vector<size_t> selected(nq_b);
+#pragma omp for schedule(dynamic, 1)
+            for (int64_t t = 0; t < (int64_t)num_tiles; ++t) {
+                size_t p_b = (size_t)t * p_tile;
+                size_t np = std::min(p_tile, npoints - p_b);
+                double hi_sq = tile_hi[t] * tile_hi[t];
+
+                size_t nsel = 0;
+                for (size_t q = 0; q < nq_b; ++q) {
+                    size_t qi = q_b + q;
+                    double q_norm = std::sqrt((double)queries_l2sq[qi]);
+                    double bound;
+                    if (l2) {
+                        double gap = std::max(
+                            {0.0, tile_lo[t] - q_norm, q_norm - tile_hi[t]});
+                        bound = gap * gap;
+                    } else {
+                        bound = -q_norm * tile_hi[t];
+                    }
+                    double tol = kPruneTolerance * (double)(dim + 8) *
+                                 (queries_l2sq[qi] + hi_sq);
+                    float kth = std::min(topk[q].threshold(), seed[qi]);
+                    if (bound - tol > kth) continue;
+                    selected[nsel++] = q;
+                }
+                pruned += nq_b - nsel;
+                if (nsel == 0) continue;
+
+                for (size_t i = 0; i < np; ++i) {
+                    size_t id = order[p_b + i];
+                    std::copy(points + id * dim, points + (id + 1) * dim,
+                              rows.data() + i * dim);
+                    rows_l2sq[i] = points_l2sq[id];
+                }
+                for (size_t s = 0; s < nsel; ++s) {
+                    size_t qi = q_b + selected[s];
+                    std::copy(queries + qi * dim, queries + (qi + 1) * dim,
+                              q_rows.data() + s * dim);
+                    q_l2sq[s] = queries_l2sq[qi];
+                }
+                distsq_to_points(dim, tile.data(), np, rows.data(),
+                                 rows_l2sq.data(), nsel, q_rows.data(),
+                                 q_l2sq.data(), metric);
+                for (size_t s = 0; s < nsel; ++s)
+                    topk[selected[s]].push_indexed(tile.data() + s * np, np,
+                                                   order.data() + p_b);
+            }
+        }
+
+        merge_thread_topk(k, closest_points, dist_closest_points, q_b, q_e,
+                          thread_topk);
+        std::cout << "Computed exact k-NN for queries: [" << q_b << "," << q_e
+                  << ")" << std::endl;
+    }
+    size_t pairs = nqueries * num_tiles;
+    std::cout << "Norm bounds pruned " << pruned << " of " << pairs
+              << " query-tile pairs ("
+              << (pairs ? 100.0 * pruned / pairs : 0.0) << "%)" << std::endl;
+}
+
+// Inverse norms of 8-bit rows, used to turn inner products into cosine
+// similarities without materializing normalized float copies.
+template <typename T>
+std::vector<float> int8_inv_norms(const Int8Kernel<T> &kernel, const T *data,
+                                  size_t npts, size_t dim) {
+    std::vector<float> inv(npts);
+#pragma omp parallel for schedule(static, 65536)
+    for (int64_t i = 0; i < (int64_t)npts; ++i) {
+        const T *row = data + (ptrdiff_t)i * (ptrdiff_t)dim;
+        float sq;
+        kernel.dot(row, row, 1, dim, &sq);
+        inv[i] = sq > 0 ? 1.0f / std::sqrt(sq) : 0.0f;
+    }
+    return inv;
+}
+
+// Exact k-NN over native uint8/int8 data. Distances are computed directly on
+// the 8-bit vectors with int32 accumulation, so a part costs one byte per
+// dimension instead of four. For cosine the per-row norms are computed once
+// per part and applied to each tile of inner products.
+template <typename T>
+void exact_knn_int8(const size_t dim, const size_t k,
+                    size_t *const closest_points,
+                    float *const dist_closest_points, size_t npoints,
+                    const T *points, size_t nqueries, const T *queries,
+                    Metric metric) {
+    const Int8Kernel<T> &kernel = get_int8_kernel<T>();
+    std::vector<float> points_inv, queries_inv;
+    if (metric == Metric::COSINE) {
+        points_inv = int8_inv_norms(kernel, points, npoints, dim);
+        queries_inv = int8_inv_norms(kernel, queries, nqueries, dim);
+    }
+
+    size_t q_batch_size = (1 << 9);
+    size_t max_q_batch = std::min(nqueries, q_batch_size);
+    size_t p_tile = get_cache_info().l2 / 2 / (max_q_batch * sizeof(float));
+    p_tile = std::max<size_t>(256, p_tile / 64 * 64);
+
+    std::cout << "Going to compute " << k << " NNs for " << nqueries
+              << " queries over " << npoints << " points in " << dim
+              << " dimensions using " << metric_name(metric)
+              << " distance fn (" << kernel.name << " kernel, tiles of "
+              << p_tile << " points x " << max_q_batch << " queries). "
+              << std::endl;
+
+    exact_knn_tiled(
+        k, closest_points, dist_closest_points, npoints, nqueries,
+        q_batch_size, p_tile,
+        [&](size_t q_b, size_t nq_b, size_t p_b, size_t np, float *tile) {
+            for (size_t q = 0; q < nq_b; ++q) {
+                const T *query =
+                    queries + (ptrdiff_t)(q_b + q) * (ptrdiff_t)dim;
+                const T *tile_points =
+                    points + (ptrdiff_t)p_b * (ptrdiff_t)dim;
+                float *out = tile + q * np;
+                if (metric == Metric::L2) {
+                    kernel.l2sq(query, tile_points, np, dim, out);
+                    continue;
+                }
+                kernel.dot(query, tile_points, np, dim, out);
+                if (metric == Metric::IP) {
+                    for (size_t p = 0; p < np; ++p) out[p] = -out[p];
+                } else {
+                    float q_inv = queries_inv[q_b + q];
+                    for (size_t p = 0; p < np; ++p)
+                        out[p] = -out[p] * q_inv * points_inv[p_b + p];
+                }
+            }
+        });
+}
+
+// Float parts go through the SGEMM paths; 8-bit parts stay native. Norm
+// pruning does not help cosine, where every norm is one.
+void exact_knn_part(const size_t dim, const size_t k,
+                    size_t *const closest_points,
+                    float *const dist_closest_points, size_t npoints,
+                    float *points, size_t nqueries, float *queries,
+                    Metric metric, bool fused, bool prune) {
+    if (prune && metric != Metric::COSINE)
+        exact_knn_pruned(dim, k, closest_points, dist_closest_points, npoints,
+                         points, nqueries, queries, metric);
+    else if (fused || prune)
+        exact_knn_fused(dim, k, closest_points, dist_closest_points, npoints,
+                        points, nqueries, queries, metric);
+    else
+        exact_knn(dim, k, closest_points, dist_closest_points, npoints, points,
+                  nqueries, queries, metric);
+}
+
+template <typename T>
+void exact_knn_part(const size_t dim, const size_t k,
+                    size_t *const closest_points,
+                    float *const dist_closest_points, size_t npoints,
+                    T *points, size_t nqueries, T *queries, Metric metric,
+                    bool, bool) {
+    exact_knn_int8(dim, k, closest_points, dist_closest_points, npoints,
+                   points, nqueries, queries, metric);
+}
+
+// Cosine over float data is answered as inner product over unit vectors, so
+// the query set and every base part are normalized once, right after loading.
+void prepare_for_metric(float *data, size_t npts, size_t dim, Metric metric) {
+    if (metric != Metric::COSINE) return;
+#pragma omp parallel for schedule(static, 65536)
+    for (int64_t i = 0; i < (int64_t)npts; ++i)
+        normalize_vector(data + (ptrdiff_t)i * (ptrdiff_t)dim, dim);
+}
+
+// 8-bit data stays untouched; exact_knn_int8 applies the norms per tile.
 template <typename T>
-inline int get_num_parts(const char *filename) {
+void prepare_for_metric(T *, size_t, size_t, Metric) {}
+
+inline void get_bin_shape(const char *filename, size_t &npts,
+                          size_t &ndims) {
     std::ifstream reader;
     reader.exceptions(std::ios::failbit | std::ios::badbit);
     reader.open(filename, std::ios::binary);
@@ -213,16 +565,17 @@ inline int get_num_parts(const char *filename) {
     std::cout << "#pts = " << npts_i32 << ", #dims = " << ndims_i32
               << std::endl;
     reader.close();
-    uint32_t num_parts = (npts_i32 % PARTSIZE) == 0
-                             ? npts_i32 / PARTSIZE
-                             : (uint32_t)std::floor(npts_i32 / PARTSIZE) + 1;
-    std::cout << "Number of parts: " << num_parts << std::endl;
-    return num_parts;
+    npts = (size_t)npts_i32;
+    ndims = (size_t)ndims_i32;
 }
 
+// Reads the part_num-th PARTSIZE slice of points [range_begin, range_end) of
+// a .bin file in its on-disk element type; 8-bit data is never widened, so a
+// part costs sizeof(T) bytes per dimension.
 template <typename T>
-inline void load_bin_as_float(const char *filename, float *&data, size_t &npts,
-                              size_t &ndims, int part_num) {
+inline void load_bin_part(const char *filename, T *&data, size_t &npts,
+                          size_t &ndims, int part_num, size_t range_begin = 0,
+                          size_t range_end = SIZE_MAX) {
     std::ifstream reader;
     reader.exceptions(std::ios::failbit | std::ios::badbit);
     reader.open(filename, std::ios::binary);
@@ -230,8 +583,9 @@ inline void load_bin_as_float(const char *filename, float *&data, size_t &npts,
     int npts_i32, ndims_i32;
     reader.read(reinterpret_cast<char *>(&npts_i32), sizeof(int));
     reader.read(reinterpret_cast<char *>(&ndims_i32), sizeof(int));
-    uint64_t start_id = (uint64_t)part_num * PARTSIZE;
-    uint64_t end_id = (std::min)(start_id + PARTSIZE, (uint64_t)npts_i32);
+    range_end = (std::min)(range_end, (size_t)npts_i32);
+    uint64_t start_id = range_begin + (uint64_t)part_num * PARTSIZE;
+    uint64_t end_id = (std::min)(start_id + PARTSIZE, (uint64_t)range_end);
     npts = end_id - start_id;
     ndims = (uint64_t)ndims_i32;
     std::cout << "#pts in part = " << npts << ", #dims = " << ndims
@@ -239,20 +593,10 @@ inline void load_bin_as_float(const char *filename, float *&data, size_t &npts,
 
     reader.seekg(start_id * ndims * sizeof(T) + 2 * sizeof(uint32_t),
                  std::ios::beg);
-    T *data_T = new T[npts * ndims];
-    reader.read(reinterpret_cast<char *>(data_T), sizeof(T) * npts * ndims);
+    data = new T[npts * ndims];
+    reader.read(reinterpret_cast<char *>(data), sizeof(T) * npts * ndims);
     std::cout << "Finished reading part of the bin file." << std::endl;
     reader.close();
-
-    data = new float[npts * ndims];
-#pragma omp parallel for schedule(dynamic, 32768)
-    for (int64_t i = 0; i < (int64_t)npts; i++) {
-        for (int64_t j = 0; j < (int64_t)ndims; j++) {
-            data[i * ndims + j] = static_cast<float>(data_T[i * ndims + j]);
-        }
-    }
-    delete[] data_T;
-    std::cout << "Finished converting part data to float." << std::endl;
 }
 
 inline void save_groundtruth_as_one_file(const std::string filename,
@@ -282,26 +626,56 @@ inline void save_groundtruth_as_one_file(const std::string filename,
 
 template <typename T>
 std::vector<std::vector<std::pair<uint32_t, float>>> processUnfilteredParts(
-    const std::string &base_file, size_t &nqueries, size_t &npoints,
-    size_t &dim, size_t &k, float *query_data) {
-    float *base_data = nullptr;
-    int num_parts = get_num_parts<T>(base_file.c_str());
+    const std::string &base_file, size_t point_begin, size_t point_end,
+    size_t &nqueries, size_t &npoints, size_t &dim, size_t &k, T *query_data,
+    Metric metric, bool fused, bool prune, bool pipeline) {
+    T *base_data = nullptr;
+    int num_parts =
+        (int)div_round_up(point_end - point_begin, (size_t)PARTSIZE);
+    std::cout << "Number of parts: " << num_parts << std::endl;
     std::vector<std::vector<std::pair<uint32_t, float>>> res(nqueries);
+
+    // In pipelined mode part p + 1 is read on a background thread while part
+    // p is searched, so at most two parts are resident.
+    T *next_data = nullptr;
+    size_t next_npoints = 0, next_dim = 0;
+    std::future<void> next_part;
+    auto prefetch_part = [&](int part_num) {
+        return std::async(std::launch::async, [&, part_num] {
+            omp_set_num_threads(1);
+            load_bin_part<T>(base_file.c_str(), next_data, next_npoints,
+                             next_dim, part_num, point_begin, point_end);
+            prepare_for_metric(next_data, next_npoints, next_dim, metric);
+        });
+    };
+    if (pipeline && num_parts > 0) next_part = prefetch_part(0);
+
     for (int p = 0; p < num_parts; p++) {
-        size_t start_id = (size_t)p * PARTSIZE;
-        load_bin_as_float<T>(base_file.c_str(), base_data, npoints, dim, p);
+        size_t start_id = point_begin + (size_t)p * PARTSIZE;
+        if (pipeline) {
+            next_part.get();
+            base_data = next_data;
+            npoints = next_npoints;
+            dim = next_dim;
+            if (p + 1 < num_parts) next_part = prefetch_part(p + 1);
+        } else {
+            load_bin_part<T>(base_file.c_str(), base_data, npoints, dim, p,
+                             point_begin, point_end);
+            prepare_for_metric(base_data, npoints, dim, metric);
+        }
 
         size_t *closest_points_part = new size_t[nqueries * k];
         float *dist_closest_points_part = new float[nqueries * k];
 
         auto part_k = k < npoints ? k : npoints;
-        exact_knn(dim, part_k, closest_points_part, dist_closest_points_part,
-                  npoints, base_data, nqueries, query_data);
+        exact_knn_part(dim, part_k, closest_points_part,
+                       dist_closest_points_part, npoints, base_data, nqueries,
+                       query_data, metric, fused, prune);
 
         for (size_t i = 0; i < nqueries; i++) {
             for (size_t j = 0; j < part_k; j++) {
                 res[i].push_back(std::make_pair(
-                    (uint32_t)(closest_points_part[i * k + j] + start_id),
+                    (uint32_t)(closest_points_part[i * part_k + j] + start_id),
                     dist_closest_points_part[i * part_k + j]));
             }
         }
@@ -314,27 +688,72 @@ std::vector<std::vector<std::pair<uint32_t, float>>> processUnfilteredParts(
     return res;
 }
 
+// Which slice of the problem this process computes. With more than one shard
+// on either axis the output is a partial file for merge_gt instead of a
+// truthset.
+struct ShardSpec {
+    size_t shard = 0;
+    size_t num_shards = 1;
+    size_t query_shard = 0;
+    size_t num_query_shards = 1;
+
+    bool partial() const { return num_shards > 1 || num_query_shards > 1; }
+};
+
+// [begin, end) of the idx-th of num near-equal slices of [0, total).
+inline void shard_range(size_t total, size_t num, size_t idx, size_t &begin,
+                        size_t &end) {
+    begin = total * idx / num;
+    end = total * (idx + 1) / num;
+}
+
 template <typename T>
 int aux_main_logic(const std::string &base_file, const std::string &query_file,
-                   const std::string &gt_file,
-                   size_t k) {  // Removed metric parameter
+                   const std::string &gt_file, size_t k, Metric metric,
+                   bool fused, bool prune, bool pipeline,
+                   const ShardSpec &shards) {
     size_t npoints, nqueries, dim;
-
-    float *query_data;
-
-    load_bin_as_float<T>(query_file.c_str(), query_data, nqueries, dim, 0);
-    if (nqueries > PARTSIZE)
-        std::cerr << "WARNING: #Queries provided (" << nqueries
+    size_t base_npts, query_npts, query_dim;
+
+    get_bin_shape(base_file.c_str(), base_npts, dim);
+    get_bin_shape(query_file.c_str(), query_npts, query_dim);
+    if (query_dim != dim)
+        throw std::runtime_error("Base and query dimensions differ");
+    if (query_npts > PARTSIZE) {
+        std::cerr << "WARNING: #Queries provided (" << query_npts
                   << ") is greater than " << PARTSIZE
                   << ". Computing GT only for the first " << PARTSIZE
                   << " queries." << std::endl;
+        query_npts = PARTSIZE;
+    }
+
+    size_t point_begin, point_end, query_begin, query_end;
+    shard_range(base_npts, shards.num_shards, shards.shard, point_begin,
+                point_end);
+    shard_range(query_npts, shards.num_query_shards, shards.query_shard,
+                query_begin, query_end);
+    if (shards.partial())
+        std::cout << "Shard covers points [" << point_begin << ","
+                  << point_end << ") and queries [" << query_begin << ","
+                  << query_end << ")" << std::endl;
+
+    T *query_data;
+
+    load_bin_part<T>(query_file.c_str(), query_data, nqueries, dim, 0,
+                     query_begin, query_end);
+    prepare_for_metric(query_data, nqueries, dim, metric);
 
     int *closest_points = new int[nqueries * k];
     float *dist_closest_points = new float[nqueries * k];
+    std::fill(closest_points, closest_points + nqueries * k,
+              (int)kGTPartialEmpty);
+    std::fill(dist_closest_points, dist_closest_points + nqueries * k,
+              std::numeric_limits<float>::infinity());
 
     std::vector<std::vector<std::pair<uint32_t, float>>> results =
-        processUnfilteredParts<T>(base_file, nqueries, npoints, dim, k,
-                                  query_data);  // Removed metric parameter
+        processUnfilteredParts<T>(base_file, point_begin, point_end, nqueries,
+                                  npoints, dim, k, query_data, metric, fused,
+                                  prune, pipeline);
 
     for (size_t i = 0; i < nqueries; i++) {
         std::vector<std::pair<uint32_t, float>> &cur_res = results[i];
@@ -346,13 +765,27 @@ int aux_main_logic(const std::string &base_file, const std::string &query_file,
             dist_closest_points[i * k + j] = iter.second;
             ++j;
         }
-        if (j < k)
+        if (j < k && !shards.partial())
             std::cout << "WARNING: found less than k GT entries for query " << i
                       << std::endl;
     }
 
-    save_groundtruth_as_one_file(gt_file, closest_points, dist_closest_points,
-                                 nqueries, k);
+    if (shards.partial()) {
+        GTPartialHeader header = {kGTPartialMagic,  kGTPartialVersion,
+                                  query_npts,       base_npts,
+                                  query_begin,      query_end,
+                                  point_begin,      point_end,
+                                  (uint32_t)k,      (uint32_t)metric,
+                                  (uint32_t)dim,    0};
+        save_gt_partial(gt_file, header,
+                        reinterpret_cast<const uint32_t *>(closest_points),
+                        dist_closest_points);
+        std::cout << "Saved partial truthset for " << nqueries << " queries"
+                  << std::endl;
+    } else {
+        save_groundtruth_as_one_file(gt_file, closest_points,
+                                     dist_closest_points, nqueries, k);
+    }
     delete[] closest_points;
     delete[] dist_closest_points;
     delete[] query_data;
@@ -361,14 +794,29 @@ int aux_main_logic(const std::string &base_file, const std::string &query_file,
 }
 
 int main(int argc, char **argv) {
-    std::string base_file, query_file, gt_file;
+    std::string base_file, query_file, gt_file, data_type = "float";
+    std::string metric_str = "l2";
     int K = 0;
+    bool fused = false;
+    bool prune = false;
+    bool pipeline = false;
+    ShardSpec shards;
 
     const char *const short_opts = "";
     const option long_opts[] = {{"base_file", required_argument, nullptr, 0},
                                 {"query_file", required_argument, nullptr, 0},
                                 {"gt_file", required_argument, nullptr, 0},
                                 {"k", required_argument, nullptr, 0},
+                                {"fused", no_argument, nullptr, 0},
+                                {"prune", no_argument, nullptr, 0},
+                                {"pipeline", no_argument, nullptr, 0},
+                                {"data_type", required_argument, nullptr, 0},
+                                {"metric", required_argument, nullptr, 0},
+                                {"num_shards", required_argument, nullptr, 0},
+                                {"shard", required_argument, nullptr, 0},
+                                {"num_query_shards", required_argument,
+                                 nullptr, 0},
+                                {"query_shard", required_argument, nullptr, 0},
                                 {nullptr, 0, nullptr, 0}};
     int opt_idx = 0;
     while (true) {
@@ -383,17 +831,63 @@ int main(int argc, char **argv) {
                 gt_file = optarg;
             else if (std::string(long_opts[opt_idx].name) == "k")
                 K = std::stoi(optarg);
+            else if (std::string(long_opts[opt_idx].name) == "fused")
+                fused = true;
+            else if (std::string(long_opts[opt_idx].name) == "prune")
+                prune = true;
+            else if (std::string(long_opts[opt_idx].name) == "pipeline")
+                pipeline = true;
+            else if (std::string(long_opts[opt_idx].name) == "data_type")
+                data_type = optarg;
+            else if (std::string(long_opts[opt_idx].name) == "metric")
+                metric_str = optarg;
+            else if (std::string(long_opts[opt_idx].name) == "num_shards")
+                shards.num_shards = std::stoul(optarg);
+            else if (std::string(long_opts[opt_idx].name) == "shard")
+                shards.shard = std::stoul(optarg);
+            else if (std::string(long_opts[opt_idx].name) ==
+                     "num_query_shards")
+                shards.num_query_shards = std::stoul(optarg);
+            else if (std::string(long_opts[opt_idx].name) == "query_shard")
+                shards.query_shard = std::stoul(optarg);
         }
     }
 
-    if (base_file.empty() || query_file.empty() || gt_file.empty() || K <= 0) {
+    Metric metric;
+    if (base_file.empty() || query_file.empty() || gt_file.empty() || K <= 0 ||
+        (data_type != "float" && data_type != "uint8" &&
+         data_type != "int8") ||
+        !parse_metric(metric_str, metric) || shards.num_shards == 0 ||
+        shards.shard >= shards.num_shards || shards.num_query_shards == 0 ||
+        shards.query_shard >= shards.num_query_shards) {
         std::cout << "Usage: ./compute_gt --base_file BASE --query_file QUERY "
-                     "--gt_file GT --k K"
+                     "--gt_file GT --k K [--fused] [--prune] [--pipeline] "
+                     "[--data_type float|uint8|int8] [--metric l2|ip|cosine] "
+                     "[--num_shards S --shard I] "
+                     "[--num_query_shards Q --query_shard J]\n"
+                     "With more than one shard, GT is a partial file to be "
+                     "combined with merge_gt. --prune skips point tiles "
+                     "that norm bounds rule out (float l2 and ip; results "
+                     "are unchanged)."
                   << std::endl;
         return 1;
     }
+    // The 8-bit kernels have a single tile loop of their own.
+    if (data_type != "float" && (fused || prune)) {
+        std::cerr << "--fused and --prune apply to float data only, not "
+                  << data_type << std::endl;
+        return 1;
+    }
 
-    aux_main_logic<float>(base_file, query_file, gt_file, K);
+    if (data_type == "uint8")
+        aux_main_logic<uint8_t>(base_file, query_file, gt_file, K, metric,
+                                fused, prune, pipeline, shards);
+    else if (data_type == "int8")
+        aux_main_logic<int8_t>(base_file, query_file, gt_file, K, metric,
+                               fused, prune, pipeline, shards);
+    else
+        aux_main_logic<float>(base_file, query_file, gt_file, K, metric,
+                              fused, prune, pipeline, shards);
 
     std::cout << "Done. Saved groundtruth to " << gt_file << std::endl;
     return 0;
@@ -1,14 +1,25 @@
+#include <fcntl.h>
 #include <immintrin.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <queue>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "distance.hpp"
+#include "gt_format.hpp"
+#include "topk.hpp"
+
 using PointPair = std::pair<int, float>;
 
 float euclidean_distance_simd(const std::vector<float> &a,
@@ -43,48 +54,387 @@ float euclidean_distance_simd(const std::vector<float> &a,
     return sum;
 }
 
+// Same sum as euclidean_distance_simd, but abandoned once it provably cannot
+// end below cutoff. Every lane only grows, so the final sum is at least the sum
+// of the partial lanes; the partial lanes are reduced in registers, in a
+// different order than the final sum, and kPartialSlack covers that rounding
+// difference. Abandoned points are reported as infinity; all others get
+// exactly the euclidean_distance_simd value.
+const float kPartialSlack = 1.0f - 1.0f / (1 << 20);
+
+inline float hsum_ps_avx(__m256 v) {
+    __m128 s =
+        _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+float euclidean_distance_bounded(const std::vector<float> &a,
+                                 const std::vector<float> &b, float cutoff) {
+    if (a.size() != b.size())
+        throw std::runtime_error("Vector dimensions mismatch");
+
+    size_t n = a.size();
+    float sum = 0.0f;
+    size_t i = 0;
+
+    if (n >= 8) {
+        __m256 sum_vec = _mm256_setzero_ps();
+        float temp[8];
+        for (; i <= n - 8; i += 8) {
+            __m256 va = _mm256_loadu_ps(&a[i]);
+            __m256 vb = _mm256_loadu_ps(&b[i]);
+            __m256 diff = _mm256_sub_ps(va, vb);
+            sum_vec = _mm256_fmadd_ps(diff, diff, sum_vec);
+            // Check every 64 dimensions, but not after the last block.
+            if (i % 64 == 56 && i + 16 <= n &&
+                hsum_ps_avx(sum_vec) * kPartialSlack > cutoff)
+                return std::numeric_limits<float>::infinity();
+        }
+        _mm256_storeu_ps(temp, sum_vec);
+        for (int j = 0; j < 8; ++j) {
+            sum += temp[j];
+        }
+    }
+
+    for (; i < n; ++i) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+// Negated inner product, so that smaller is closer as with L2. There is no
+// monotone partial sum to stop early on, so the cutoff is ignored.
+float neg_inner_product_simd(const std::vector<float> &a,
+                             const std::vector<float> &b, float /*cutoff*/) {
+    if (a.size() != b.size())
+        throw std::runtime_error("Vector dimensions mismatch");
+
+    size_t n = a.size();
+    float sum = 0.0f;
+    size_t i = 0;
+
+    if (n >= 8) {
+        __m256 sum_vec = _mm256_setzero_ps();
+        for (; i <= n - 8; i += 8) {
+            __m256 va = _mm256_loadu_ps(&a[i]);
+            __m256 vb = _mm256_loadu_ps(&b[i]);
+            sum_vec = _mm256_fmadd_ps(va, vb, sum_vec);
+        }
+        float temp[8];
+        _mm256_storeu_ps(temp, sum_vec);
+        for (int j = 0; j < 8; ++j) {
+            sum += temp[j];
+        }
+    }
+
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+
+    return -sum;
+}
+
+typedef float (*DistFn)(const std::vector<float> &, const std::vector<float> &,
+                        float cutoff);
+
+// Cosine is inner product over unit vectors: main() normalizes the base and
+// the queries once after reading them.
+DistFn get_dist_fn(Metric metric) {
+    return metric == Metric::L2 ? euclidean_distance_bounded
+                                : neg_inner_product_simd;
+}
+
+// Keeps the running top-k of one query over a growing prefix of the base, so
+// each stage only has to scan the points added since the previous stage.
+// Distances are produced in small blocks and run through the shared SIMD
+// threshold filter before touching the sorted top-k buffer.
+//
+// For sliding-window streams the buffer holds a deeper reserve of the nearest
+// live points. bound is a lower bound on the distance of every live point that
+// is not in the reserve, so while the reserve is not full only points below it
+// may enter, and the reserve always stays the exact nearest prefix of the live
+// set. Expiring points only drops reserve entries; the live window is rescanned
+// only when fewer than k entries are left and points outside the reserve may
+// still be alive.
 class IncrementalKNN {
    private:
-    std::priority_queue<PointPair, std::vector<PointPair>, std::less<PointPair>>
-        max_heap;
+    static constexpr size_t kBlockSize = 256;
+
+    TopKBuffer<int> topk;
     size_t current_size;
+    size_t window_start;
     int k;
+    DistFn dist;
+    float bound;
+    size_t rescans;
+    size_t computed;
+    size_t abandoned;
+
+    // Distances from query to vecs[first, first + n). Points that cannot
+    // enter the buffer may be abandoned early and come back as infinity.
+    void fill_block(const std::vector<std::vector<float>> &vecs, size_t first,
+                    size_t n, const std::vector<float> &query, float *dists) {
+        float cutoff = topk.full() ? topk.threshold() : bound;
+        for (size_t j = 0; j < n; ++j) {
+            dists[j] = dist(query, vecs[first + j], cutoff);
+            if (dists[j] == std::numeric_limits<float>::infinity())
+                abandoned++;
+        }
+        computed += n;
+    }
+
+    void push_block(float *dists, size_t n, size_t id_base) {
+        if (!topk.full() && bound < std::numeric_limits<float>::infinity()) {
+            for (size_t j = 0; j < n; ++j)
+                if (!(dists[j] < bound))
+                    dists[j] = std::numeric_limits<float>::infinity();
+        }
+        topk.push_block(dists, n, static_cast<int>(id_base));
+        if (topk.full()) bound = std::min(bound, topk.threshold());
+    }
 
    public:
-    IncrementalKNN(int k) : current_size(0), k(k) {}
+    IncrementalKNN(int k, Metric metric = Metric::L2, int reserve = 0)
+        : topk(std::max(k, reserve)),
+          current_size(0),
+          window_start(0),
+          k(k),
+          dist(get_dist_fn(metric)),
+          bound(std::numeric_limits<float>::infinity()),
+          rescans(0),
+          computed(0),
+          abandoned(0) {}
 
     void add_new_vectors(const std::vector<std::vector<float>> &new_vectors,
                          const std::vector<float> &query) {
-        for (const auto &vec : new_vectors) {
-            float dist = euclidean_distance_simd(query, vec);
-            if (max_heap.size() < static_cast<size_t>(k)) {
-                max_heap.emplace(dist, static_cast<int>(current_size++));
-            } else if (dist < max_heap.top().first) {
-                max_heap.pop();
-                max_heap.emplace(dist, static_cast<int>(current_size++));
-            } else {
-                current_size++;
-            }
+        float dists[kBlockSize];
+        for (size_t i = 0; i < new_vectors.size(); i += kBlockSize) {
+            size_t n = std::min(kBlockSize, new_vectors.size() - i);
+            fill_block(new_vectors, i, n, query, dists);
+            push_block(dists, n, current_size);
+            current_size += n;
         }
     }
 
-    std::vector<PointPair> get_topk() {
-        std::vector<PointPair> topk;
-        topk.reserve(k);
-        while (!max_heap.empty()) {
-            topk.emplace_back(max_heap.top().second, max_heap.top().first);
-            max_heap.pop();
+    // Scans base[current_size, end) only; ids are positions in the base.
+    void add_until(const std::vector<std::vector<float>> &base, size_t end,
+                   const std::vector<float> &query) {
+        float dists[kBlockSize];
+        end = std::min(end, base.size());
+        while (current_size < end) {
+            size_t n = std::min(kBlockSize, end - current_size);
+            fill_block(base, current_size, n, query, dists);
+            push_block(dists, n, current_size);
+            current_size += n;
         }
-        std::reverse(topk.begin(), topk.end());
-        return topk;
     }
 
-    void reset() {
-        while (!max_heap.empty()) {
-            max_heap.pop();
+    // Deletes base[window_start, start) from the live set.
+    void expire_before(const std::vector<std::vector<float>> &base,
+                       size_t start, const std::vector<float> &query) {
+        if (start <= window_start) return;
+        window_start = start;
+        topk.remove_if([start](int id) { return (size_t)id < start; });
+        if (topk.size() >= static_cast<size_t>(k) ||
+            bound == std::numeric_limits<float>::infinity())
+            return;
+
+        rescans++;
+        topk.clear();
+        bound = std::numeric_limits<float>::infinity();
+        float dists[kBlockSize];
+        for (size_t i = window_start; i < current_size; i += kBlockSize) {
+            size_t n = std::min(kBlockSize, current_size - i);
+            fill_block(base, i, n, query, dists);
+            push_block(dists, n, i);
         }
+    }
+
+    size_t size() const {
+        return std::min(topk.size(), static_cast<size_t>(k));
+    }
+    size_t num_rescans() const { return rescans; }
+    size_t num_computed() const { return computed; }
+    size_t num_abandoned() const { return abandoned; }
+
+    // Writes the current top-k in ascending distance order.
+    void snapshot(int *ids, float *dists) const {
+        std::copy(topk.ids(), topk.ids() + size(), ids);
+        std::copy(topk.dists(), topk.dists() + size(), dists);
+    }
+
+    std::vector<PointPair> get_topk() {
+        std::vector<PointPair> topk_pairs;
+        topk_pairs.reserve(k);
+        for (size_t i = 0; i < size(); ++i)
+            topk_pairs.emplace_back(topk.ids()[i], topk.dists()[i]);
+        topk.clear();
+        return topk_pairs;
+    }
+
+    void reset() {
+        topk.clear();
         current_size = 0;
+        window_start = 0;
+        bound = std::numeric_limits<float>::infinity();
+    }
+
+    // Checkpoint serialization of the whole per-query state, reserve included.
+    void save(std::ostream &out) const {
+        uint64_t fields[5] = {current_size, window_start, rescans, computed,
+                              abandoned};
+        uint32_t size = static_cast<uint32_t>(topk.size());
+        out.write(reinterpret_cast<const char *>(fields), sizeof(fields));
+        out.write(reinterpret_cast<const char *>(&bound), sizeof(float));
+        out.write(reinterpret_cast<const char *>(&size), sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(topk.ids()),
+                  size * sizeof(int));
+        out.write(reinterpret_cast<const char *>(topk.dists()),
+                  size * sizeof(float));
+    }
+
+    void load(std::istream &in) {
+        uint64_t fields[5];
+        uint32_t size;
+        in.read(reinterpret_cast<char *>(fields), sizeof(fields));
+        in.read(reinterpret_cast<char *>(&bound), sizeof(float));
+        in.read(reinterpret_cast<char *>(&size), sizeof(uint32_t));
+        if (size > topk.capacity())
+            throw std::runtime_error("Checkpointed top-k exceeds the reserve");
+        std::vector<int> ids(size);
+        std::vector<float> dists(size);
+        in.read(reinterpret_cast<char *>(ids.data()), size * sizeof(int));
+        in.read(reinterpret_cast<char *>(dists.data()), size * sizeof(float));
+        current_size = fields[0];
+        window_start = fields[1];
+        rescans = fields[2];
+        computed = fields[3];
+        abandoned = fields[4];
+        // Entries are sorted, so re-inserting them keeps their order.
+        topk.clear();
+        for (uint32_t i = 0; i < size; ++i) topk.insert(ids[i], dists[i]);
+    }
+};
+
+// Resumable state of a batch run, kept next to the output as
+// <batch_gt_path>.ckpt:
+//   CheckpointHeader, num_index x DeltaGTIndexEntry, then the saved state of
+//   every query's IncrementalKNN.
+// output_size is the length of the output file holding the first stages_done
+// stages. The output is fsynced before the checkpoint is renamed into place, so
+// a checkpoint never points past durable data; on resume anything after
+// output_size is cut off and recomputed.
+const uint32_t kCheckpointMagic = 0x43544753;  // "SGTC"
+const uint32_t kCheckpointVersion = 2;
+
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_queries;
+    uint64_t num_points;
+    uint64_t k;
+    uint64_t reserve;
+    uint64_t increment;
+    uint64_t window;
+    uint64_t keyframe_interval;
+    uint32_t metric;
+    uint32_t reserved;
+    uint64_t stages_done;
+    uint64_t output_size;
+    uint64_t num_index;
+};
+
+void fsync_file(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open file: " + path);
+    int ret = ::fsync(fd);
+    ::close(fd);
+    if (ret != 0) throw std::runtime_error("Failed to sync file: " + path);
+}
+
+void write_checkpoint(const std::string &ckpt_path, const std::string &gt_path,
+                      const CheckpointHeader &header,
+                      const std::vector<DeltaGTIndexEntry> &index,
+                      const std::vector<IncrementalKNN> &knns) {
+    fsync_file(gt_path);
+
+    std::string tmp_path = ckpt_path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out.is_open())
+        throw std::runtime_error("Failed to open file: " + tmp_path);
+    out.exceptions(std::ios::failbit | std::ios::badbit);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(index.data()),
+              index.size() * sizeof(DeltaGTIndexEntry));
+    for (const IncrementalKNN &knn : knns) knn.save(out);
+    out.close();
+
+    fsync_file(tmp_path);
+    if (std::rename(tmp_path.c_str(), ckpt_path.c_str()) != 0)
+        throw std::runtime_error("Failed to rename " + tmp_path + " to " +
+                                 ckpt_path);
+}
+
+void read_checkpoint(const std::string &ckpt_path, CheckpointHeader &header,
+                     std::vector<DeltaGTIndexEntry> &index,
+                     std::vector<IncrementalKNN> &knns) {
+    std::ifstream in(ckpt_path, std::ios::binary);
+    if (!in.is_open())
+        throw std::runtime_error("Failed to open checkpoint: " + ckpt_path);
+    in.exceptions(std::ios::failbit | std::ios::badbit);
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (header.magic != kCheckpointMagic ||
+        header.version != kCheckpointVersion)
+        throw std::runtime_error("Not a checkpoint file: " + ckpt_path);
+    if (header.num_queries != knns.size())
+        throw std::runtime_error("Checkpoint has " +
+                                 std::to_string(header.num_queries) +
+                                 " queries, expected " +
+                                 std::to_string(knns.size()));
+    index.resize(header.num_index);
+    in.read(reinterpret_cast<char *>(index.data()),
+            index.size() * sizeof(DeltaGTIndexEntry));
+    for (IncrementalKNN &knn : knns) knn.load(in);
+}
+
+// Writes checkpoints on a background thread so the compute threads only pay
+// for copying the per-query state. At most one checkpoint is in flight; a
+// failed checkpoint is reported and the run goes on with the previous one.
+class AsyncCheckpointer {
+   public:
+    AsyncCheckpointer(const std::string &ckpt_path, const std::string &gt_path)
+        : ckpt_path_(ckpt_path), gt_path_(gt_path) {}
+
+    ~AsyncCheckpointer() { wait(); }
+
+    void submit(const CheckpointHeader &header,
+                std::vector<DeltaGTIndexEntry> index,
+                std::vector<IncrementalKNN> knns) {
+        wait();
+        thread_ = std::thread([this, header, index = std::move(index),
+                               knns = std::move(knns)]() {
+            try {
+                write_checkpoint(ckpt_path_, gt_path_, header, index, knns);
+            } catch (const std::exception &e) {
+                std::cerr << "WARNING: checkpoint at stage "
+                          << header.stages_done << " failed: " << e.what()
+                          << std::endl;
+            }
+        });
+    }
+
+    void wait() {
+        if (thread_.joinable()) thread_.join();
     }
+
+   private:
+    std::string ckpt_path_;
+    std::string gt_path_;
+    std::thread thread_;
 };
 
 std::vector<PointPair> exact_knn(const std::vector<float> &query,
@@ -162,15 +512,10 @@ std::vector<std::vector<float>> read_fvecs(const std::string &filename) {
         in.read(reinterpret_cast<char *>(&dim), sizeof(int));
         if (!in.good()) break;
 
-        std::vector<float> vec_float(dim);
-        in.read(reinterpret_cast<char *>(vec_float.data()),
-                dim * sizeof(float));
-
+        // Components are kept as read: ip and cosine embeddings are signed
+        // and not integer-valued.
         std::vector<float> vec(dim);
-        for (int i = 0; i < dim; ++i) {
-            vec[i] = static_cast<float>(
-                std::min(std::max(vec_float[i], 0.0f), 255.0f));
-        }
+        in.read(reinterpret_cast<char *>(vec.data()), dim * sizeof(float));
         data.push_back(vec);
     }
     in.close();
@@ -187,6 +532,13 @@ struct Args {
     int increment = 10;
     int chunk_size = 10000;
     int num_threads = 0;
+    Metric metric = Metric::L2;
+    int keyframe_interval = 0;
+    int window = 0;
+    int reserve = 0;
+    int checkpoint_interval = 0;
+    bool resume = false;
+    std::string trace_path;
 };
 
 void print_help() {
@@ -202,6 +554,32 @@ void print_help() {
         << "  --chunk_size SIZE    Chunk size for processing (default: 10000)\n"
         << "  --threads N          Number of threads to use (default: 0, use "
            "system default)\n"
+        << "  --metric METRIC      l2, ip or cosine (default: l2)\n"
+        << "  --keyframe_interval N  Write the delta-encoded format with a "
+           "full\n"
+        << "                       keyframe every N stages (default: 0, "
+           "full\n"
+        << "                       top-k for every stage)\n"
+        << "  --window W           Sliding-window stream: each stage also "
+           "deletes\n"
+        << "                       points older than the last W inserts "
+           "(default:\n"
+        << "                       0, append-only)\n"
+        << "  --reserve R          Candidates kept per query in window mode "
+           "(default:\n"
+        << "                       2 * k)\n"
+        << "  --checkpoint_interval N  Checkpoint the per-query state to\n"
+        << "                       <batch_gt_path>.ckpt every N chunks "
+           "(default: 0,\n"
+        << "                       off; 1 with --resume)\n"
+        << "  --resume             Continue an interrupted run from its "
+           "checkpoint,\n"
+        << "                       appending to the existing output\n"
+        << "  --trace PATH         Trace-driven mode: compute GT at the "
+           "watermark of\n"
+        << "                       every search in a bench trace and write "
+           "it\n"
+        << "                       sparsely to batch_gt_path\n"
         << "  --help               Show this help message\n"
         << "\n"
         << "Mode Description:\n"
@@ -238,6 +616,21 @@ Args parse_args(int argc, char *argv[]) {
             args.chunk_size = std::stoi(argv[++i]);
         else if (arg == "--threads" && i + 1 < argc)
             args.num_threads = std::stoi(argv[++i]);
+        else if (arg == "--metric" && i + 1 < argc &&
+                 parse_metric(argv[i + 1], args.metric))
+            ++i;
+        else if (arg == "--keyframe_interval" && i + 1 < argc)
+            args.keyframe_interval = std::stoi(argv[++i]);
+        else if (arg == "--window" && i + 1 < argc)
+            args.window = std::stoi(argv[++i]);
+        else if (arg == "--reserve" && i + 1 < argc)
+            args.reserve = std::stoi(argv[++i]);
+        else if (arg == "--checkpoint_interval" && i + 1 < argc)
+            args.checkpoint_interval = std::stoi(argv[++i]);
+        else if (arg == "--resume")
+            args.resume = true;
+        else if (arg == "--trace" && i + 1 < argc)
+            args.trace_path = argv[++i];
         else {
             std::cerr << "Error: Unknown argument '" << arg << "'" << std::endl;
             std::cerr << "Use --help to see usage information" << std::endl;
@@ -247,8 +640,111 @@ Args parse_args(int argc, char *argv[]) {
     return args;
 }
 
+// Trace-driven mode: ground truth at exactly the watermark each traced search
+// saw. Events are reduced to distinct (query, watermark) pairs and sorted, so
+// every query is answered by one forward scan over the base that snapshots its
+// top-k at each of its watermarks on the way. The cost is one pass per query
+// up to its largest watermark, however many searches ran it.
+void compute_trace_gt(const Args &args,
+                      const std::vector<std::vector<float>> &base,
+                      const std::vector<std::vector<float>> &queries,
+                      size_t num_threads) {
+    std::vector<SearchTraceEvent> events;
+    load_search_trace(args.trace_path, events);
+
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;  // (query, watermark)
+    pairs.reserve(events.size());
+    for (const SearchTraceEvent &e : events) {
+        if (e.query_idx >= queries.size() || e.watermark > base.size())
+            throw std::runtime_error(
+                "Search " + std::to_string(e.search_id) + " (query " +
+                std::to_string(e.query_idx) + ", watermark " +
+                std::to_string(e.watermark) + ") is out of range for " +
+                std::to_string(queries.size()) + " queries and " +
+                std::to_string(base.size()) + " base points");
+        pairs.emplace_back(e.query_idx, e.watermark);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+    std::cout << "Read " << events.size() << " search events from "
+              << args.trace_path << ", " << pairs.size()
+              << " distinct (query, watermark) pairs" << std::endl;
+
+    // Pairs are answered in blocks of whole queries, which bounds the
+    // buffered results independently of the trace length.
+    const size_t kBlockPairs = 1 << 20;
+    size_t k = static_cast<size_t>(args.k);
+    SparseGTWriter out(args.batch_gt_path, args.k);
+    std::vector<int> ids;
+    std::vector<float> dists;
+    for (size_t begin = 0; begin < pairs.size();) {
+        size_t end = std::min(begin + kBlockPairs, pairs.size());
+        while (end < pairs.size() && pairs[end].first == pairs[end - 1].first)
+            ++end;
+        std::vector<size_t> groups;
+        for (size_t i = begin; i < end; ++i)
+            if (i == begin || pairs[i].first != pairs[i - 1].first)
+                groups.push_back(i);
+        groups.push_back(end);
+        ids.resize((end - begin) * k);
+        dists.resize((end - begin) * k);
+
+        std::atomic<size_t> next_group(0);
+        auto worker = [&]() {
+            IncrementalKNN knn(args.k, args.metric);
+            for (size_t g = next_group++; g + 1 < groups.size();
+                 g = next_group++) {
+                knn.reset();
+                const std::vector<float> &query =
+                    queries[pairs[groups[g]].first];
+                for (size_t i = groups[g]; i < groups[g + 1]; ++i) {
+                    knn.add_until(base, pairs[i].second, query);
+                    knn.snapshot(ids.data() + (i - begin) * k,
+                                 dists.data() + (i - begin) * k);
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; ++t) threads.emplace_back(worker);
+        for (auto &thread : threads) thread.join();
+
+        for (size_t i = begin; i < end; ++i) {
+            uint32_t count = static_cast<uint32_t>(
+                std::min<size_t>(k, pairs[i].second));
+            out.write_entry(pairs[i].first, pairs[i].second,
+                            ids.data() + (i - begin) * k,
+                            dists.data() + (i - begin) * k, count);
+        }
+        std::cout << "Processed " << end << "/" << pairs.size() << " pairs"
+                  << std::endl;
+        begin = end;
+    }
+    out.close();
+    std::cout << "Wrote " << out.num_entries() << " entries to "
+              << args.batch_gt_path << std::endl;
+}
+
 int main(int argc, char *argv[]) {
     Args args = parse_args(argc, argv);
+    if (args.window > 0 && args.window < args.k) {
+        std::cerr << "Error: --window must be at least --k" << std::endl;
+        return 1;
+    }
+    if (args.window > 0 && args.reserve == 0) args.reserve = 2 * args.k;
+    if (args.resume && args.batch_gt_path.empty()) {
+        std::cerr << "Error: --resume requires --batch_gt_path" << std::endl;
+        return 1;
+    }
+    if (args.resume && args.checkpoint_interval == 0)
+        args.checkpoint_interval = 1;
+    if (!args.trace_path.empty() &&
+        (args.batch_gt_path.empty() || args.window > 0 ||
+         args.keyframe_interval > 0 || args.checkpoint_interval > 0)) {
+        std::cerr << "Error: --trace needs --batch_gt_path and does not "
+                     "support --window, --keyframe_interval or checkpoints"
+                  << std::endl;
+        return 1;
+    }
 
     size_t num_threads = args.num_threads > 0
                              ? static_cast<size_t>(args.num_threads)
@@ -259,65 +755,161 @@ int main(int argc, char *argv[]) {
 
     std::vector<std::vector<float>> base = read_fvecs(args.base_path);
     std::vector<std::vector<float>> queries = read_fvecs(args.query_path);
+    if (args.metric == Metric::COSINE) {
+        for (auto &v : base) normalize_vector(v.data(), v.size());
+        for (auto &v : queries) normalize_vector(v.data(), v.size());
+    }
 
     std::cout << "Computing groundtruth for " << args.k << " nearest neighbors"
-              << std::endl;
+              << " (" << metric_name(args.metric) << ")" << std::endl;
+
+    if (!args.trace_path.empty()) {
+        compute_trace_gt(args, base, queries, num_threads);
+        return 0;
+    }
 
     if (!args.batch_gt_path.empty()) {
+        int n = static_cast<int>(queries.size());
+        size_t total_b = base.size();
+        size_t total_increments = total_b / args.increment;
+        size_t nq = queries.size();
+        size_t k = static_cast<size_t>(args.k);
+
+        // One persistent top-k state per query. Each chunk of stages is
+        // computed by walking every query forward through the chunk, so
+        // every base point is compared against every query exactly once
+        // (plus the occasional window rescan).
+        std::vector<IncrementalKNN> knns(
+            nq, IncrementalKNN(args.k, args.metric, args.reserve));
+        size_t window = static_cast<size_t>(args.window);
+        size_t chunk_cap =
+            std::min(static_cast<size_t>(args.chunk_size), total_increments);
+        std::vector<int> chunk_ids(chunk_cap * nq * k);
+        std::vector<float> chunk_dists(chunk_cap * nq * k);
+        std::vector<int> batch_sizes;
+        batch_sizes.reserve(chunk_cap);
+
+        std::string ckpt_path = args.batch_gt_path + ".ckpt";
+        CheckpointHeader ckpt = {};
+        ckpt.magic = kCheckpointMagic;
+        ckpt.version = kCheckpointVersion;
+        ckpt.num_queries = nq;
+        ckpt.num_points = total_b;
+        ckpt.k = k;
+        ckpt.reserve = static_cast<uint64_t>(args.reserve);
+        ckpt.increment = static_cast<uint64_t>(args.increment);
+        ckpt.window = window;
+        ckpt.keyframe_interval = static_cast<uint64_t>(args.keyframe_interval);
+        ckpt.metric = static_cast<uint32_t>(args.metric);
+
+        size_t current_increment = 0;
+        CheckpointHeader saved = ckpt;
+        std::vector<DeltaGTIndexEntry> saved_index;
+        if (args.resume) {
+            read_checkpoint(ckpt_path, saved, saved_index, knns);
+            if (saved.num_points != ckpt.num_points || saved.k != ckpt.k ||
+                saved.reserve != ckpt.reserve ||
+                saved.increment != ckpt.increment ||
+                saved.window != ckpt.window ||
+                saved.keyframe_interval != ckpt.keyframe_interval ||
+                saved.metric != ckpt.metric)
+                throw std::runtime_error(
+                    "Checkpoint " + ckpt_path +
+                    " was written with different data or options");
+            current_increment = saved.stages_done;
+            std::cout << "Resuming from checkpoint " << ckpt_path
+                      << " at increment " << current_increment << "/"
+                      << total_increments << std::endl;
+        }
+
         std::cout << "Attempting to open batch groundtruth file: "
                   << args.batch_gt_path << std::endl;
-        std::ofstream out(args.batch_gt_path, std::ios::binary);
-        if (!out.is_open()) {
-            std::cerr << "Error: Failed to open file: " << args.batch_gt_path
-                      << std::endl;
-            throw std::runtime_error("Failed to open file: " +
-                                     args.batch_gt_path);
+        std::ofstream out;
+        std::unique_ptr<DeltaGTWriter> delta_out;
+        if (args.keyframe_interval > 0 && args.resume) {
+            // The restored states are exactly the last written stage.
+            std::vector<int> last_ids(nq * k);
+            std::vector<float> last_dists(nq * k);
+            for (size_t i = 0; i < nq; ++i)
+                knns[i].snapshot(last_ids.data() + i * k,
+                                 last_dists.data() + i * k);
+            delta_out.reset(new DeltaGTWriter(
+                args.batch_gt_path, n, args.k, args.keyframe_interval,
+                saved.output_size, saved_index, last_ids.data(),
+                last_dists.data(), k));
+        } else if (args.keyframe_interval > 0) {
+            delta_out.reset(new DeltaGTWriter(args.batch_gt_path, n, args.k,
+                                              args.keyframe_interval));
+        } else {
+            std::ios::openmode mode = std::ios::binary;
+            if (args.resume) {
+                if (::truncate(args.batch_gt_path.c_str(),
+                               static_cast<off_t>(saved.output_size)) != 0)
+                    throw std::runtime_error("Failed to truncate file: " +
+                                             args.batch_gt_path);
+                mode |= std::ios::in | std::ios::out;
+            }
+            out.open(args.batch_gt_path, mode);
+            if (!out.is_open()) {
+                std::cerr << "Error: Failed to open file: "
+                          << args.batch_gt_path << std::endl;
+                throw std::runtime_error("Failed to open file: " +
+                                         args.batch_gt_path);
+            }
         }
         std::cout << "Successfully opened file for writing" << std::endl;
 
-        int n = static_cast<int>(queries.size());
-        int b = static_cast<int>((base.size() + args.increment - 1) /
-                                 args.increment);
-        out.write(reinterpret_cast<const char *>(&n), sizeof(int));
-        out.write(reinterpret_cast<const char *>(&args.k), sizeof(int));
-        out.write(reinterpret_cast<const char *>(&b), sizeof(int));
+        // b counts the stages written so far and is rewritten after every
+        // chunk, so an interrupted run still leaves a readable prefix.
+        auto write_stage_count = [&]() {
+            int b = static_cast<int>(current_increment);
+            out.seekp(2 * sizeof(int), std::ios::beg);
+            out.write(reinterpret_cast<const char *>(&b), sizeof(int));
+            out.seekp(0, std::ios::end);
+        };
+        if (!delta_out && !args.resume) {
+            out.write(reinterpret_cast<const char *>(&n), sizeof(int));
+            out.write(reinterpret_cast<const char *>(&args.k), sizeof(int));
+        }
+        if (!delta_out) write_stage_count();
 
-        std::vector<std::vector<std::vector<PointPair>>> batch_results;
-        std::vector<int> batch_sizes;
-        batch_results.reserve(args.chunk_size);
-        batch_sizes.reserve(args.chunk_size);
+        std::unique_ptr<AsyncCheckpointer> checkpointer;
+        if (args.checkpoint_interval > 0)
+            checkpointer.reset(
+                new AsyncCheckpointer(ckpt_path, args.batch_gt_path));
+        int chunks_since_checkpoint = 0;
 
-        size_t total_b = base.size();
-        size_t total_increments = total_b / args.increment;
-        size_t current_increment = 0;
+        while (current_increment < total_increments) {
+            size_t chunk_begin = current_increment;
+            size_t chunk_end =
+                std::min(chunk_begin + chunk_cap, total_increments);
+            size_t num_stages = chunk_end - chunk_begin;
 
-        for (size_t b_size = args.increment; b_size <= total_b;
-             b_size += args.increment) {
-            current_increment++;
-            int current_base_size = static_cast<int>(b_size);
-            batch_sizes.push_back(current_base_size);
+            batch_sizes.clear();
+            for (size_t s = chunk_begin; s < chunk_end; ++s)
+                batch_sizes.push_back(
+                    static_cast<int>((s + 1) * args.increment));
 
-            std::vector<std::vector<PointPair>> current_batch_results(
-                queries.size());
             std::vector<std::thread> threads;
-            size_t queries_per_thread =
-                (queries.size() + num_threads - 1) / num_threads;
+            size_t queries_per_thread = (nq + num_threads - 1) / num_threads;
 
             auto worker = [&](size_t start, size_t end) {
-                IncrementalKNN knn(args.k);
-                for (size_t i = start; i < end && i < queries.size(); ++i) {
-                    knn.reset();
-                    std::vector<std::vector<float>> current_base(
-                        base.begin(), base.begin() + b_size);
-                    knn.add_new_vectors(current_base, queries[i]);
-                    current_batch_results[i] = knn.get_topk();
+                for (size_t i = start; i < end && i < nq; ++i) {
+                    for (size_t s = 0; s < num_stages; ++s) {
+                        knns[i].add_until(base, batch_sizes[s], queries[i]);
+                        if (window > 0 && (size_t)batch_sizes[s] > window)
+                            knns[i].expire_before(
+                                base, batch_sizes[s] - window, queries[i]);
+                        size_t offset = (s * nq + i) * k;
+                        knns[i].snapshot(chunk_ids.data() + offset,
+                                         chunk_dists.data() + offset);
+                    }
                 }
             };
 
             for (size_t t = 0; t < num_threads; ++t) {
                 size_t start = t * queries_per_thread;
-                size_t end =
-                    std::min(start + queries_per_thread, queries.size());
+                size_t end = std::min(start + queries_per_thread, nq);
                 threads.emplace_back(worker, start, end);
             }
 
@@ -325,48 +917,97 @@ int main(int argc, char *argv[]) {
                 thread.join();
             }
 
-            batch_results.push_back(std::move(current_batch_results));
-
+            current_increment = chunk_end;
             std::cout << "Processed increment " << current_increment << "/"
                       << total_increments << " ("
                       << (current_increment * 100 / total_increments) << "%)"
-                      << " [base size: " << b_size << "]" << std::endl;
-
-            if (batch_results.size() >= static_cast<size_t>(args.chunk_size) ||
-                b_size + args.increment > total_b) {
-                std::cout << "Writing batch results for "
-                          << batch_results.size() << " increments to disk"
-                          << std::endl;
-
-                for (size_t i = 0; i < batch_results.size(); ++i) {
-                    out.write(reinterpret_cast<const char *>(&batch_sizes[i]),
-                              sizeof(int));
+                      << " [base size: " << batch_sizes.back() << "]"
+                      << std::endl;
 
-                    for (const auto &result : batch_results[i]) {
-                        for (const auto &[id, dist] : result) {
-                            out.write(reinterpret_cast<const char *>(&id),
-                                      sizeof(int));
-                        }
-                    }
+            std::cout << "Writing batch results for " << num_stages
+                      << " increments to disk" << std::endl;
 
-                    for (const auto &result : batch_results[i]) {
-                        for (const auto &[id, dist] : result) {
-                            out.write(reinterpret_cast<const char *>(&dist),
-                                      sizeof(float));
-                        }
-                    }
+            for (size_t s = 0; s < num_stages; ++s) {
+                if (delta_out) {
+                    delta_out->write_stage(batch_sizes[s],
+                                           chunk_ids.data() + s * nq * k,
+                                           chunk_dists.data() + s * nq * k, k);
+                    continue;
                 }
+                out.write(reinterpret_cast<const char *>(&batch_sizes[s]),
+                          sizeof(int));
+
+                // Early stages hold fewer than k points; only the filled
+                // prefix of each query's slot is written, as before.
+                size_t count =
+                    std::min(k, static_cast<size_t>(batch_sizes[s]));
+                const int *ids = chunk_ids.data() + s * nq * k;
+                const float *dists = chunk_dists.data() + s * nq * k;
+                if (count == k) {
+                    out.write(reinterpret_cast<const char *>(ids),
+                              nq * k * sizeof(int));
+                    out.write(reinterpret_cast<const char *>(dists),
+                              nq * k * sizeof(float));
+                    continue;
+                }
+                for (size_t i = 0; i < nq; ++i)
+                    out.write(reinterpret_cast<const char *>(ids + i * k),
+                              count * sizeof(int));
+                for (size_t i = 0; i < nq; ++i)
+                    out.write(reinterpret_cast<const char *>(dists + i * k),
+                              count * sizeof(float));
+            }
 
+            if (delta_out) {
+                delta_out->flush();
+            } else {
+                write_stage_count();
                 out.flush();
-                std::cout << "Flushed " << batch_results.size()
-                          << " increments to disk" << std::endl;
+            }
+            std::cout << "Flushed " << num_stages << " increments to disk"
+                      << std::endl;
 
-                batch_results.clear();
-                batch_sizes.clear();
+            if (checkpointer && current_increment < total_increments &&
+                ++chunks_since_checkpoint >= args.checkpoint_interval) {
+                chunks_since_checkpoint = 0;
+                ckpt.stages_done = current_increment;
+                std::vector<DeltaGTIndexEntry> index;
+                if (delta_out) {
+                    index = delta_out->index();
+                    ckpt.output_size = delta_out->offset();
+                } else {
+                    ckpt.output_size = static_cast<uint64_t>(out.tellp());
+                }
+                ckpt.num_index = index.size();
+                checkpointer->submit(ckpt, std::move(index), knns);
             }
         }
-        out.close();
+        if (checkpointer) checkpointer->wait();
+        if (delta_out)
+            delta_out->close();
+        else
+            out.close();
         std::cout << "Closed output file: " << args.batch_gt_path << std::endl;
+        if (checkpointer) std::remove(ckpt_path.c_str());
+
+        if (args.metric == Metric::L2) {
+            size_t computed = 0, abandoned = 0;
+            for (const IncrementalKNN &knn : knns) {
+                computed += knn.num_computed();
+                abandoned += knn.num_abandoned();
+            }
+            std::cout << "Early-abandoned " << abandoned << " of " << computed
+                      << " distance computations ("
+                      << (computed ? 100.0 * abandoned / computed : 0.0)
+                      << "%)" << std::endl;
+        }
+        if (window > 0) {
+            size_t rescans = 0;
+            for (const IncrementalKNN &knn : knns) rescans += knn.num_rescans();
+            std::cout << "Window rescans: " << rescans << " over " << nq
+                      << " queries and " << total_increments << " stages"
+                      << std::endl;
+        }
     }
 
     return 0;
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Distance conventions shared by the ground truth tools. Every metric is
+// reported as a distance where smaller is closer, so the recall tools can keep
+// sorting ascending regardless of metric:
+//   l2      squared Euclidean distance
+//   ip      negated inner product
+//   cosine  negated cosine similarity (inner product of unit vectors)
+enum class Metric { L2, IP, COSINE };
+
+inline bool parse_metric(const std::string &name, Metric &metric) {
+    if (name == "l2")
+        metric = Metric::L2;
+    else if (name == "ip" || name == "mips")
+        metric = Metric::IP;
+    else if (name == "cosine")
+        metric = Metric::COSINE;
+    else
+        return false;
+    return true;
+}
+
+inline const char *metric_name(Metric metric) {
+    switch (metric) {
+        case Metric::IP:
+            return "ip";
+        case Metric::COSINE:
+            return "cosine";
+        default:
+            return "l2";
+    }
+}
+
+// Scales v to unit length in place; zero vectors are left untouched.
+inline void normalize_vector(float *v, size_t dim) {
+    float norm = 0.0f;
+    for (size_t i = 0; i < dim; ++i) norm += v[i] * v[i];
+    if (norm == 0.0f) return;
+    float inv = 1.0f / std::sqrt(norm);
+    for (size_t i = 0; i < dim; ++i) v[i] *= inv;
+}
+
+// Exact squared L2 distances and inner products for 8-bit vectors. Values are
+// widened to int16 and multiplied into int32 lanes, so every result is exact
+// for any dimension below 2^15 (255^2 * 2^15 < 2^31) and no float widening of
+// the data is needed.
+//
+// Every kernel computes one query against n consecutive points, which keeps
+// the indirect call and the query loads out of the inner loop.
+
+template <typename T, bool kL2>
+inline int32_t int8_scalar(const T *a, const T *b, size_t dim) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < dim; ++i) {
+        if (kL2) {
+            int32_t d = (int32_t)a[i] - (int32_t)b[i];
+            sum += d * d;
+        } else {
+            sum += (int32_t)a[i] * (int32_t)b[i];
+        }
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) inline __m256i widen_epi16_avx2(
+    const uint8_t *p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+__attribute__((target("avx2"))) inline __m256i widen_epi16_avx2(
+    const int8_t *p) {
+    return _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline __m512i widen_epi16_avx512(
+    const uint8_t *p) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)p));
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline __m512i widen_epi16_avx512(
+    const int8_t *p) {
+    return _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)p));
+}
+
+__attribute__((target("avx2"))) inline int32_t hsum_epi32_avx2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+// 16 dimensions per step: widen, subtract for L2, then madd multiplies
+// adjacent int16 pairs into int32 lanes.
+template <typename T, bool kL2>
+__attribute__((target("avx2"))) void int8_block_avx2(const T *query,
+                                                     const T *points, size_t n,
+                                                     size_t dim, float *out) {
+    for (size_t p = 0; p < n; ++p) {
+        const T *point = points + p * dim;
+        __m256i acc = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 16 <= dim; i += 16) {
+            __m256i a = widen_epi16_avx2(query + i);
+            __m256i b = widen_epi16_avx2(point + i);
+            if (kL2) a = b = _mm256_sub_epi16(a, b);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+        }
+        int32_t sum = hsum_epi32_avx2(acc);
+        sum += int8_scalar<T, kL2>(query + i, point + i, dim - i);
+        out[p] = (float)sum;
+    }
+}
+
+// 32 dimensions per step, with VNNI's dpwssd fusing the multiply and the
+// accumulate.
+template <typename T, bool kL2>
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) void int8_block_vnni(
+    const T *query, const T *points, size_t n, size_t dim, float *out) {
+    for (size_t p = 0; p < n; ++p) {
+        const T *point = points + p * dim;
+        __m512i acc = _mm512_setzero_si512();
+        size_t i = 0;
+        for (; i + 32 <= dim; i += 32) {
+            __m512i a = widen_epi16_avx512(query + i);
+            __m512i b = widen_epi16_avx512(point + i);
+            if (kL2) a = b = _mm512_sub_epi16(a, b);
+            acc = _mm512_dpwssd_epi32(acc, a, b);
+        }
+        alignas(64) int32_t lanes[16];
+        _mm512_store_si512(lanes, acc);
+        int32_t sum = 0;
+        for (int l = 0; l < 16; ++l) sum += lanes[l];
+        sum += int8_scalar<T, kL2>(query + i, point + i, dim - i);
+        out[p] = (float)sum;
+    }
+}
+
+template <typename T>
+struct Int8Kernel {
+    typedef void (*BlockFn)(const T *, const T *, size_t, size_t, float *);
+    BlockFn l2sq;  // squared L2 distance
+    BlockFn dot;   // inner product, not negated
+    const char *name;
+};
+
+template <typename T>
+inline const Int8Kernel<T> &get_int8_kernel() {
+    static const Int8Kernel<T> kernel =
+        (__builtin_cpu_supports("avx512bw") &&
+         __builtin_cpu_supports("avx512vnni"))
+            ? Int8Kernel<T>{int8_block_vnni<T, true>,
+                            int8_block_vnni<T, false>, "avx512vnni_dpwssd"}
+            : Int8Kernel<T>{int8_block_avx2<T, true>,
+                            int8_block_avx2<T, false>, "avx2_madd"};
+    return kernel;
+}
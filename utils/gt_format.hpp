@@ -0,0 +1,588 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Delta-encoded stagewise ground truth (.dgt).
+//
+// Between two increments most queries keep their top-k, and those that change
+// usually gain a few new points that push the tail out. Instead of n x k ids
+// and distances per stage, the file stores a full keyframe every
+// keyframe_interval stages and, in between, only the change events of each
+// stage. An index at the end of the file records where every stage starts, so
+// a reader can seek to any stage by decoding one keyframe plus fewer than
+// keyframe_interval deltas.
+//
+// Layout (all integers little-endian):
+//   header   uint32 magic, uint32 version, int32 n, int32 k, int32 b,
+//            int32 keyframe_interval
+//   stage    int32 base_size, int32 count, uint32 kind
+//            kind 0 (keyframe): n x count int32 ids, n x count float dists
+//            kind 1 (delta):    uint32 num_events, num_events x DeltaGTEvent
+//   index    b x {uint64 offset, int32 base_size, uint32 kind}
+//   footer   uint64 index offset, uint32 magic
+//
+// count is min(k, base_size). Events of a delta stage are applied in order to
+// the previous stage's lists, which are then truncated to count:
+//   insert  insert (id, dist) at slot, shifting the rest of the list down
+//   set     overwrite slot, or append if slot equals the list size
+
+const uint32_t kDeltaGTMagic = 0x44544753;  // "SGTD"
+const uint32_t kDeltaGTVersion = 1;
+const uint32_t kDeltaGTSetFlag = 0x80000000u;
+
+struct DeltaGTEvent {
+    uint32_t query;
+    uint32_t slot;  // kDeltaGTSetFlag set for "set", clear for "insert"
+    int32_t id;
+    float dist;
+};
+
+struct DeltaGTIndexEntry {
+    uint64_t offset;
+    int32_t base_size;
+    uint32_t kind;
+};
+
+inline bool is_delta_gt_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    uint32_t magic = 0;
+    in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    return in.good() && magic == kDeltaGTMagic;
+}
+
+class DeltaGTWriter {
+   public:
+    DeltaGTWriter(const std::string &path, int n, int k,
+                  int keyframe_interval)
+        : out_(path, std::ios::binary),
+          n_(n),
+          k_(k),
+          keyframe_interval_(std::max(1, keyframe_interval)),
+          ids_((size_t)n * k),
+          dists_((size_t)n * k),
+          sizes_(n, 0) {
+        if (!out_.is_open())
+            throw std::runtime_error("Failed to open file: " + path);
+        out_.exceptions(std::ios::failbit | std::ios::badbit);
+        int32_t b = 0;
+        out_.write(reinterpret_cast<const char *>(&kDeltaGTMagic),
+                   sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(&kDeltaGTVersion),
+                   sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(&n_), sizeof(int32_t));
+        out_.write(reinterpret_cast<const char *>(&k_), sizeof(int32_t));
+        out_.write(reinterpret_cast<const char *>(&b), sizeof(int32_t));
+        out_.write(reinterpret_cast<const char *>(&keyframe_interval_),
+                   sizeof(int32_t));
+    }
+
+    // Reopens a file that an interrupted run wrote up to end_offset. index
+    // lists the stages written so far and ids/dists hold the last of them, so
+    // the next stage is encoded exactly as without the interruption.
+    DeltaGTWriter(const std::string &path, int n, int k, int keyframe_interval,
+                  uint64_t end_offset,
+                  const std::vector<DeltaGTIndexEntry> &index, const int *ids,
+                  const float *dists, size_t stride)
+        : n_(n),
+          k_(k),
+          keyframe_interval_(std::max(1, keyframe_interval)),
+          ids_((size_t)n * k),
+          dists_((size_t)n * k),
+          sizes_(n, 0),
+          index_(index) {
+        if (::truncate(path.c_str(), (off_t)end_offset) != 0)
+            throw std::runtime_error("Failed to truncate file: " + path);
+        out_.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        if (!out_.is_open())
+            throw std::runtime_error("Failed to open file: " + path);
+        out_.exceptions(std::ios::failbit | std::ios::badbit);
+        out_.seekp(0, std::ios::end);
+        if (index_.empty()) return;
+        int32_t count = std::min(k_, index_.back().base_size);
+        for (int i = 0; i < n_; ++i) {
+            std::copy(ids + i * stride, ids + i * stride + count,
+                      ids_.begin() + (size_t)i * k_);
+            std::copy(dists + i * stride, dists + i * stride + count,
+                      dists_.begin() + (size_t)i * k_);
+            sizes_[i] = count;
+        }
+    }
+
+    // A stream that already failed is left as is rather than throwing
+    // again while the first error unwinds.
+    ~DeltaGTWriter() {
+        if (out_.is_open() && !out_.fail()) close();
+    }
+
+    // ids/dists hold query i's sorted top-k at [i * stride, i * stride +
+    // count).
+    void write_stage(int base_size, const int *ids, const float *dists,
+                     size_t stride) {
+        int32_t count = std::min(k_, base_size);
+        uint32_t kind = index_.size() % keyframe_interval_ == 0 ? 0 : 1;
+        index_.push_back(DeltaGTIndexEntry{(uint64_t)out_.tellp(),
+                                           (int32_t)base_size, kind});
+        out_.write(reinterpret_cast<const char *>(&base_size), sizeof(int32_t));
+        out_.write(reinterpret_cast<const char *>(&count), sizeof(int32_t));
+        out_.write(reinterpret_cast<const char *>(&kind), sizeof(uint32_t));
+
+        if (kind == 0) {
+            for (int i = 0; i < n_; ++i)
+                out_.write(reinterpret_cast<const char *>(ids + i * stride),
+                           count * sizeof(int32_t));
+            for (int i = 0; i < n_; ++i)
+                out_.write(reinterpret_cast<const char *>(dists + i * stride),
+                           count * sizeof(float));
+        } else {
+            events_.clear();
+            for (int i = 0; i < n_; ++i)
+                diff_query(i, ids + i * stride, dists + i * stride, count);
+            uint32_t num_events = (uint32_t)events_.size();
+            out_.write(reinterpret_cast<const char *>(&num_events),
+                       sizeof(uint32_t));
+            out_.write(reinterpret_cast<const char *>(events_.data()),
+                       events_.size() * sizeof(DeltaGTEvent));
+        }
+
+        for (int i = 0; i < n_; ++i) {
+            std::copy(ids + i * stride, ids + i * stride + count,
+                      ids_.begin() + (size_t)i * k_);
+            std::copy(dists + i * stride, dists + i * stride + count,
+                      dists_.begin() + (size_t)i * k_);
+            sizes_[i] = count;
+        }
+    }
+
+    void flush() { out_.flush(); }
+
+    // Stages written so far and the end of the last one, for checkpoints.
+    const std::vector<DeltaGTIndexEntry> &index() const { return index_; }
+    uint64_t offset() { return (uint64_t)out_.tellp(); }
+
+    void close() {
+        uint64_t index_offset = (uint64_t)out_.tellp();
+        out_.write(reinterpret_cast<const char *>(index_.data()),
+                   index_.size() * sizeof(DeltaGTIndexEntry));
+        out_.write(reinterpret_cast<const char *>(&index_offset),
+                   sizeof(uint64_t));
+        out_.write(reinterpret_cast<const char *>(&kDeltaGTMagic),
+                   sizeof(uint32_t));
+        int32_t b = (int32_t)index_.size();
+        out_.seekp(4 * sizeof(int32_t), std::ios::beg);
+        out_.write(reinterpret_cast<const char *>(&b), sizeof(int32_t));
+        out_.close();
+    }
+
+   private:
+    static bool same(int32_t a_id, float a_dist, int32_t b_id, float b_dist) {
+        return a_id == b_id &&
+               std::memcmp(&a_dist, &b_dist, sizeof(float)) == 0;
+    }
+
+    // Emits whichever of the two encodings is shorter: inserts, when the new
+    // list is the old one with new entries merged in, or per-slot sets.
+    void diff_query(int q, const int *ids, const float *dists, int count) {
+        const int32_t *old_ids = ids_.data() + (size_t)q * k_;
+        const float *old_dists = dists_.data() + (size_t)q * k_;
+        int old_size = sizes_[q];
+
+        inserts_.clear();
+        int j = 0;
+        for (int i = 0; i < count; ++i) {
+            if (j < old_size &&
+                same(ids[i], dists[i], old_ids[j], old_dists[j]))
+                ++j;
+            else
+                inserts_.push_back(
+                    DeltaGTEvent{(uint32_t)q, (uint32_t)i, ids[i], dists[i]});
+        }
+        if (inserts_.empty()) return;
+
+        size_t num_sets = 0;
+        for (int i = 0; i < count; ++i)
+            if (i >= old_size ||
+                !same(ids[i], dists[i], old_ids[i], old_dists[i]))
+                ++num_sets;
+
+        if (inserts_.size() <= num_sets) {
+            events_.insert(events_.end(), inserts_.begin(), inserts_.end());
+            return;
+        }
+        for (int i = 0; i < count; ++i)
+            if (i >= old_size ||
+                !same(ids[i], dists[i], old_ids[i], old_dists[i]))
+                events_.push_back(DeltaGTEvent{
+                    (uint32_t)q, (uint32_t)i | kDeltaGTSetFlag, ids[i],
+                    dists[i]});
+    }
+
+    std::ofstream out_;
+    int32_t n_;
+    int32_t k_;
+    int32_t keyframe_interval_;
+    std::vector<int32_t> ids_;
+    std::vector<float> dists_;
+    std::vector<int> sizes_;
+    std::vector<DeltaGTIndexEntry> index_;
+    std::vector<DeltaGTEvent> events_;
+    std::vector<DeltaGTEvent> inserts_;
+};
+
+// Random access over a .dgt file. read_stage() replays from the closest
+// keyframe at or before the requested stage, or keeps going from the last
+// decoded stage when that is closer, so a forward scan decodes every record
+// exactly once.
+class DeltaGTReader {
+   public:
+    explicit DeltaGTReader(const std::string &path)
+        : in_(path, std::ios::binary) {
+        if (!in_.is_open())
+            throw std::runtime_error("Failed to open file: " + path);
+        in_.exceptions(std::ios::failbit | std::ios::badbit);
+        uint32_t magic, version;
+        in_.read(reinterpret_cast<char *>(&magic), sizeof(uint32_t));
+        in_.read(reinterpret_cast<char *>(&version), sizeof(uint32_t));
+        if (magic != kDeltaGTMagic || version != kDeltaGTVersion)
+            throw std::runtime_error("Not a delta GT file: " + path);
+        int32_t b, keyframe_interval;
+        in_.read(reinterpret_cast<char *>(&n_), sizeof(int32_t));
+        in_.read(reinterpret_cast<char *>(&k_), sizeof(int32_t));
+        in_.read(reinterpret_cast<char *>(&b), sizeof(int32_t));
+        in_.read(reinterpret_cast<char *>(&keyframe_interval), sizeof(int32_t));
+        if (n_ <= 0 || k_ <= 0 || b < 0)
+            throw std::runtime_error(
+                "Invalid file header: n, k, or b is non-positive");
+
+        uint64_t index_offset;
+        in_.seekg(-(std::streamoff)(sizeof(uint64_t) + sizeof(uint32_t)),
+                  std::ios::end);
+        in_.read(reinterpret_cast<char *>(&index_offset), sizeof(uint64_t));
+        index_.resize(b);
+        in_.seekg(index_offset, std::ios::beg);
+        in_.read(reinterpret_cast<char *>(index_.data()),
+                 b * sizeof(DeltaGTIndexEntry));
+
+        ids_.resize((size_t)n_ * k_);
+        dists_.resize((size_t)n_ * k_);
+        sizes_.assign(n_, 0);
+    }
+
+    int num_queries() const { return n_; }
+    int k() const { return k_; }
+    int num_stages() const { return (int)index_.size(); }
+    int base_size(int stage) const { return index_[stage].base_size; }
+
+    // Decodes stage into ids/dists laid out [query][count].
+    void read_stage(int stage, std::vector<uint32_t> &ids,
+                    std::vector<float> &dists, int &count) {
+        if (stage < 0 || stage >= num_stages())
+            throw std::runtime_error("Stage out of range: " +
+                                     std::to_string(stage));
+        int start = stage;
+        while (index_[start].kind != 0) --start;
+        if (cur_stage_ >= start && cur_stage_ <= stage) start = cur_stage_ + 1;
+        for (int s = start; s <= stage; ++s) apply_stage(s);
+
+        count = count_;
+        ids.resize((size_t)n_ * count);
+        dists.resize((size_t)n_ * count);
+        for (int i = 0; i < n_; ++i) {
+            std::copy(ids_.begin() + (size_t)i * k_,
+                      ids_.begin() + (size_t)i * k_ + count,
+                      ids.begin() + (size_t)i * count);
+            std::copy(dists_.begin() + (size_t)i * k_,
+                      dists_.begin() + (size_t)i * k_ + count,
+                      dists.begin() + (size_t)i * count);
+        }
+    }
+
+   private:
+    void apply_stage(int s) {
+        in_.seekg(index_[s].offset, std::ios::beg);
+        int32_t base_size, count;
+        uint32_t kind;
+        in_.read(reinterpret_cast<char *>(&base_size), sizeof(int32_t));
+        in_.read(reinterpret_cast<char *>(&count), sizeof(int32_t));
+        in_.read(reinterpret_cast<char *>(&kind), sizeof(uint32_t));
+
+        if (kind == 0) {
+            std::vector<int32_t> block((size_t)n_ * count);
+            in_.read(reinterpret_cast<char *>(block.data()),
+                     block.size() * sizeof(int32_t));
+            for (int i = 0; i < n_; ++i)
+                std::copy(block.begin() + (size_t)i * count,
+                          block.begin() + (size_t)(i + 1) * count,
+                          ids_.begin() + (size_t)i * k_);
+            std::vector<float> dblock((size_t)n_ * count);
+            in_.read(reinterpret_cast<char *>(dblock.data()),
+                     dblock.size() * sizeof(float));
+            for (int i = 0; i < n_; ++i)
+                std::copy(dblock.begin() + (size_t)i * count,
+                          dblock.begin() + (size_t)(i + 1) * count,
+                          dists_.begin() + (size_t)i * k_);
+            std::fill(sizes_.begin(), sizes_.end(), count);
+        } else {
+            uint32_t num_events;
+            in_.read(reinterpret_cast<char *>(&num_events), sizeof(uint32_t));
+            events_.resize(num_events);
+            in_.read(reinterpret_cast<char *>(events_.data()),
+                     num_events * sizeof(DeltaGTEvent));
+            for (const DeltaGTEvent &e : events_) apply_event(e);
+            for (int &size : sizes_) size = std::min(size, (int)count);
+        }
+        cur_stage_ = s;
+        count_ = count;
+    }
+
+    // Rows have room for k entries; an insert into a full row drops the last
+    // one, which the truncation to count would remove anyway.
+    void apply_event(const DeltaGTEvent &e) {
+        uint32_t *ids = ids_.data() + (size_t)e.query * k_;
+        float *dists = dists_.data() + (size_t)e.query * k_;
+        int &size = sizes_[e.query];
+        int slot = (int)(e.slot & ~kDeltaGTSetFlag);
+        if (e.slot & kDeltaGTSetFlag) {
+            if (slot == size) ++size;
+        } else {
+            int last = std::min(size, k_ - 1);
+            std::memmove(ids + slot + 1, ids + slot,
+                         (last - slot) * sizeof(uint32_t));
+            std::memmove(dists + slot + 1, dists + slot,
+                         (last - slot) * sizeof(float));
+            size = std::min(size + 1, (int)k_);
+        }
+        ids[slot] = (uint32_t)e.id;
+        dists[slot] = e.dist;
+    }
+
+    std::ifstream in_;
+    int32_t n_;
+    int32_t k_;
+    std::vector<DeltaGTIndexEntry> index_;
+    std::vector<uint32_t> ids_;
+    std::vector<float> dists_;
+    std::vector<int> sizes_;
+    std::vector<DeltaGTEvent> events_;
+    int cur_stage_ = -1;
+    int count_ = 0;
+};
+
+// Partial ground truth written by one compute_gt shard (.gtp). A shard covers
+// queries [query_begin, query_end) against base points [point_begin,
+// point_end); ids are global base positions. Rows hold the shard's k nearest
+// in ascending distance and are padded with kGTPartialEmpty / +inf when the
+// shard has fewer than k points. metric (a Metric value) and dim record what
+// the distances mean, so merge_gt can refuse to mix runs, and num_points is
+// the size of the whole base, so it can tell when a shard is missing.
+// merge_gt combines partials into the usual truthset layout.
+//
+// Layout: GTPartialHeader, then n x k uint32 ids, then n x k float dists,
+// with n = query_end - query_begin.
+
+const uint32_t kGTPartialMagic = 0x50544753;  // "SGTP"
+const uint32_t kGTPartialVersion = 3;
+const uint32_t kGTPartialEmpty = 0xFFFFFFFFu;
+
+struct GTPartialHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_queries;  // queries in the full query set
+    uint64_t num_points;   // points in the full base
+    uint64_t query_begin;
+    uint64_t query_end;
+    uint64_t point_begin;
+    uint64_t point_end;
+    uint32_t k;
+    uint32_t metric;
+    uint32_t dim;
+    uint32_t reserved;
+};
+
+inline void save_gt_partial(const std::string &path,
+                            const GTPartialHeader &header, const uint32_t *ids,
+                            const float *dists) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open())
+        throw std::runtime_error("Failed to open file: " + path);
+    out.exceptions(std::ios::failbit | std::ios::badbit);
+    size_t n = header.query_end - header.query_begin;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(ids),
+              n * header.k * sizeof(uint32_t));
+    out.write(reinterpret_cast<const char *>(dists),
+              n * header.k * sizeof(float));
+}
+
+inline void load_gt_partial(const std::string &path, GTPartialHeader &header,
+                            std::vector<uint32_t> &ids,
+                            std::vector<float> &dists) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+        throw std::runtime_error("Failed to open file: " + path);
+    in.exceptions(std::ios::failbit | std::ios::badbit);
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (header.magic != kGTPartialMagic ||
+        header.version != kGTPartialVersion)
+        throw std::runtime_error("Not a partial GT file: " + path);
+    if (header.query_end < header.query_begin ||
+        header.query_end > header.num_queries ||
+        header.point_end < header.point_begin ||
+        header.point_end > header.num_points)
+        throw std::runtime_error("Invalid ranges in partial GT file: " + path);
+    size_t n = header.query_end - header.query_begin;
+    ids.resize(n * header.k);
+    dists.resize(n * header.k);
+    in.read(reinterpret_cast<char *>(ids.data()),
+            ids.size() * sizeof(uint32_t));
+    in.read(reinterpret_cast<char *>(dists.data()),
+            dists.size() * sizeof(float));
+}
+
+// Search trace (.trace) recorded by the bench: for every search, the query it
+// ran and the visible insert watermark, i.e. the number of base points
+// [0, watermark) whose inserts had all completed when the search started.
+//   header  uint32 magic, uint32 version
+//   event   SearchTraceEvent, in search order
+const uint32_t kSearchTraceMagic = 0x52544753;  // "SGTR"
+const uint32_t kSearchTraceVersion = 1;
+
+struct SearchTraceEvent {
+    uint64_t search_id;
+    uint32_t query_idx;
+    uint32_t watermark;
+};
+
+inline void load_search_trace(const std::string &path,
+                              std::vector<SearchTraceEvent> &events) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open())
+        throw std::runtime_error("Failed to open file: " + path);
+    in.exceptions(std::ios::failbit | std::ios::badbit);
+    size_t size = (size_t)in.tellg();
+    uint32_t magic = 0, version = 0;
+    in.seekg(0, std::ios::beg);
+    if (size >= 2 * sizeof(uint32_t)) {
+        in.read(reinterpret_cast<char *>(&magic), sizeof(uint32_t));
+        in.read(reinterpret_cast<char *>(&version), sizeof(uint32_t));
+    }
+    if (magic != kSearchTraceMagic || version != kSearchTraceVersion)
+        throw std::runtime_error("Not a search trace: " + path);
+    // A trace cut short by a crash keeps its complete events.
+    size_t num_events =
+        (size - 2 * sizeof(uint32_t)) / sizeof(SearchTraceEvent);
+    events.resize(num_events);
+    in.read(reinterpret_cast<char *>(events.data()),
+            num_events * sizeof(SearchTraceEvent));
+}
+
+// Sparse stagewise ground truth (.sgt) for traced runs: one entry per distinct
+// (base_size, query) pair instead of every query at every stage.
+//   header  uint32 magic, uint32 version, uint64 num_entries, int32 k,
+//           int32 reserved
+//   entry   uint32 query, uint32 base_size, uint32 count,
+//           count x int32 ids, count x float dists
+// Entries are grouped by query with base_size ascending within a query.
+const uint32_t kSparseGTMagic = 0x53544753;  // "SGTS"
+const uint32_t kSparseGTVersion = 1;
+
+inline bool is_sparse_gt_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    uint32_t magic = 0;
+    in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    return in.good() && magic == kSparseGTMagic;
+}
+
+class SparseGTWriter {
+   public:
+    SparseGTWriter(const std::string &path, int k)
+        : out_(path, std::ios::binary), k_(k), num_entries_(0) {
+        if (!out_.is_open())
+            throw std::runtime_error("Failed to open file: " + path);
+        out_.exceptions(std::ios::failbit | std::ios::badbit);
+        int32_t reserved = 0;
+        out_.write(reinterpret_cast<const char *>(&kSparseGTMagic),
+                   sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(&kSparseGTVersion),
+                   sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(&num_entries_),
+                   sizeof(uint64_t));
+        out_.write(reinterpret_cast<const char *>(&k_), sizeof(int32_t));
+        out_.write(reinterpret_cast<const char *>(&reserved), sizeof(int32_t));
+    }
+
+    ~SparseGTWriter() {
+        if (out_.is_open()) close();
+    }
+
+    void write_entry(uint32_t query, uint32_t base_size, const int *ids,
+                     const float *dists, uint32_t count) {
+        out_.write(reinterpret_cast<const char *>(&query), sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(&base_size),
+                   sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(&count), sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(ids),
+                   count * sizeof(int32_t));
+        out_.write(reinterpret_cast<const char *>(dists),
+                   count * sizeof(float));
+        num_entries_++;
+    }
+
+    uint64_t num_entries() const { return num_entries_; }
+
+    void close() {
+        out_.seekp(2 * sizeof(uint32_t), std::ios::beg);
+        out_.write(reinterpret_cast<const char *>(&num_entries_),
+                   sizeof(uint64_t));
+        out_.close();
+    }
+
+   private:
+    std::ofstream out_;
+    int32_t k_;
+    uint64_t num_entries_;
+};
+
+// Plain ground truth / result matrix (.gt, .bin) as written by compute_gt and
+// the bench: int32 n, int32 k, n x k uint32 ids, then optionally n x k float
+// distances. Whether distances are present is told by the file size; dists is
+// left empty when they are not.
+inline void load_truthset(const std::string &path, std::vector<uint32_t> &ids,
+                          std::vector<float> &dists, size_t &n, size_t &k) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open())
+        throw std::runtime_error("Failed to open file: " + path);
+    in.exceptions(std::ios::failbit | std::ios::badbit);
+    uint64_t file_size = static_cast<uint64_t>(in.tellg());
+    in.seekg(0, std::ios::beg);
+    int32_t header[2] = {0, 0};
+    if (file_size < sizeof(header))
+        throw std::runtime_error("Truncated truthset file: " + path);
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (header[0] < 0 || header[1] < 0)
+        throw std::runtime_error("Invalid truthset header: " + path);
+    n = static_cast<size_t>(header[0]);
+    k = static_cast<size_t>(header[1]);
+    uint64_t cells = static_cast<uint64_t>(n) * k;
+    uint64_t ids_size = sizeof(header) + cells * sizeof(uint32_t);
+    uint64_t full_size = ids_size + cells * sizeof(float);
+    if (file_size != ids_size && file_size != full_size)
+        throw std::runtime_error(
+            "Truthset file size mismatch: " + path + " has " +
+            std::to_string(file_size) + " bytes, expected " +
+            std::to_string(ids_size) + " or " + std::to_string(full_size));
+    ids.resize(cells);
+    in.read(reinterpret_cast<char *>(ids.data()), cells * sizeof(uint32_t));
+    dists.clear();
+    if (file_size == full_size) {
+        dists.resize(cells);
+        in.read(reinterpret_cast<char *>(dists.data()), cells * sizeof(float));
+    }
+}
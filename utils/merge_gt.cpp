@@ -0,0 +1,190 @@
+#include <getopt.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "gt_format.hpp"
+
+// Combines the partial truthsets written by sharded compute_gt runs
+// (--num_shards / --num_query_shards) into one truthset with the same layout
+// as an unsharded run: int n, int k, n x k int32 ids, n x k float dists.
+
+struct Partial {
+    std::string path;
+    GTPartialHeader header;
+    std::vector<uint32_t> ids;
+    std::vector<float> dists;
+};
+
+// Every query must be covered by partials whose point ranges tile
+// [0, num_points) exactly once.
+void check_coverage(const std::vector<Partial> &partials, size_t num_queries,
+                    size_t num_points) {
+    std::vector<size_t> cuts = {0, num_queries};
+    for (const Partial &p : partials) {
+        cuts.push_back(p.header.query_begin);
+        cuts.push_back(p.header.query_end);
+    }
+    std::sort(cuts.begin(), cuts.end());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+
+    for (size_t c = 0; c + 1 < cuts.size(); ++c) {
+        size_t q_b = cuts[c], q_e = cuts[c + 1];
+        std::vector<std::pair<size_t, size_t>> ranges;
+        for (const Partial &p : partials)
+            if (p.header.query_begin <= q_b && p.header.query_end >= q_e &&
+                p.header.point_end > p.header.point_begin)
+                ranges.emplace_back(p.header.point_begin, p.header.point_end);
+        std::sort(ranges.begin(), ranges.end());
+        size_t covered = 0;
+        for (const auto &r : ranges) {
+            if (r.first != covered)
+                throw std::runtime_error(
+                    "Partials for queries [" + std::to_string(q_b) + "," +
+                    std::to_string(q_e) + ") " +
+                    (r.first < covered ? "overlap" : "leave a gap") +
+                    " at point " + std::to_string(std::min(r.first, covered)));
+            covered = r.second;
+        }
+        if (covered != num_points)
+            throw std::runtime_error(
+                "Partials for queries [" + std::to_string(q_b) + "," +
+                std::to_string(q_e) + ") cover points up to " +
+                std::to_string(covered) + " of " + std::to_string(num_points));
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string gt_file;
+    int K = 0;
+
+    const option long_opts[] = {{"gt_file", required_argument, nullptr, 0},
+                                {"k", required_argument, nullptr, 0},
+                                {nullptr, 0, nullptr, 0}};
+    int opt_idx = 0;
+    while (true) {
+        int opt = getopt_long(argc, argv, "", long_opts, &opt_idx);
+        if (opt == -1) break;
+        if (opt == 0) {
+            if (std::string(long_opts[opt_idx].name) == "gt_file")
+                gt_file = optarg;
+            else if (std::string(long_opts[opt_idx].name) == "k")
+                K = std::stoi(optarg);
+        }
+    }
+
+    if (gt_file.empty() || optind >= argc || K < 0) {
+        std::cout << "Usage: ./merge_gt --gt_file GT [--k K] PARTIAL..."
+                  << std::endl;
+        return 1;
+    }
+
+    try {
+        std::vector<Partial> partials(argc - optind);
+        size_t num_queries = 0, num_points = 0, k = 0;
+        uint32_t metric = 0, dim = 0;
+        for (size_t i = 0; i < partials.size(); ++i) {
+            Partial &p = partials[i];
+            p.path = argv[optind + i];
+            load_gt_partial(p.path, p.header, p.ids, p.dists);
+            std::cout << "Read " << p.path << ": queries ["
+                      << p.header.query_begin << "," << p.header.query_end
+                      << "), points [" << p.header.point_begin << ","
+                      << p.header.point_end << ")" << std::endl;
+            if (i == 0) {
+                num_queries = p.header.num_queries;
+                num_points = p.header.num_points;
+                k = p.header.k;
+                metric = p.header.metric;
+                dim = p.header.dim;
+            } else if (p.header.num_queries != num_queries ||
+                       p.header.num_points != num_points ||
+                       p.header.k != k) {
+                throw std::runtime_error(
+                    p.path +
+                    " was computed for a different query set, base or k");
+            } else if (p.header.metric != metric || p.header.dim != dim) {
+                throw std::runtime_error(
+                    p.path + " was computed with a different metric or dim");
+            }
+        }
+        if (K > 0) {
+            if ((size_t)K > k)
+                throw std::runtime_error("Partials only hold " +
+                                         std::to_string(k) + " neighbors");
+            k = K;
+        }
+        check_coverage(partials, num_queries, num_points);
+
+        std::vector<int32_t> ids(num_queries * k);
+        std::vector<float> dists(num_queries * k);
+        size_t short_queries = 0;
+
+        // k-way merge of the sorted per-shard rows of each query, ordered by
+        // (distance, id).
+        typedef std::tuple<float, uint32_t, size_t, size_t> Head;
+        for (size_t q = 0; q < num_queries; ++q) {
+            std::priority_queue<Head, std::vector<Head>, std::greater<Head>>
+                heads;
+            for (size_t s = 0; s < partials.size(); ++s) {
+                const GTPartialHeader &h = partials[s].header;
+                if (q < h.query_begin || q >= h.query_end) continue;
+                size_t row = (q - h.query_begin) * h.k;
+                if (partials[s].ids[row] != kGTPartialEmpty)
+                    heads.emplace(partials[s].dists[row], partials[s].ids[row],
+                                  s, row);
+            }
+            size_t j = 0;
+            for (; j < k && !heads.empty(); ++j) {
+                Head top = heads.top();
+                heads.pop();
+                ids[q * k + j] = (int32_t)std::get<1>(top);
+                dists[q * k + j] = std::get<0>(top);
+
+                const Partial &p = partials[std::get<2>(top)];
+                size_t next = std::get<3>(top) + 1;
+                size_t row_end =
+                    (q - p.header.query_begin + 1) * (size_t)p.header.k;
+                if (next < row_end && p.ids[next] != kGTPartialEmpty)
+                    heads.emplace(p.dists[next], p.ids[next],
+                                  std::get<2>(top), next);
+            }
+            if (j < k) short_queries++;
+            for (; j < k; ++j) {
+                ids[q * k + j] = (int32_t)kGTPartialEmpty;
+                dists[q * k + j] = std::numeric_limits<float>::infinity();
+            }
+        }
+        if (short_queries)
+            std::cout << "WARNING: found less than k GT entries for "
+                      << short_queries << " queries" << std::endl;
+
+        std::ofstream writer(gt_file, std::ios::binary);
+        writer.exceptions(std::ios::failbit | std::ios::badbit);
+        int npts_i32 = (int)num_queries, ndims_i32 = (int)k;
+        writer.write(reinterpret_cast<char *>(&npts_i32), sizeof(int));
+        writer.write(reinterpret_cast<char *>(&ndims_i32), sizeof(int));
+        writer.write(reinterpret_cast<char *>(ids.data()),
+                     ids.size() * sizeof(int32_t));
+        writer.write(reinterpret_cast<char *>(dists.data()),
+                     dists.size() * sizeof(float));
+        writer.close();
+        std::cout << "Merged " << partials.size() << " partials into "
+                  << gt_file << " (" << num_queries << " queries, k = " << k
+                  << ", " << num_points << " points)" << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "gt_format.hpp"
+#include "recall.hpp"
+
+// Random access to the stages of a stagewise ground truth file by base size.
+// Full and sparse files are memory-mapped and only their stage headers are
+// read up front; delta files go through DeltaGTReader, which decodes forward
+// from the nearest keyframe. Not thread-safe.
+class StagewiseGT {
+   public:
+    explicit StagewiseGT(const std::string &path) : path_(path) {
+        if (is_delta_gt_file(path)) {
+            delta_.reset(new DeltaGTReader(path));
+            n_ = delta_->num_queries();
+            for (int s = 0; s < delta_->num_stages(); ++s)
+                stages_[delta_->base_size(s)] = Stage{(uint64_t)s, 0};
+            return;
+        }
+        map_file();
+        if (size_ >= sizeof(uint32_t) &&
+            *reinterpret_cast<const uint32_t *>(data_) == kSparseGTMagic)
+            index_sparse();
+        else
+            index_full();
+    }
+
+    ~StagewiseGT() {
+        if (data_) munmap(const_cast<char *>(data_), size_);
+    }
+
+    StagewiseGT(const StagewiseGT &) = delete;
+    StagewiseGT &operator=(const StagewiseGT &) = delete;
+
+    int num_queries() const { return n_; }
+    size_t num_stages() const { return stages_.size(); }
+
+    // Builds the recall sets of the stage with base_size; false if the file
+    // has no such stage.
+    bool build_sets(size_t base_size, size_t recall_at, RecallSets &sets) {
+        auto it = stages_.find(base_size);
+        if (it == stages_.end()) return false;
+        const Stage &stage = it->second;
+        if (delta_) {
+            int count;
+            delta_->read_stage((int)stage.offset, ids_, dists_, count);
+            sizes_.assign(n_, count);
+            sets.build(ids_.data(), dists_.data(), sizes_.data(), n_, count,
+                       recall_at);
+        } else if (sparse_) {
+            // Only the queries with an entry in the stage get a set.
+            sets.clear();
+            for (uint64_t e = stage.offset; e < stage.offset + stage.count;
+                 ++e) {
+                const SparseEntry &entry = sparse_entries_[e];
+                const uint32_t *ids =
+                    reinterpret_cast<const uint32_t *>(data_ + entry.offset);
+                sets.add(entry.query, ids,
+                         reinterpret_cast<const float *>(ids + entry.count),
+                         entry.count, recall_at);
+            }
+        } else {
+            const uint32_t *ids =
+                reinterpret_cast<const uint32_t *>(data_ + stage.offset);
+            const float *dists = reinterpret_cast<const float *>(
+                ids + (size_t)n_ * stage.count);
+            sizes_.assign(n_, (int)stage.count);
+            sets.build(ids, dists, sizes_.data(), n_, stage.count, recall_at);
+        }
+        return true;
+    }
+
+   private:
+    // Full files: offset of the stage's ids and the per-query count. Sparse
+    // files: the stage's range in sparse_entries_. Delta files: stage index.
+    struct Stage {
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    struct SparseEntry {
+        uint32_t base_size;
+        uint32_t query;
+        uint32_t count;
+        uint64_t offset;
+    };
+
+    void map_file() {
+        int fd = ::open(path_.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Failed to open file: " + path_);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat file: " + path_);
+        }
+        size_ = (size_t)st.st_size;
+        void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("Failed to map file: " + path_);
+        data_ = static_cast<const char *>(addr);
+    }
+
+    template <typename T>
+    T read_at(uint64_t offset) const {
+        if (offset + sizeof(T) > size_)
+            throw std::runtime_error("Truncated GT file: " + path_);
+        T value;
+        std::memcpy(&value, data_ + offset, sizeof(T));
+        return value;
+    }
+
+    void index_full() {
+        int32_t n = read_at<int32_t>(0), k = read_at<int32_t>(4),
+                b = read_at<int32_t>(8);
+        if (n <= 0 || k <= 0 || b <= 0)
+            throw std::runtime_error(
+                "Invalid file header: n, k, or b is non-positive");
+        n_ = n;
+        k_ = k;
+        uint64_t offset = 3 * sizeof(int32_t);
+        for (int32_t s = 0; s < b; ++s) {
+            int32_t base_size = read_at<int32_t>(offset);
+            // Stages smaller than k hold only their base_size points.
+            uint64_t count = (uint64_t)std::max(0, std::min(k, base_size));
+            offset += sizeof(int32_t);
+            stages_[base_size] = Stage{offset, count};
+            offset += (uint64_t)n * count * (sizeof(int32_t) + sizeof(float));
+            if (offset > size_)
+                throw std::runtime_error("Truncated GT file: " + path_);
+        }
+    }
+
+    void index_sparse() {
+        sparse_ = true;
+        uint64_t num_entries = read_at<uint64_t>(8);
+        k_ = read_at<int32_t>(16);
+        if (read_at<uint32_t>(4) != kSparseGTVersion || k_ <= 0)
+            throw std::runtime_error("Invalid sparse GT header: " + path_);
+        uint64_t offset = 24;
+        sparse_entries_.reserve(num_entries);
+        for (uint64_t e = 0; e < num_entries; ++e) {
+            uint32_t query = read_at<uint32_t>(offset);
+            uint32_t base_size = read_at<uint32_t>(offset + 4);
+            uint32_t count = read_at<uint32_t>(offset + 8);
+            offset += 3 * sizeof(uint32_t);
+            if (count > (uint32_t)k_ ||
+                offset + count * (sizeof(int32_t) + sizeof(float)) > size_)
+                throw std::runtime_error("Invalid sparse GT entry " +
+                                         std::to_string(e) + " in " + path_);
+            sparse_entries_.push_back(
+                SparseEntry{base_size, query, count, offset});
+            n_ = std::max(n_, (int)query + 1);
+            offset += count * (sizeof(int32_t) + sizeof(float));
+        }
+        std::sort(sparse_entries_.begin(), sparse_entries_.end(),
+                  [](const SparseEntry &a, const SparseEntry &b) {
+                      return a.base_size < b.base_size;
+                  });
+        for (size_t e = 0; e < sparse_entries_.size(); ++e) {
+            Stage &stage = stages_[sparse_entries_[e].base_size];
+            if (stage.count == 0) stage.offset = e;
+            stage.count++;
+        }
+    }
+
+    std::string path_;
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    std::unique_ptr<DeltaGTReader> delta_;
+    bool sparse_ = false;
+    int n_ = 0;
+    int k_ = 0;
+    std::unordered_map<uint64_t, Stage> stages_;
+    std::vector<SparseEntry> sparse_entries_;
+    std::vector<uint32_t> ids_;
+    std::vector<float> dists_;
+    std::vector<int> sizes_;
+};
+
+// Scores search results while the benchmark is still running. submit() copies
+// a batch into a queue and returns; a background thread scores it against the
+// ground truth stage matching its insert offset and adds it to running
+// per-stage totals. The recall sets of the most recently used stages are
+// cached, since searches at a given offset arrive close together.
+class OnlineRecall {
+   public:
+    struct StageRecall {
+        double recall_sum = 0.0;  // sum of per-query recall, in [0, 1]
+        uint64_t count = 0;       // scored queries
+        uint64_t unmatched = 0;   // queries with no ground truth
+    };
+
+    OnlineRecall(const std::string &gt_path, size_t recall_at)
+        : gt_(gt_path), recall_at_(recall_at) {
+        worker_ = std::thread([this] { run(); });
+    }
+
+    ~OnlineRecall() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mu_);
+            stop_ = true;
+        }
+        queue_cv_.notify_all();
+        worker_.join();
+    }
+
+    OnlineRecall(const OnlineRecall &) = delete;
+    OnlineRecall &operator=(const OnlineRecall &) = delete;
+
+    // Queues count results seen at insert_offset; tags holds count x k ids,
+    // where 0xffffffff marks an empty slot. Blocks only while kMaxQueued
+    // results are already waiting.
+    void submit(uint64_t insert_offset, const uint32_t *query_idx,
+                const uint32_t *tags, size_t count, size_t k) {
+        Batch batch{insert_offset, k,
+                    std::vector<uint32_t>(query_idx, query_idx + count),
+                    std::vector<uint32_t>(tags, tags + count * k)};
+        std::unique_lock<std::mutex> lock(queue_mu_);
+        space_cv_.wait(lock, [&] { return queued_ < kMaxQueued; });
+        queued_ += count;
+        queue_.push_back(std::move(batch));
+        queue_cv_.notify_one();
+    }
+
+    // Waits until every submitted batch has been scored.
+    void flush() {
+        std::unique_lock<std::mutex> lock(queue_mu_);
+        space_cv_.wait(lock, [&] { return queue_.empty() && !busy_; });
+    }
+
+    // Running totals per insert offset, ordered by offset.
+    std::map<uint64_t, StageRecall> stages() const {
+        std::lock_guard<std::mutex> lock(stats_mu_);
+        return stats_;
+    }
+
+    StageRecall overall() const {
+        std::lock_guard<std::mutex> lock(stats_mu_);
+        return total_;
+    }
+
+   private:
+    static constexpr size_t kMaxQueued = 1 << 20;
+    static constexpr size_t kCachedStages = 16;
+
+    struct Batch {
+        uint64_t insert_offset;
+        size_t k;
+        std::vector<uint32_t> query_idx;
+        std::vector<uint32_t> tags;
+    };
+
+    void run() {
+        std::vector<uint32_t> scratch;
+        while (true) {
+            Batch batch;
+            {
+                std::unique_lock<std::mutex> lock(queue_mu_);
+                queue_cv_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                batch = std::move(queue_.front());
+                queue_.pop_front();
+                busy_ = true;
+            }
+
+            StageRecall delta;
+            const RecallSets *sets = stage_sets(batch.insert_offset);
+            for (size_t r = 0; r < batch.query_idx.size(); ++r) {
+                size_t q = batch.query_idx[r];
+                if (!sets || !sets->has(q)) {
+                    delta.unmatched++;
+                    continue;
+                }
+                delta.recall_sum +=
+                    (double)count_matches(*sets, q,
+                                          batch.tags.data() + r * batch.k,
+                                          batch.k, 0xffffffffu, scratch) /
+                    recall_at_;
+                delta.count++;
+            }
+            {
+                std::lock_guard<std::mutex> lock(stats_mu_);
+                add(stats_[batch.insert_offset], delta);
+                add(total_, delta);
+            }
+            {
+                std::lock_guard<std::mutex> lock(queue_mu_);
+                queued_ -= batch.query_idx.size();
+                busy_ = false;
+            }
+            space_cv_.notify_all();
+        }
+    }
+
+    static void add(StageRecall &to, const StageRecall &from) {
+        to.recall_sum += from.recall_sum;
+        to.count += from.count;
+        to.unmatched += from.unmatched;
+    }
+
+    // Recall sets of the stage at base_size, or null if the ground truth has
+    // no such stage or it cannot be read.
+    const RecallSets *stage_sets(uint64_t base_size) {
+        auto it = cache_.find(base_size);
+        if (it != cache_.end()) return it->second.get();
+        std::unique_ptr<RecallSets> sets(new RecallSets());
+        try {
+            if (!gt_.build_sets(base_size, recall_at_, *sets)) sets.reset();
+        } catch (const std::exception &e) {
+            std::cerr << "Failed to read ground truth stage " << base_size
+                      << ": " << e.what() << std::endl;
+            sets.reset();
+        }
+        if (cache_order_.size() == kCachedStages) {
+            cache_.erase(cache_order_.front());
+            cache_order_.pop_front();
+        }
+        cache_order_.push_back(base_size);
+        return (cache_[base_size] = std::move(sets)).get();
+    }
+
+    StagewiseGT gt_;
+    size_t recall_at_;
+
+    std::mutex queue_mu_;
+    std::condition_variable queue_cv_, space_cv_;
+    std::deque<Batch> queue_;
+    size_t queued_ = 0;
+    bool busy_ = false;
+    bool stop_ = false;
+
+    mutable std::mutex stats_mu_;
+    std::map<uint64_t, StageRecall> stats_;
+    StageRecall total_;
+
+    std::unordered_map<uint64_t, std::unique_ptr<RecallSets>> cache_;
+    std::deque<uint64_t> cache_order_;
+    std::thread worker_;
+};
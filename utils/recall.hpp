@@ -0,0 +1,273 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Recall library shared by the recall tools and the bench (through
+// index_cgo). Ground truth neighbors and search results are both compared as
+// sorted id arrays, so scoring a query is one short SIMD merge rather than a
+// set lookup per returned tag.
+
+// Number of values two sorted, duplicate-free arrays have in common.
+inline size_t intersect_count_scalar(const uint32_t *a, size_t na,
+                                     const uint32_t *b, size_t nb) {
+    size_t i = 0, j = 0, count = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (b[j] < a[i]) {
+            ++j;
+        } else {
+            ++count;
+            ++i;
+            ++j;
+        }
+    }
+    return count;
+}
+
+// Block merge: every 8-wide block of a is compared against all 8 rotations of
+// the current block of b, then whichever block ends lower is advanced. A
+// common value is seen exactly once, in the step where both of its blocks are
+// loaded.
+__attribute__((target("avx2"))) inline size_t intersect_count_avx2(
+    const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    size_t i = 0, j = 0, count = 0;
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+        __m256i eq = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; ++r) {
+            vb = _mm256_permutevar8x32_epi32(vb, rotate);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+        }
+        count += __builtin_popcount(
+            (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+        uint32_t a_max = a[i + 7], b_max = b[j + 7];
+        if (a_max <= b_max) i += 8;
+        if (b_max <= a_max) j += 8;
+    }
+    return count + intersect_count_scalar(a + i, na - i, b + j, nb - j);
+}
+
+inline size_t intersect_count(const uint32_t *a, size_t na, const uint32_t *b,
+                              size_t nb) {
+    return intersect_count_avx2(a, na, b, nb);
+}
+
+// End of the recall set of a ground truth row with size entries, nearest
+// first: the recall_at nearest plus every further neighbor tying the
+// recall_at-th distance. Without distances there is no tie extension.
+inline size_t recall_set_end(const float *dists, size_t size,
+                             size_t recall_at) {
+    size_t end = std::min(recall_at, size);
+    if (dists && end == recall_at && end > 0)
+        while (end < size && dists[end] == dists[recall_at - 1]) ++end;
+    return end;
+}
+
+// Sorts ids[0, n) into out without duplicates or empty (padding) tags.
+inline void sorted_unique(const uint32_t *ids, size_t n, uint32_t empty,
+                          std::vector<uint32_t> &out) {
+    out.clear();
+    for (size_t j = 0; j < n; ++j)
+        if (ids[j] != empty) out.push_back(ids[j]);
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+// Recall sets of one ground truth stage, flattened: the sorted ids of row r
+// are ids[offsets[r], offsets[r + 1]). A set holds the recall_at nearest
+// neighbors plus every further neighbor tying the recall_at-th distance, so a
+// result is not penalized for picking a different one of several equals.
+// build() makes row q the set of query q; a sparse stage that only holds a
+// few queries is instead filled one query at a time with clear() and add(),
+// and rows are then found through a map.
+class RecallSets {
+   public:
+    // gt_ids/gt_dists hold n rows of stride entries, nearest first; sizes[q]
+    // is the number of valid entries of row q, or -1 for a missing row.
+    void build(const uint32_t *gt_ids, const float *gt_dists,
+               const int *sizes, size_t n, size_t stride, size_t recall_at) {
+        clear();
+        sparse_ = false;
+        present_.assign(n, 0);
+        for (size_t q = 0; q < n; ++q) {
+            if (sizes[q] >= 0) {
+                present_[q] = 1;
+                add_row(gt_ids + q * stride, gt_dists + q * stride, sizes[q],
+                        recall_at);
+            } else {
+                offsets_.push_back(ids_.size());
+            }
+        }
+    }
+
+    // Empties the sets for add().
+    void clear() {
+        ids_.clear();
+        offsets_.assign(1, 0);
+        present_.clear();
+        rows_.clear();
+        sparse_ = true;
+        ties_ = 0;
+    }
+
+    // Sets query q from its size nearest neighbors, replacing any earlier
+    // set of q.
+    void add(uint32_t q, const uint32_t *gt_ids, const float *gt_dists,
+             size_t size, size_t recall_at) {
+        rows_[q] = offsets_.size() - 1;
+        add_row(gt_ids, gt_dists, size, recall_at);
+    }
+
+    bool has(size_t q) const {
+        if (sparse_) return rows_.count(q) != 0;
+        return q < present_.size() && present_[q];
+    }
+    const uint32_t *set(size_t q) const {
+        return ids_.data() + offsets_[row(q)];
+    }
+    size_t set_size(size_t q) const {
+        size_t r = row(q);
+        return offsets_[r + 1] - offsets_[r];
+    }
+    // Neighbors added past recall_at by ties.
+    size_t ties() const { return ties_; }
+    size_t num_ids() const { return ids_.size(); }
+
+   private:
+    size_t row(size_t q) const { return sparse_ ? rows_.at(q) : q; }
+
+    void add_row(const uint32_t *ids, const float *dists, size_t size,
+                 size_t recall_at) {
+        if (!std::is_sorted(dists, dists + size)) {
+            row_.clear();
+            for (size_t i = 0; i < size; ++i)
+                row_.emplace_back(dists[i], ids[i]);
+            std::stable_sort(row_.begin(), row_.end(),
+                             [](const std::pair<float, uint32_t> &x,
+                                const std::pair<float, uint32_t> &y) {
+                                 return x.first < y.first;
+                             });
+            row_ids_.resize(size);
+            row_dists_.resize(size);
+            for (size_t i = 0; i < size; ++i) {
+                row_dists_[i] = row_[i].first;
+                row_ids_[i] = row_[i].second;
+            }
+            ids = row_ids_.data();
+            dists = row_dists_.data();
+        }
+
+        size_t end = recall_set_end(dists, size, recall_at);
+        if (end > recall_at) ties_ += end - recall_at;
+        size_t begin = ids_.size();
+        ids_.insert(ids_.end(), ids, ids + end);
+        std::sort(ids_.begin() + begin, ids_.end());
+        ids_.erase(std::unique(ids_.begin() + begin, ids_.end()), ids_.end());
+        offsets_.push_back(ids_.size());
+    }
+
+    std::vector<uint32_t> ids_;
+    std::vector<size_t> offsets_;
+    std::vector<uint8_t> present_;
+    std::unordered_map<uint32_t, size_t> rows_;
+    bool sparse_ = false;
+    std::vector<std::pair<float, uint32_t>> row_;
+    std::vector<uint32_t> row_ids_;
+    std::vector<float> row_dists_;
+    size_t ties_ = 0;
+};
+
+// Number of the k tags of a result row that are in set q. Tags equal to
+// empty (padding) are skipped and repeated tags count once; scratch is reused
+// across calls.
+inline size_t count_matches(const RecallSets &sets, size_t q,
+                            const uint32_t *tags, size_t k, uint32_t empty,
+                            std::vector<uint32_t> &scratch) {
+    sorted_unique(tags, k, empty, scratch);
+    return intersect_count(sets.set(q), sets.set_size(q), scratch.data(),
+                           scratch.size());
+}
+
+// Rank (0-based) of the first of the k tags that is in set q, or k if none.
+// With sets built at recall_at 1 this is the rank of the true nearest neighbor
+// (or one tying it), as used for the mean reciprocal rank.
+inline size_t first_match(const RecallSets &sets, size_t q,
+                          const uint32_t *tags, size_t k) {
+    const uint32_t *begin = sets.set(q), *end = begin + sets.set_size(q);
+    for (size_t j = 0; j < k; ++j)
+        if (std::binary_search(begin, end, tags[j])) return j;
+    return k;
+}
+
+// Sum of res_dists[j] / gt_dists[j] over the first n ranks, both nearest
+// first; returns the number of ranks summed. Ranks with an empty result
+// (infinite distance) or a non-positive ground truth distance are skipped,
+// so the ratio is only meaningful for metrics like (squared) l2 whose
+// distances are non-negative.
+inline size_t sum_distance_ratios(const float *res_dists,
+                                  const float *gt_dists, size_t n,
+                                  double &sum) {
+    size_t count = 0;
+    for (size_t j = 0; j < n; ++j) {
+        if (!(gt_dists[j] > 0.0f) || !std::isfinite(res_dists[j]) ||
+            res_dists[j] < 0.0f)
+            continue;
+        sum += static_cast<double>(res_dists[j]) / gt_dists[j];
+        ++count;
+    }
+    return count;
+}
+
+// Recall@recall_at, in percent, of num_queries result rows (res_k tags each)
+// against a ground truth matrix (gt_k ids per row, nearest first). With
+// gt_dists the ground truth set is extended over ties at the recall_at-th
+// distance; gt_dists may be null. Only the first recall_at tags of a result
+// row count, and repeated or empty tags are counted once at most. Queries are
+// split over num_threads threads, 0 meaning one per hardware thread.
+inline double calculate_recall(size_t num_queries, const uint32_t *gt_ids,
+                               const float *gt_dists, size_t gt_k,
+                               const uint32_t *res_tags, size_t res_k,
+                               size_t recall_at, uint32_t empty = 0xffffffff,
+                               size_t num_threads = 0) {
+    if (num_queries == 0 || recall_at == 0) return 0.0;
+    if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0) num_threads = 1;
+    // Small inputs are not worth a thread each.
+    num_threads = std::min(num_threads, (num_queries + 1023) / 1024);
+
+    size_t res_n = std::min(recall_at, res_k);
+    std::vector<size_t> matches(num_threads, 0);
+    auto score = [&](size_t t) {
+        std::vector<uint32_t> gt, res;
+        size_t begin = num_queries * t / num_threads;
+        size_t end = num_queries * (t + 1) / num_threads;
+        for (size_t q = begin; q < end; ++q) {
+            const float *dists = gt_dists ? gt_dists + q * gt_k : nullptr;
+            sorted_unique(gt_ids + q * gt_k,
+                          recall_set_end(dists, gt_k, recall_at), empty, gt);
+            sorted_unique(res_tags + q * res_k, res_n, empty, res);
+            matches[t] +=
+                intersect_count(gt.data(), gt.size(), res.data(), res.size());
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; ++t) threads.emplace_back(score, t);
+    score(0);
+    for (auto &thread : threads) thread.join();
+
+    size_t total = 0;
+    for (size_t m : matches) total += m;
+    return static_cast<double>(total) / num_queries * (100.0 / recall_at);
+}
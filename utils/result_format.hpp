@@ -0,0 +1,220 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Binary stagewise search results (.sres), written by the bench and read by
+// calc_incr_recall in place of the text .res files.
+//
+// Results are stored in batches, one per search call, whose queries all saw
+// the same insert offset. Every result row has exactly k tags (short rows are
+// padded with kResultEmpty), so a batch is a set of fixed-width columns that a
+// reader can use straight from an mmap without parsing.
+//
+// Layout (all integers little-endian):
+//   header  ResultFileHeader
+//   batch   count x uint32 query_idx, count x k uint32 tags,
+//           count x k float dists (only with kResultHasDistances)
+//   index   num_batches x ResultBatchEntry, 8-byte aligned
+// Batches appear in the order they were written; the index lets a reader
+// visit them grouped by insert offset.
+const uint32_t kResultMagic = 0x53455253;  // "SRES"
+const uint32_t kResultVersion = 1;
+const uint32_t kResultHasDistances = 1;
+const uint32_t kResultEmpty = 0xffffffff;
+
+struct ResultFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t k;
+    uint32_t flags;
+    uint64_t num_results;
+    uint64_t num_batches;
+    uint64_t index_offset;
+};
+static_assert(sizeof(ResultFileHeader) == 40, "unexpected header padding");
+
+struct ResultBatchEntry {
+    uint64_t insert_offset;
+    uint64_t offset;  // file offset of the batch's query_idx column
+    uint32_t count;
+    uint32_t reserved;
+};
+static_assert(sizeof(ResultBatchEntry) == 24, "unexpected entry padding");
+
+inline bool is_result_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    uint32_t magic = 0;
+    in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    return in.good() && magic == kResultMagic;
+}
+
+class ResultWriter {
+   public:
+    ResultWriter(const std::string &path, uint32_t k, bool with_distances)
+        : out_(path, std::ios::binary) {
+        if (!out_.is_open())
+            throw std::runtime_error("Failed to open file: " + path);
+        out_.exceptions(std::ios::failbit | std::ios::badbit);
+        header_ = ResultFileHeader{
+            kResultMagic, kResultVersion, k,
+            with_distances ? kResultHasDistances : 0u, 0, 0, 0};
+        out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+        offset_ = sizeof(header_);
+    }
+
+    ~ResultWriter() {
+        if (out_.is_open()) close();
+    }
+
+    // Appends count results seen at insert_offset. tags (and dists, when the
+    // file has distances) hold count x k values, row by row.
+    void write_batch(uint64_t insert_offset, uint32_t count,
+                     const uint32_t *query_idx, const uint32_t *tags,
+                     const float *dists) {
+        size_t cells = (size_t)count * header_.k;
+        index_.push_back(ResultBatchEntry{insert_offset, offset_, count, 0});
+        out_.write(reinterpret_cast<const char *>(query_idx),
+                   count * sizeof(uint32_t));
+        out_.write(reinterpret_cast<const char *>(tags),
+                   cells * sizeof(uint32_t));
+        offset_ += (count + cells) * sizeof(uint32_t);
+        if (header_.flags & kResultHasDistances) {
+            out_.write(reinterpret_cast<const char *>(dists),
+                       cells * sizeof(float));
+            offset_ += cells * sizeof(float);
+        }
+        header_.num_results += count;
+    }
+
+    void close() {
+        const char pad[8] = {};
+        size_t padding = (8 - offset_ % 8) % 8;
+        out_.write(pad, padding);
+        header_.index_offset = offset_ + padding;
+        header_.num_batches = index_.size();
+        out_.write(reinterpret_cast<const char *>(index_.data()),
+                   index_.size() * sizeof(ResultBatchEntry));
+        out_.seekp(0, std::ios::beg);
+        out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+        out_.close();
+    }
+
+   private:
+    std::ofstream out_;
+    ResultFileHeader header_;
+    uint64_t offset_;
+    std::vector<ResultBatchEntry> index_;
+};
+
+// One batch of results viewed in place; dists is null without distances.
+struct ResultBatch {
+    uint64_t insert_offset;
+    uint32_t count;
+    const uint32_t *query_idx;
+    const uint32_t *tags;
+    const float *dists;
+};
+
+// Read-only mapping of a .sres file. batches() lists every batch ordered by
+// insert offset (file order within an offset); the views stay valid for the
+// reader's lifetime.
+class ResultReader {
+   public:
+    explicit ResultReader(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Failed to open file: " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat file: " + path);
+        }
+        size_ = (size_t)st.st_size;
+        if (size_ < sizeof(ResultFileHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Not a result file: " + path);
+        }
+        void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("Failed to map file: " + path);
+        data_ = static_cast<const char *>(addr);
+        madvise(addr, size_, MADV_SEQUENTIAL);
+
+        std::memcpy(&header_, data_, sizeof(header_));
+        if (header_.magic != kResultMagic ||
+            header_.version != kResultVersion) {
+            unmap();
+            throw std::runtime_error("Not a result file: " + path);
+        }
+        size_t cell_bytes =
+            sizeof(uint32_t) + (has_distances() ? sizeof(float) : 0);
+        if (header_.index_offset % 8 != 0 ||
+            header_.index_offset > size_ ||
+            (size_ - header_.index_offset) / sizeof(ResultBatchEntry) <
+                header_.num_batches) {
+            unmap();
+            throw std::runtime_error("Truncated or unfinished result file: " +
+                                     path);
+        }
+
+        const ResultBatchEntry *index =
+            reinterpret_cast<const ResultBatchEntry *>(data_ +
+                                                       header_.index_offset);
+        batches_.reserve(header_.num_batches);
+        for (uint64_t b = 0; b < header_.num_batches; ++b) {
+            const ResultBatchEntry &e = index[b];
+            size_t cells = (size_t)e.count * header_.k;
+            if (e.offset % 4 != 0 ||
+                e.offset + e.count * sizeof(uint32_t) + cells * cell_bytes >
+                    header_.index_offset) {
+                unmap();
+                throw std::runtime_error("Corrupt batch index in " + path);
+            }
+            const uint32_t *query_idx =
+                reinterpret_cast<const uint32_t *>(data_ + e.offset);
+            const uint32_t *tags = query_idx + e.count;
+            const float *dists =
+                has_distances()
+                    ? reinterpret_cast<const float *>(tags + cells)
+                    : nullptr;
+            batches_.push_back(
+                ResultBatch{e.insert_offset, e.count, query_idx, tags, dists});
+        }
+        std::stable_sort(batches_.begin(), batches_.end(),
+                         [](const ResultBatch &a, const ResultBatch &b) {
+                             return a.insert_offset < b.insert_offset;
+                         });
+    }
+
+    ~ResultReader() { unmap(); }
+
+    ResultReader(const ResultReader &) = delete;
+    ResultReader &operator=(const ResultReader &) = delete;
+
+    uint32_t k() const { return header_.k; }
+    bool has_distances() const { return header_.flags & kResultHasDistances; }
+    uint64_t num_results() const { return header_.num_results; }
+    const std::vector<ResultBatch> &batches() const { return batches_; }
+
+   private:
+    void unmap() {
+        if (data_) munmap(const_cast<char *>(data_), size_);
+        data_ = nullptr;
+    }
+
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    ResultFileHeader header_;
+    std::vector<ResultBatch> batches_;
+};
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <immintrin.h>
+#include <omp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Cache-blocked SGEMM used by the ground truth tools. It computes
+//     C[i + j * ldC] = alpha * dot(A[i, :], B[j, :]) + beta * C[i + j * ldC]
+//                      + row_bias[i] + col_bias[j]
+// where A (M x K) and B (N x K) are row-major and C is column-major, i.e. the
+// layout produced by the old manual_sgemm_dot_product_rows. Blocking follows
+// the usual GotoBLAS scheme: B panels are packed once per (jc, pc) block and
+// shared by all threads, A blocks are packed per thread to stay in L2, and an
+// MR x NR register tile is accumulated by the micro-kernel. When called from
+// inside a parallel region the routine runs on the calling thread only.
+
+struct CacheInfo {
+    size_t l1d;
+    size_t l2;
+    size_t l3;
+};
+
+inline size_t read_sysfs_cache_size(int level) {
+    for (int idx = 0; idx < 8; ++idx) {
+        std::string dir =
+            "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(idx);
+        std::ifstream level_file(dir + "/level");
+        std::ifstream type_file(dir + "/type");
+        std::ifstream size_file(dir + "/size");
+        if (!level_file.is_open() || !type_file.is_open() ||
+            !size_file.is_open())
+            continue;
+        int cur_level = 0;
+        std::string type, size;
+        level_file >> cur_level;
+        type_file >> type;
+        size_file >> size;
+        if (cur_level != level || type == "Instruction" || size.empty())
+            continue;
+        size_t value = std::stoul(size);
+        char unit = size.back();
+        if (unit == 'K') value <<= 10;
+        if (unit == 'M') value <<= 20;
+        return value;
+    }
+    return 0;
+}
+
+inline size_t detect_cache_size(int level, size_t fallback) {
+    long value = -1;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    if (level == 1) value = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    if (level == 2) value = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (level == 3) value = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+    if (value > 0) return static_cast<size_t>(value);
+    size_t sysfs_value = read_sysfs_cache_size(level);
+    return sysfs_value > 0 ? sysfs_value : fallback;
+}
+
+inline const CacheInfo &get_cache_info() {
+    static const CacheInfo info = {detect_cache_size(1, 32 << 10),
+                                   detect_cache_size(2, 1 << 20),
+                                   detect_cache_size(3, 8 << 20)};
+    return info;
+}
+
+typedef void (*SgemmKernel)(size_t kb, const float *a, const float *b,
+                            float *c, size_t ldc, float alpha, float beta,
+                            const float *row_bias, const float *col_bias);
+
+struct SgemmKernelInfo {
+    size_t mr;
+    size_t nr;
+    SgemmKernel kernel;
+    const char *name;
+};
+
+struct SgemmBlocking {
+    size_t kc;
+    size_t mc;
+    size_t nc;
+};
+
+__attribute__((target("avx2,fma"))) inline void sgemm_kernel_avx2_16x6(
+    size_t kb, const float *a, const float *b, float *c, size_t ldc,
+    float alpha, float beta, const float *row_bias, const float *col_bias) {
+    constexpr size_t MR = 16, NR = 6;
+    __m256 acc[NR][2];
+    for (size_t j = 0; j < NR; ++j) {
+        acc[j][0] = _mm256_setzero_ps();
+        acc[j][1] = _mm256_setzero_ps();
+    }
+    for (size_t p = 0; p < kb; ++p) {
+        __m256 a0 = _mm256_loadu_ps(a);
+        __m256 a1 = _mm256_loadu_ps(a + 8);
+        for (size_t j = 0; j < NR; ++j) {
+            __m256 bj = _mm256_broadcast_ss(b + j);
+            acc[j][0] = _mm256_fmadd_ps(a0, bj, acc[j][0]);
+            acc[j][1] = _mm256_fmadd_ps(a1, bj, acc[j][1]);
+        }
+        a += MR;
+        b += NR;
+    }
+
+    __m256 valpha = _mm256_set1_ps(alpha);
+    __m256 vbeta = _mm256_set1_ps(beta);
+    for (size_t j = 0; j < NR; ++j) {
+        float *col = c + j * ldc;
+        for (size_t h = 0; h < 2; ++h) {
+            __m256 v = _mm256_mul_ps(valpha, acc[j][h]);
+            if (beta != 0.0f)
+                v = _mm256_fmadd_ps(vbeta, _mm256_loadu_ps(col + 8 * h), v);
+            if (row_bias != nullptr)
+                v = _mm256_add_ps(v, _mm256_loadu_ps(row_bias + 8 * h));
+            if (col_bias != nullptr)
+                v = _mm256_add_ps(v, _mm256_set1_ps(col_bias[j]));
+            _mm256_storeu_ps(col + 8 * h, v);
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) inline void sgemm_kernel_avx512_32x12(
+    size_t kb, const float *a, const float *b, float *c, size_t ldc,
+    float alpha, float beta, const float *row_bias, const float *col_bias) {
+    constexpr size_t MR = 32, NR = 12;
+    __m512 acc[NR][2];
+    for (size_t j = 0; j < NR; ++j) {
+        acc[j][0] = _mm512_setzero_ps();
+        acc[j][1] = _mm512_setzero_ps();
+    }
+    for (size_t p = 0; p < kb; ++p) {
+        __m512 a0 = _mm512_loadu_ps(a);
+        __m512 a1 = _mm512_loadu_ps(a + 16);
+        for (size_t j = 0; j < NR; ++j) {
+            __m512 bj = _mm512_set1_ps(b[j]);
+            acc[j][0] = _mm512_fmadd_ps(a0, bj, acc[j][0]);
+            acc[j][1] = _mm512_fmadd_ps(a1, bj, acc[j][1]);
+        }
+        a += MR;
+        b += NR;
+    }
+
+    __m512 valpha = _mm512_set1_ps(alpha);
+    __m512 vbeta = _mm512_set1_ps(beta);
+    for (size_t j = 0; j < NR; ++j) {
+        float *col = c + j * ldc;
+        for (size_t h = 0; h < 2; ++h) {
+            __m512 v = _mm512_mul_ps(valpha, acc[j][h]);
+            if (beta != 0.0f)
+                v = _mm512_fmadd_ps(vbeta, _mm512_loadu_ps(col + 16 * h), v);
+            if (row_bias != nullptr)
+                v = _mm512_add_ps(v, _mm512_loadu_ps(row_bias + 16 * h));
+            if (col_bias != nullptr)
+                v = _mm512_add_ps(v, _mm512_set1_ps(col_bias[j]));
+            _mm512_storeu_ps(col + 16 * h, v);
+        }
+    }
+}
+
+inline const SgemmKernelInfo &get_sgemm_kernel() {
+    static const SgemmKernelInfo info =
+        __builtin_cpu_supports("avx512f")
+            ? SgemmKernelInfo{32, 12, sgemm_kernel_avx512_32x12, "avx512"}
+            : SgemmKernelInfo{16, 6, sgemm_kernel_avx2_16x6, "avx2"};
+    return info;
+}
+
+inline size_t ceil_div(size_t numerator, size_t denominator) {
+    return (numerator + denominator - 1) / denominator;
+}
+
+inline size_t round_down_to(size_t value, size_t multiple) {
+    return std::max(multiple, value / multiple * multiple);
+}
+
+// Picks kc so that one A and one B micro-panel share half of L1, mc so that
+// the packed A block takes half of L2 and nc so that the shared packed B
+// block takes half of L3.
+inline SgemmBlocking get_sgemm_blocking(const SgemmKernelInfo &kinfo,
+                                        size_t K) {
+    const CacheInfo &cache = get_cache_info();
+    SgemmBlocking blk;
+    blk.kc = cache.l1d / 2 / ((kinfo.mr + kinfo.nr) * sizeof(float));
+    blk.kc = std::min(K, std::max<size_t>(blk.kc / 8 * 8, 64));
+    blk.kc = std::max<size_t>(blk.kc, 1);
+    blk.mc = round_down_to(cache.l2 / 2 / (blk.kc * sizeof(float)), kinfo.mr);
+    blk.nc = round_down_to(cache.l3 / 2 / (blk.kc * sizeof(float)), kinfo.nr);
+    return blk;
+}
+
+// Packs rows [0, rows) x cols [0, kb) of a row-major matrix into panels of
+// `width` rows stored k-major, zero-padding the last panel.
+inline void sgemm_pack_panels(const float *src, size_t ld, size_t rows,
+                              size_t kb, size_t width, float *dst) {
+    for (size_t r = 0; r < rows; r += width) {
+        size_t w = std::min(width, rows - r);
+        float *panel = dst + r * kb;
+        for (size_t i = 0; i < w; ++i) {
+            const float *row = src + (r + i) * ld;
+            for (size_t p = 0; p < kb; ++p) panel[p * width + i] = row[p];
+        }
+        for (size_t i = w; i < width; ++i)
+            for (size_t p = 0; p < kb; ++p) panel[p * width + i] = 0.0f;
+    }
+}
+
+inline void sgemm_dot_product_rows(size_t M, size_t N, size_t K, float alpha,
+                                   const float *A, size_t ldA, const float *B,
+                                   size_t ldB, float beta, float *C,
+                                   size_t ldC, const float *row_bias = nullptr,
+                                   const float *col_bias = nullptr) {
+    if (M == 0 || N == 0) return;
+    const SgemmKernelInfo &kinfo = get_sgemm_kernel();
+    const size_t MR = kinfo.mr, NR = kinfo.nr;
+    const SgemmBlocking blk = get_sgemm_blocking(kinfo, K);
+
+    size_t max_nb = std::min(blk.nc, ceil_div(N, NR) * NR);
+    std::vector<float> b_pack(max_nb * blk.kc);
+
+    for (size_t jc = 0; jc < N; jc += blk.nc) {
+        size_t nb = std::min(blk.nc, N - jc);
+        size_t num_pc = K == 0 ? 1 : ceil_div(K, blk.kc);
+        for (size_t pb = 0; pb < num_pc; ++pb) {
+            size_t pc = pb * blk.kc;
+            size_t kb = std::min(blk.kc, K - pc);
+            bool first = (pb == 0), last = (pb + 1 == num_pc);
+            float beta_eff = first ? beta : 1.0f;
+
+#pragma omp parallel for schedule(static) if (!omp_in_parallel())
+            for (int64_t r = 0; r < (int64_t)ceil_div(nb, NR); ++r) {
+                size_t rows = std::min(NR, nb - r * NR);
+                sgemm_pack_panels(B + (jc + r * NR) * ldB + pc, ldB, rows, kb,
+                                  NR, b_pack.data() + r * NR * kb);
+            }
+
+#pragma omp parallel if (!omp_in_parallel())
+            {
+                std::vector<float> a_pack(blk.mc * kb);
+                std::vector<float> tile(MR * NR);
+#pragma omp for schedule(dynamic, 1)
+                for (int64_t ib = 0; ib < (int64_t)ceil_div(M, blk.mc);
+                     ++ib) {
+                    size_t ic = ib * blk.mc;
+                    size_t mb = std::min(blk.mc, M - ic);
+                    sgemm_pack_panels(A + ic * ldA + pc, ldA, mb, kb, MR,
+                                      a_pack.data());
+
+                    for (size_t jr = 0; jr < nb; jr += NR) {
+                        size_t n_rem = std::min(NR, nb - jr);
+                        const float *bp = b_pack.data() + jr * kb;
+                        const float *cb =
+                            (last && col_bias) ? col_bias + jc + jr : nullptr;
+                        for (size_t ir = 0; ir < mb; ir += MR) {
+                            size_t m_rem = std::min(MR, mb - ir);
+                            const float *ap = a_pack.data() + ir * kb;
+                            const float *rb = (last && row_bias)
+                                                  ? row_bias + ic + ir
+                                                  : nullptr;
+                            float *cp = C + (ic + ir) + (jc + jr) * ldC;
+                            if (m_rem == MR && n_rem == NR) {
+                                kinfo.kernel(kb, ap, bp, cp, ldC, alpha,
+                                             beta_eff, rb, cb);
+                                continue;
+                            }
+                            // Edge tile: compute into a scratch tile and
+                            // apply the epilogue to the valid part only.
+                            kinfo.kernel(kb, ap, bp, tile.data(), MR, alpha,
+                                         0.0f, nullptr, nullptr);
+                            for (size_t j = 0; j < n_rem; ++j) {
+                                for (size_t i = 0; i < m_rem; ++i) {
+                                    float v = tile[i + j * MR];
+                                    if (beta_eff != 0.0f)
+                                        v += beta_eff * cp[i + j * ldC];
+                                    if (rb) v += rb[i];
+                                    if (cb) v += cb[j];
+                                    cp[i + j * ldC] = v;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,119 @@
+// compute_incr_gt over vectors with negative, non-integer components: under
+// ip and cosine every stage must match a brute-force top-k of the raw data.
+// Usage: incr_gt_signed_test COMPUTE_INCR_GT SCRATCH_DIR
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define CHECK(cond)                                                    \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, \
+                         __LINE__, #cond);                             \
+            std::exit(1);                                              \
+        }                                                              \
+    } while (0)
+
+typedef std::vector<std::vector<float>> Vecs;
+
+Vecs random_vecs(size_t n, int dim, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+    Vecs v(n, std::vector<float>(dim));
+    for (auto &x : v)
+        for (float &c : x) c = u(rng);
+    return v;
+}
+
+void write_fvecs(const std::string &path, const Vecs &v) {
+    std::ofstream out(path, std::ios::binary);
+    CHECK(out.is_open());
+    for (const auto &x : v) {
+        int dim = static_cast<int>(x.size());
+        out.write(reinterpret_cast<const char *>(&dim), sizeof(int));
+        out.write(reinterpret_cast<const char *>(x.data()),
+                  dim * sizeof(float));
+    }
+}
+
+float neg_ip(const std::vector<float> &a, const std::vector<float> &b,
+             bool cosine) {
+    double dot = 0, na = 0, nb = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        dot += a[i] * b[i];
+        na += a[i] * a[i];
+        nb += b[i] * b[i];
+    }
+    return static_cast<float>(cosine ? -dot / std::sqrt(na * nb) : -dot);
+}
+
+void check_metric(const std::string &tool, const std::string &dir,
+                  const std::string &metric, const Vecs &base,
+                  const Vecs &queries, int k, int inc) {
+    std::string gt = dir + "/signed_" + metric + ".gt";
+    std::string cmd = tool + " --base_path " + dir + "/signed_base.fvecs" +
+                      " --query_path " + dir + "/signed_query.fvecs" +
+                      " --k " + std::to_string(k) + " --inc " +
+                      std::to_string(inc) + " --threads 2 --metric " +
+                      metric + " --batch_gt_path " + gt + " > /dev/null";
+    CHECK(std::system(cmd.c_str()) == 0);
+
+    std::ifstream in(gt, std::ios::binary);
+    CHECK(in.is_open());
+    int n = 0, gt_k = 0, stages = 0;
+    in.read(reinterpret_cast<char *>(&n), sizeof(int));
+    in.read(reinterpret_cast<char *>(&gt_k), sizeof(int));
+    in.read(reinterpret_cast<char *>(&stages), sizeof(int));
+    CHECK(n == static_cast<int>(queries.size()) && gt_k == k);
+    CHECK(stages == static_cast<int>(base.size()) / inc);
+
+    bool cosine = metric == "cosine";
+    for (int s = 0; s < stages; ++s) {
+        int size = 0;
+        in.read(reinterpret_cast<char *>(&size), sizeof(int));
+        CHECK(size == (s + 1) * inc);
+        size_t count = std::min(k, size);
+        std::vector<int> ids(n * count);
+        std::vector<float> dists(n * count);
+        in.read(reinterpret_cast<char *>(ids.data()), ids.size() * sizeof(int));
+        in.read(reinterpret_cast<char *>(dists.data()),
+                dists.size() * sizeof(float));
+        CHECK(in.good());
+
+        for (int q = 0; q < n; ++q) {
+            std::vector<std::pair<float, int>> all;
+            for (int i = 0; i < size; ++i)
+                all.emplace_back(neg_ip(queries[q], base[i], cosine), i);
+            std::sort(all.begin(), all.end());
+            for (size_t j = 0; j < count; ++j) {
+                CHECK(ids[q * count + j] == all[j].second);
+                CHECK(std::fabs(dists[q * count + j] - all[j].first) < 1e-4f);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    CHECK(argc == 3);
+    std::string tool = argv[1], dir = argv[2];
+    std::mt19937 rng(7);
+    // Scaled so the raw inner products and the cosine ranking disagree.
+    Vecs base = random_vecs(300, 24, rng);
+    for (size_t i = 0; i < base.size(); ++i)
+        for (float &c : base[i]) c *= 0.5f + (i % 7);
+    Vecs queries = random_vecs(20, 24, rng);
+    write_fvecs(dir + "/signed_base.fvecs", base);
+    write_fvecs(dir + "/signed_query.fvecs", queries);
+
+    check_metric(tool, dir, "ip", base, queries, 10, 50);
+    check_metric(tool, dir, "cosine", base, queries, 10, 50);
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Fixed-capacity k-nearest buffer shared by the ground truth tools. Entries
+// are kept sorted by (distance, id), like a max-heap keyed on that pair, so
+// the contents do not depend on the order candidates arrive in: a candidate
+// tying the k-th distance only enters with a smaller id.
+//
+// push_block() compares 8 (AVX2) or 16 (AVX-512) candidates at a time
+// against the current k-th distance and only sends survivors to insert(), so
+// once the buffer is warm almost every candidate costs one vector compare.
+template <typename IdT>
+class TopKBuffer {
+   public:
+    explicit TopKBuffer(size_t k = 0) { reset(k); }
+
+    void reset(size_t k) {
+        k_ = k;
+        ids_.assign(k, IdT());
+        dists_.assign(k, std::numeric_limits<float>::max());
+        clear();
+    }
+
+    void clear() {
+        size_ = 0;
+        threshold_ = std::numeric_limits<float>::infinity();
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return k_; }
+    bool full() const { return size_ == k_; }
+    // Distance a candidate has to beat (or tie with a smaller id) to enter.
+    float threshold() const { return threshold_; }
+
+    const IdT *ids() const { return ids_.data(); }
+    const float *dists() const { return dists_.data(); }
+
+    bool insert(IdT id, float dist) {
+        if (k_ == 0 || !(dist <= threshold_)) return false;
+        if (dist == threshold_ && (size_ < k_ || !(id < ids_[k_ - 1])))
+            return false;
+        size_t pos = std::upper_bound(dists_.begin(), dists_.begin() + size_,
+                                      dist) -
+                     dists_.begin();
+        while (pos > 0 && dists_[pos - 1] == dist && id < ids_[pos - 1]) --pos;
+        size_t last = size_ < k_ ? size_ : k_ - 1;
+        for (size_t i = last; i > pos; --i) {
+            ids_[i] = ids_[i - 1];
+            dists_[i] = dists_[i - 1];
+        }
+        ids_[pos] = id;
+        dists_[pos] = dist;
+        if (size_ < k_) size_++;
+        if (size_ == k_) threshold_ = dists_[k_ - 1];
+        return true;
+    }
+
+    // Offers dists[0, n) with ids id_base + i.
+    void push_block(const float *dists, size_t n, IdT id_base) {
+        if (k_ == 0) return;
+        size_t i = 0;
+        for (; i < n && size_ < k_; ++i) insert(id_base + (IdT)i, dists[i]);
+        if (i < n) i = simd_filter()(this, dists, n, id_base, i);
+        for (; i < n; ++i) insert(id_base + (IdT)i, dists[i]);
+    }
+
+    // Offers dists[0, n) with ids ids[i], for blocks whose ids are not
+    // consecutive.
+    void push_indexed(const float *dists, size_t n, const IdT *ids) {
+        for (size_t i = 0; i < n; ++i)
+            if (dists[i] <= threshold_) insert(ids[i], dists[i]);
+    }
+
+    // Merges another buffer's entries into this one.
+    void merge(const TopKBuffer &other) {
+        for (size_t i = 0; i < other.size_; ++i)
+            if (!insert(other.ids_[i], other.dists_[i])) break;
+    }
+
+    // Drops every entry whose id satisfies pred, keeping the rest in order.
+    // Returns the number of entries removed.
+    template <typename Pred>
+    size_t remove_if(Pred pred) {
+        size_t kept = 0;
+        for (size_t i = 0; i < size_; ++i) {
+            if (pred(ids_[i])) continue;
+            ids_[kept] = ids_[i];
+            dists_[kept] = dists_[i];
+            ++kept;
+        }
+        size_t removed = size_ - kept;
+        size_ = kept;
+        if (removed) threshold_ = std::numeric_limits<float>::infinity();
+        return removed;
+    }
+
+   private:
+    typedef size_t (*FilterFn)(TopKBuffer *, const float *, size_t, IdT,
+                               size_t);
+
+    __attribute__((target("avx2"))) static size_t filter_avx2(
+        TopKBuffer *self, const float *dists, size_t n, IdT id_base,
+        size_t i) {
+        for (; i + 8 <= n; i += 8) {
+            __m256 v = _mm256_loadu_ps(dists + i);
+            __m256 thr = _mm256_set1_ps(self->threshold_);
+            unsigned mask = (unsigned)_mm256_movemask_ps(
+                _mm256_cmp_ps(v, thr, _CMP_LE_OQ));
+            while (mask) {
+                unsigned b = __builtin_ctz(mask);
+                self->insert(id_base + (IdT)(i + b), dists[i + b]);
+                mask &= mask - 1;
+            }
+        }
+        return i;
+    }
+
+    __attribute__((target("avx512f"))) static size_t filter_avx512(
+        TopKBuffer *self, const float *dists, size_t n, IdT id_base,
+        size_t i) {
+        for (; i + 16 <= n; i += 16) {
+            __m512 v = _mm512_loadu_ps(dists + i);
+            __m512 thr = _mm512_set1_ps(self->threshold_);
+            unsigned mask =
+                (unsigned)_mm512_cmp_ps_mask(v, thr, _CMP_LE_OQ);
+            while (mask) {
+                unsigned b = __builtin_ctz(mask);
+                self->insert(id_base + (IdT)(i + b), dists[i + b]);
+                mask &= mask - 1;
+            }
+        }
+        return i;
+    }
+
+    static FilterFn simd_filter() {
+        static const FilterFn fn =
+            __builtin_cpu_supports("avx512f") ? filter_avx512 : filter_avx2;
+        return fn;
+    }
+
+    size_t k_;
+    size_t size_;
+    float threshold_;
+    std::vector<IdT> ids_;
+    std::vector<float> dists_;
+};
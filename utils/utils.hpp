@@ -6,12 +6,17 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "gt_format.hpp"
+#include "result_format.hpp"
+
 template <typename TagT>
 struct SearchResult {
     size_t insert_offset;
@@ -91,10 +96,35 @@ struct Stat {
               std::to_string(threads) + ".res") {}
 };
 
+// Reads search results from either a binary .sres file or the older text
+// format of "batch <offset>" headers followed by query/tags line pairs.
 void read_results(std::vector<SearchResult<uint32_t>> &res,
                   const std::string &res_path) {
     res.clear();
 
+    if (is_result_file(res_path)) {
+        ResultReader reader(res_path);
+        size_t k = reader.k();
+        res.reserve(reader.num_results());
+        for (const ResultBatch &batch : reader.batches()) {
+            for (size_t i = 0; i < batch.count; ++i) {
+                const uint32_t *row = batch.tags + i * k;
+                size_t len = std::find(row, row + k, kResultEmpty) - row;
+                std::vector<uint32_t> tags(row, row + len);
+                if (batch.dists)
+                    res.emplace_back(batch.insert_offset, batch.query_idx[i],
+                                     tags,
+                                     std::vector<float>(batch.dists + i * k,
+                                                        batch.dists + i * k +
+                                                            len));
+                else
+                    res.emplace_back(batch.insert_offset, batch.query_idx[i],
+                                     tags);
+            }
+        }
+        return;
+    }
+
     std::ifstream in_file(res_path);
     if (!in_file.is_open()) {
         throw std::runtime_error("Unable to open file: " + res_path);
@@ -148,105 +178,300 @@ void read_results(std::vector<SearchResult<uint32_t>> &res,
     in_file.close();
 }
 
+// Writes res as a binary .sres file (see result_format.hpp), one batch per
+// insert offset. Rows are padded to the longest tag list, and distances are
+// kept when any result carries them.
 void write_results(std::vector<SearchResult<uint32_t>> &res,
                    const std::string &res_path) {
-    std::sort(
+    std::stable_sort(
         res.begin(), res.end(),
         [](const SearchResult<uint32_t> &a, const SearchResult<uint32_t> &b) {
             return a.insert_offset < b.insert_offset;
         });
 
-    std::ofstream out_file(res_path);
-    if (!out_file.is_open()) {
-        throw std::runtime_error("Unable to open file: " + res_path);
+    size_t k = 0;
+    bool with_distances = false;
+    for (const auto &result : res) {
+        k = std::max(k, result.tags.size());
+        with_distances |= !result.distances.empty();
     }
 
-    size_t current_offset = res.empty() ? 0 : res[0].insert_offset;
-    bool first_batch = true;
+    ResultWriter writer(res_path, (uint32_t)k, with_distances);
+    std::vector<uint32_t> query_idx, tags;
+    std::vector<float> dists;
+    for (size_t begin = 0, end; begin < res.size(); begin = end) {
+        for (end = begin; end < res.size() &&
+                          res[end].insert_offset == res[begin].insert_offset;
+             ++end) {
+        }
+        size_t count = end - begin;
+        query_idx.resize(count);
+        tags.assign(count * k, kResultEmpty);
+        dists.assign(with_distances ? count * k : 0,
+                     std::numeric_limits<float>::infinity());
+        for (size_t i = 0; i < count; ++i) {
+            const auto &result = res[begin + i];
+            query_idx[i] = (uint32_t)result.query_idx;
+            std::copy(result.tags.begin(), result.tags.end(),
+                      tags.begin() + i * k);
+            if (with_distances)
+                std::copy(result.distances.begin(),
+                          result.distances.begin() +
+                              std::min(result.distances.size(), k),
+                          dists.begin() + i * k);
+        }
+        writer.write_batch(res[begin].insert_offset, (uint32_t)count,
+                           query_idx.data(), tags.data(),
+                           with_distances ? dists.data() : nullptr);
+    }
+    writer.close();
+}
 
-    for (const auto &result : res) {
-        if (result.insert_offset != current_offset) {
-            current_offset = result.insert_offset;
-            out_file << "\nbatch " << current_offset << "\n";
-        } else if (first_batch) {
-            out_file << "batch " << current_offset << "\n";
-            first_batch = false;
+// One stage of stagewise ground truth. Rows are laid out [query][k] with the
+// nearest neighbor first; sizes[q] is the number of valid entries of query q,
+// or -1 when the stage has no ground truth for it (sparse files only).
+struct GTStage {
+    size_t base_size = 0;
+    int n = 0;
+    int k = 0;
+    std::vector<uint32_t> ids;
+    std::vector<float> distances;
+    std::vector<int> sizes;
+};
+
+// Reads stagewise ground truth one stage at a time from the full per-stage
+// format, the delta-encoded one or the sparse one of traced runs (see
+// gt_format.hpp), so a caller only ever holds a single stage. Full and delta
+// files yield stages in file order; sparse files are regrouped by base size.
+// When base_sizes is given, other stages are skipped without being decoded.
+class GTStageStream {
+   public:
+    explicit GTStageStream(const std::string &gt_path,
+                           const std::set<size_t> *base_sizes = nullptr)
+        : path_(gt_path), base_sizes_(base_sizes) {
+        if (is_sparse_gt_file(gt_path)) {
+            open_sparse();
+        } else if (is_delta_gt_file(gt_path)) {
+            delta_.reset(new DeltaGTReader(gt_path));
+            n_ = delta_->num_queries();
+            k_ = delta_->k();
+            num_stages_ = delta_->num_stages();
+        } else {
+            open_full();
         }
+    }
+
+    int num_queries() const { return n_; }
+    int k() const { return k_; }
+    // Stages in the file; for sparse files, the distinct base sizes.
+    size_t num_stages() const { return num_stages_; }
+    const char *format_name() const {
+        return delta_ ? "delta-encoded" : sparse_ ? "sparse" : "full";
+    }
+
+    // Reads the next wanted stage into stage; false once the file is done.
+    bool next(GTStage &stage) {
+        if (sparse_) return next_sparse(stage);
+        while (next_stage_ < num_stages_) {
+            int batch_idx = (int)next_stage_++;
+            if (delta_) {
+                int base_size = delta_->base_size(batch_idx);
+                if (!wanted(base_size)) continue;
+                int count;
+                delta_->read_stage(batch_idx, stage.ids, stage.distances,
+                                   count);
+                fill_header(stage, base_size, count);
+                return true;
+            }
 
-        out_file << result.query_idx << "\n";
+            int base_size;
+            in_.read(reinterpret_cast<char *>(&base_size), sizeof(int));
+            if (!in_.good()) {
+                throw std::runtime_error("Failed to read base size for batch " +
+                                         std::to_string(batch_idx));
+            }
+
+            // Stages smaller than k hold only their base_size points per
+            // query.
+            int count = std::min(k_, base_size);
+            if (!wanted(base_size)) {
+                in_.seekg((std::streamoff)n_ * count *
+                              (sizeof(int) + sizeof(float)),
+                          std::ios::cur);
+                continue;
+            }
 
-        for (size_t i = 0; i < result.tags.size(); ++i) {
-            out_file << result.tags[i];
-            if (i < result.tags.size() - 1) {
-                out_file << " ";
+            stage.ids.resize((size_t)n_ * count);
+            in_.read(reinterpret_cast<char *>(stage.ids.data()),
+                     stage.ids.size() * sizeof(int));
+            if (!in_.good()) {
+                throw std::runtime_error("Failed to read indices for batch " +
+                                         std::to_string(batch_idx));
             }
+            stage.distances.resize((size_t)n_ * count);
+            in_.read(reinterpret_cast<char *>(stage.distances.data()),
+                     stage.distances.size() * sizeof(float));
+            if (!in_.good()) {
+                throw std::runtime_error("Failed to read distances for batch " +
+                                         std::to_string(batch_idx));
+            }
+            fill_header(stage, base_size, count);
+            return true;
         }
-        out_file << "\n";
+        return false;
     }
 
-    out_file.close();
-}
+   private:
+    struct SparseEntry {
+        uint32_t base_size;
+        uint32_t query;
+        uint32_t count;
+        uint64_t offset;
+    };
 
-template <typename TagT = uint32_t>
-void load_gt(std::vector<SearchResult<TagT>> &gt, const std::string &gt_path) {
-    std::ifstream in(gt_path, std::ios::binary);
-    if (!in.is_open()) {
-        throw std::runtime_error("Failed to open file: " + gt_path);
+    bool wanted(size_t base_size) const {
+        return !base_sizes_ || base_sizes_->count(base_size);
     }
 
-    int n, k, b;
-    in.read(reinterpret_cast<char *>(&n), sizeof(int));
-    in.read(reinterpret_cast<char *>(&k), sizeof(int));
-    in.read(reinterpret_cast<char *>(&b), sizeof(int));
+    void fill_header(GTStage &stage, int base_size, int count) const {
+        stage.base_size = base_size;
+        stage.n = n_;
+        stage.k = count;
+        stage.sizes.assign(n_, count);
+    }
 
-    if (n <= 0 || k <= 0 || b <= 0) {
-        throw std::runtime_error(
-            "Invalid file header: n, k, or b is non-positive");
+    void open_full() {
+        in_.open(path_, std::ios::binary);
+        if (!in_.is_open()) {
+            throw std::runtime_error("Failed to open file: " + path_);
+        }
+        int b;
+        in_.read(reinterpret_cast<char *>(&n_), sizeof(int));
+        in_.read(reinterpret_cast<char *>(&k_), sizeof(int));
+        in_.read(reinterpret_cast<char *>(&b), sizeof(int));
+        if (!in_.good() || n_ <= 0 || k_ <= 0 || b <= 0) {
+            throw std::runtime_error(
+                "Invalid file header: n, k, or b is non-positive");
+        }
+        num_stages_ = b;
     }
 
-    gt.clear();
-    gt.reserve(n * b);
-
-    for (int batch_idx = 0; batch_idx < b; ++batch_idx) {
-        int current_base_size;
-        in.read(reinterpret_cast<char *>(&current_base_size), sizeof(int));
-        if (!in.good()) {
-            throw std::runtime_error("Failed to read base size for batch " +
-                                     std::to_string(batch_idx));
+    // Sparse entries are grouped by query, so the stream first indexes them
+    // and then visits the wanted ones by (base_size, query).
+    void open_sparse() {
+        sparse_ = true;
+        in_.open(path_, std::ios::binary);
+        if (!in_.is_open()) {
+            throw std::runtime_error("Failed to open file: " + path_);
+        }
+        in_.exceptions(std::ios::failbit | std::ios::badbit);
+
+        uint32_t magic, version;
+        uint64_t num_entries;
+        int32_t reserved;
+        in_.read(reinterpret_cast<char *>(&magic), sizeof(uint32_t));
+        in_.read(reinterpret_cast<char *>(&version), sizeof(uint32_t));
+        in_.read(reinterpret_cast<char *>(&num_entries), sizeof(uint64_t));
+        in_.read(reinterpret_cast<char *>(&k_), sizeof(int32_t));
+        in_.read(reinterpret_cast<char *>(&reserved), sizeof(int32_t));
+        if (version != kSparseGTVersion || k_ <= 0) {
+            throw std::runtime_error("Invalid sparse GT header: " + path_);
         }
 
-        std::vector<int> indices(n * k);
-        in.read(reinterpret_cast<char *>(indices.data()), n * k * sizeof(int));
-        if (!in.good()) {
-            throw std::runtime_error("Failed to read indices for batch " +
-                                     std::to_string(batch_idx));
+        uint64_t offset = 2 * sizeof(uint32_t) + sizeof(uint64_t) +
+                          2 * sizeof(int32_t);
+        for (uint64_t e = 0; e < num_entries; ++e) {
+            uint32_t head[3];  // query, base_size, count
+            in_.read(reinterpret_cast<char *>(head), sizeof(head));
+            if (head[2] > (uint32_t)k_) {
+                throw std::runtime_error("Invalid sparse GT entry " +
+                                         std::to_string(e) + " in " + path_);
+            }
+            offset += sizeof(head);
+            n_ = std::max(n_, (int)head[0] + 1);
+            if (wanted(head[1]))
+                entries_.push_back(
+                    SparseEntry{head[1], head[0], head[2], offset});
+            offset += head[2] * (sizeof(int32_t) + sizeof(float));
+            in_.seekg(offset, std::ios::beg);
         }
+        std::sort(entries_.begin(), entries_.end(),
+                  [](const SparseEntry &a, const SparseEntry &b) {
+                      return a.base_size != b.base_size
+                                 ? a.base_size < b.base_size
+                                 : a.query < b.query;
+                  });
+        for (size_t i = 0; i < entries_.size(); ++i)
+            if (i == 0 || entries_[i].base_size != entries_[i - 1].base_size)
+                num_stages_++;
+    }
 
-        std::vector<float> distances(n * k);
-        in.read(reinterpret_cast<char *>(distances.data()),
-                n * k * sizeof(float));
-        if (!in.good()) {
-            throw std::runtime_error("Failed to read distances for batch " +
-                                     std::to_string(batch_idx));
+    bool next_sparse(GTStage &stage) {
+        if (next_entry_ == entries_.size()) return false;
+        uint32_t base_size = entries_[next_entry_].base_size;
+        stage.base_size = base_size;
+        stage.n = n_;
+        stage.k = k_;
+        stage.ids.assign((size_t)n_ * k_, 0);
+        stage.distances.assign((size_t)n_ * k_, 0.0f);
+        stage.sizes.assign(n_, -1);
+        for (; next_entry_ < entries_.size() &&
+               entries_[next_entry_].base_size == base_size;
+             ++next_entry_) {
+            const SparseEntry &e = entries_[next_entry_];
+            in_.seekg(e.offset, std::ios::beg);
+            in_.read(reinterpret_cast<char *>(stage.ids.data() +
+                                              (size_t)e.query * k_),
+                     e.count * sizeof(uint32_t));
+            in_.read(reinterpret_cast<char *>(stage.distances.data() +
+                                              (size_t)e.query * k_),
+                     e.count * sizeof(float));
+            stage.sizes[e.query] = (int)e.count;
         }
+        return true;
+    }
 
-        for (int query_idx = 0; query_idx < n; ++query_idx) {
-            std::vector<TagT> tags(k);
-            std::vector<float> query_distances;
-            for (int j = 0; j < k; ++j) {
-                size_t offset = query_idx * k + j;
-                tags[j] = indices[offset];
-                query_distances.push_back(distances[offset]);
-            }
-            gt.emplace_back(current_base_size, query_idx, tags,
+    std::string path_;
+    const std::set<size_t> *base_sizes_;
+    std::ifstream in_;
+    std::unique_ptr<DeltaGTReader> delta_;
+    bool sparse_ = false;
+    int n_ = 0;
+    int k_ = 0;
+    size_t num_stages_ = 0;
+    size_t next_stage_ = 0;
+    std::vector<SparseEntry> entries_;
+    size_t next_entry_ = 0;
+};
+
+// Loads stagewise ground truth in any format GTStageStream reads. When
+// base_sizes is given, only stages with those base sizes are materialized; the
+// delta reader then seeks to the nearest keyframe instead of decoding the
+// whole file.
+template <typename TagT = uint32_t>
+void load_gt(std::vector<SearchResult<TagT>> &gt, const std::string &gt_path,
+             const std::set<size_t> *base_sizes = nullptr) {
+    gt.clear();
+    GTStageStream stream(gt_path, base_sizes);
+    GTStage stage;
+    while (stream.next(stage)) {
+        for (int query_idx = 0; query_idx < stage.n; ++query_idx) {
+            if (stage.sizes[query_idx] < 0) continue;
+            size_t offset = (size_t)query_idx * stage.k;
+            size_t count = stage.sizes[query_idx];
+            std::vector<TagT> tags(stage.ids.begin() + offset,
+                                   stage.ids.begin() + offset + count);
+            std::vector<float> query_distances(
+                stage.distances.begin() + offset,
+                stage.distances.begin() + offset + count);
+            gt.emplace_back(stage.base_size, query_idx, tags,
                             query_distances);
         }
     }
-
-    in.close();
     std::cout << "Loaded " << gt.size() << " search results from " << gt_path
-              << " (queries: " << n << ", k: " << k << ", batches: " << b << ")"
-              << std::endl;
+              << " (queries: " << stream.num_queries()
+              << ", k: " << stream.k() << ", batches: " << stream.num_stages()
+              << ", " << stream.format_name() << ")" << std::endl;
 }
 
 template <typename T>
@@ -373,36 +598,3 @@ void save_stat(Stat &stat, std::string stat_path) {
     file << ss.str() << "\n";
     file.close();
 }
-
-double calculate_recall(uint32_t num_queries, uint32_t *gold_std,
-                        float *gs_dist, uint32_t dim_gs, uint32_t *our_results,
-                        uint32_t dim_or, uint32_t recall_at) {
-    double total_recall = 0;
-    std::set<uint32_t> gt, res;
-
-    for (size_t i = 0; i < num_queries; i++) {
-        gt.clear();
-        res.clear();
-        uint32_t *gt_vec = gold_std + dim_gs * i;
-        uint32_t *res_vec = our_results + dim_or * i;
-        size_t tie_breaker = recall_at;
-        if (gs_dist != nullptr) {
-            tie_breaker = recall_at - 1;
-            float *gt_dist_vec = gs_dist + dim_gs * i;
-            while (tie_breaker < dim_gs &&
-                   gt_dist_vec[tie_breaker] == gt_dist_vec[recall_at - 1])
-                tie_breaker++;
-        }
-
-        gt.insert(gt_vec, gt_vec + tie_breaker);
-        res.insert(res_vec, res_vec + recall_at);
-        uint32_t cur_recall = 0;
-        for (auto &v : gt) {
-            if (res.find(v) != res.end()) {
-                cur_recall++;
-            }
-        }
-        total_recall += cur_recall;
-    }
-    return total_recall / num_queries * (100.0 / recall_at);
-}
\ No newline at end of file